@@ -0,0 +1,67 @@
+#pragma once
+
+#include "CRtspSession.h"
+
+#ifndef ARDUINO_ARCH_ESP32
+
+#define RTSP_SERVER_MAX_EVENTS 64
+#define RTSP_SERVER_STALL_MSEC 5000 // a client that takes none of its queued output for this long is closed
+
+// Event driven RTSP server for POSIX hosts: one thread serves the listening socket, every session's
+// RTSP and RTCP sockets through epoll, and sends frames from a timer. Subclasses provide the streamers.
+// Client sockets don't block: what a client can't take yet waits in its queue, and it misses frames
+// until that is sent.
+class CRtspServer
+{
+public:
+    CRtspServer(u_short port, uint32_t msecPerFrame, int maxSessions = 256);
+    virtual ~CRtspServer();
+
+    bool    Start();                 // listen and set up epoll and the frame timer, false on error
+    void    Run();                   // serve until Stop()
+    bool    Step(int timeoutMs);     // one round of events, for callers that have their own loop
+    void    Stop() { m_Running = false; }
+
+    // Optional streamer shared by all multicast sessions, owned by the caller
+    void    SetMulticastStreamer(CStreamer *aStreamer) { m_MulticastStreamer = aStreamer; aStreamer->SetFrameRate(1000 / m_MsecPerFrame); }
+    int     GetSessionCount() { return m_SessionCount; }
+    uint32_t GetDroppedFrames() { return m_DroppedFrames; } // frames not sent to clients still sending the previous ones
+
+protected:
+    virtual CStreamer *NewStreamer(SOCKET aClient) = 0; // streamer for a new RTSP client, deleted with its session
+
+private:
+    struct Slot
+    {
+        CRtspSession *session;
+        CStreamer    *streamer;
+        SOCKET        client;
+        UDPSOCKET     rtcpSocket;   // registered with epoll once SETUP created it
+        bool          writeWatched; // waiting for EPOLLOUT to send queued output
+        uint32_t      stalledMsec;  // msecnow() when the client last took output while some was queued
+    };
+
+    void   Accept();
+    void   ServeSession(int idx);
+    void   CloseSession(int idx);
+    void   FlushSession(int idx);
+    bool   WatchOutput(int idx);
+    void   Tick();
+    bool   Watch(int fd, uint64_t tag);
+
+    u_short  m_Port;
+    uint32_t m_MsecPerFrame;
+    int      m_MaxSessions;
+    int      m_SessionCount;
+    uint32_t m_DroppedFrames;
+    Slot    *m_Slots;
+    CStreamer *m_MulticastStreamer;
+    UDPSOCKET  m_MulticastRtcp;   // registered RTCP socket of the multicast streamer
+
+    int  m_ListenSocket;
+    int  m_Epoll;
+    int  m_Timer;
+    bool m_Running;
+};
+
+#endif
@@ -1,30 +1,39 @@
 #pragma once
 
 #include "CStreamer.h"
+#include "RtspParser.h"
 #include "platglue.h"
 
-// supported command types
-enum RTSP_CMD_TYPES
+#define RTSP_RECV_BUFFER_SIZE  1024     // longest request we take, with any interleaved RTCP ahead of it
+#define RTSP_RESPONSE_SIZE     1024     // longest response, a DESCRIBE with its SDP
+#define RTSP_SDP_BODY_SIZE     256
+#define RTSP_MAX_PROFILES      4        // mjpeg/<profile name>
+#define RTSP_MULTICAST_STREAM  RTSP_MAX_PROFILES // mjpeg/multicast
+#define RTSP_STREAM_COUNT      (RTSP_MAX_PROFILES + 1)
+
+// Session description of one stream, everything after the origin line, with what it was built from
+struct RtspSdpCache
 {
-    RTSP_OPTIONS,
-    RTSP_DESCRIBE,
-    RTSP_SETUP,
-    RTSP_PLAY,
-    RTSP_TEARDOWN,
-    RTSP_UNKNOWN
+    uint32_t  sessionId;    // o= session id, 0 until first built
+    uint32_t  version;      // o= version, bumped on every rebuild
+    u_short   width;
+    u_short   height;
+    uint8_t   fps;
+    IPADDRESS group;
+    IPPORT    port;
+    uint8_t   ttl;
+    unsigned  len;
+    char      body[RTSP_SDP_BODY_SIZE];
 };
 
-#define RTSP_BUFFER_SIZE       10000    // for incoming requests, and outgoing responses
-#define RTSP_PARAM_STRING_MAX  200
-#define MAX_HOSTNAME_LEN       256
-
 class CRtspSession
 {
 public:
-    CRtspSession(SOCKET aRtspClient, CStreamer * aStreamer);
+    // aMulticastStreamer, if given, is shared with other sessions and used by clients that SETUP multicast
+    CRtspSession(SOCKET aRtspClient, CStreamer * aStreamer, CStreamer * aMulticastStreamer = NULL);
     ~CRtspSession();
 
-    RTSP_CMD_TYPES Handle_RtspRequest(char const * aRequest, unsigned aRequestSize);
+    RTSP_CMD_TYPES Handle_RtspRequest(char const * aRequest, unsigned aRequestSize); // one complete request
     int            GetStreamID();
 
     /**
@@ -35,7 +44,7 @@ public:
     bool handleRequests(uint32_t readTimeoutMs);
 
     /**
-       broadcast a current frame
+       broadcast a current frame, multicast sessions leave that to the owner of the shared streamer
      */
     void broadcastCurrentFrame(uint32_t curMsec);
 
@@ -43,9 +52,9 @@ public:
     bool m_stopped;
 
 private:
-    void Init();
-    bool ParseRtspRequest(char const * aRequest, unsigned aRequestSize);
+    RTSP_CMD_TYPES Dispatch(); // handle m_Request
     char const * DateHeader();
+    static void UpdateSdp(int aStreamID, CStreamer * aStreamer); // rebuild the cached SDP if the stream changed
 
     // RTSP request command handlers
     void Handle_RtspOPTION();
@@ -61,13 +70,16 @@ private:
     IPPORT m_ClientRTCPPort;                                 // client port for UDP based RTCP transport
     bool m_TcpTransport;                                      // if Tcp based streaming was activated
     CStreamer    * m_Streamer;                                // the UDP or TCP streamer of that session
+    CStreamer    * m_MulticastStreamer;                       // streamer shared by all multicast sessions, or NULL
+    bool m_Multicast;                                         // if the session was set up on the multicast streamer
 
-    // parameters of the last received RTSP request
+    // the request being handled, its views point into m_RecvBuf
+    RtspRequest m_Request;
+    char m_RecvBuf[RTSP_RECV_BUFFER_SIZE];                    // received bytes not handled yet
+    unsigned m_RecvLen;
+    char m_Response[RTSP_RESPONSE_SIZE];                      // responses are formatted here, one at a time
+    char m_Date[48];                                          // Date header, reformatted once a second
+    time_t m_DateTime;
 
-    RTSP_CMD_TYPES m_RtspCmdType;                             // command type (if any) of the current request
-    char m_URLPreSuffix[RTSP_PARAM_STRING_MAX];               // stream name pre suffix
-    char m_URLSuffix[RTSP_PARAM_STRING_MAX];                  // stream name suffix
-    char m_CSeq[RTSP_PARAM_STRING_MAX];                       // RTSP command sequence number
-    char m_URLHostPort[MAX_HOSTNAME_LEN];                     // host:port part of the URL
-    unsigned m_ContentLength;                                 // SDP string size
+    static RtspSdpCache s_Sdp[RTSP_STREAM_COUNT];
 };
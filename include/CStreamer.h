@@ -4,6 +4,33 @@
 
 typedef unsigned const char *BufPtr;
 
+#define RTCP_MAX_RECEIVERS 8           // receivers tracked per stream, a multicast stream has several
+#define RTCP_RECEIVER_TIMEOUT_MS 30000 // forget receivers that stopped reporting (RFC 3550 6.3.5)
+
+// How one receiver gets our stream, from its RTCP receiver reports (RFC 3550 6.4.1)
+struct RtcpReceiverStats
+{
+    uint32_t ssrc;           // the receiver's, reports are kept per receiver
+    uint32_t lastMsec;       // msecnow() of its last report
+    uint32_t reports;        // number of report blocks about our stream
+    uint8_t  fractionLost;   // packets lost since the previous report, in 1/256
+    int32_t  cumulativeLost;
+    uint32_t highestSeq;     // extended highest sequence number received
+    uint32_t jitter;         // interarrival jitter in RTP timestamp units (1/90000 s)
+    uint32_t rttMs;          // round trip time, 0 until a report refers to one of our sender reports
+};
+
+// How long RTP packets were held back by the pacer
+struct RtpPacerStats
+{
+    uint32_t packets;        // packets sent
+    uint32_t delayedPackets; // packets that had to wait for tokens
+    uint32_t unpacedPackets; // packets sent early because the shared wait budget ran out
+    uint32_t avgDelayUs;     // average wait of delayed packets
+    uint32_t maxDelayUs;
+    uint32_t frameSendUs;    // time taken to send the last frame
+};
+
 class CStreamer
 {
 public:
@@ -11,15 +38,69 @@ public:
     virtual ~CStreamer();
 
     void    InitTransport(u_short aRtpPort, u_short aRtcpPort, bool TCP);
+
+    // Send to a multicast group (RTP on aRtpPort, RTCP on the next port) instead of to a client.
+    // One such streamer serves every multicast session, so airtime doesn't grow with the viewers.
+    void    InitMulticast(IPADDRESS group, u_short aRtpPort, uint8_t ttl);
+    bool    IsMulticast() { return m_Multicast; }
+    IPADDRESS GetMulticastGroup() { return m_DestAddr; }
+    uint8_t GetMulticastTtl() { return m_MulticastTtl; }
+
+    // Sessions playing the multicast stream, frames only need sending while there are any
+    void    AddViewer() { m_Viewers++; }
+    void    RemoveViewer() { if(m_Viewers) m_Viewers--; }
+    int     GetViewers() { return m_Viewers; }
     u_short GetRtpServerPort();
     u_short GetRtcpServerPort();
 
     virtual void    streamImage(uint32_t curMsec) = 0; // send a new image to the client
+
+    void    HandleRtcpPacket(unsigned const char *buf, int len); // compound RTCP packet from the client
+    void    PollRtcp(); // read pending RTCP packets from the UDP socket, also done before each frame
+    UDPSOCKET GetRtcpSocket() { return m_RtcpSocket; } // for event loops, NULLSOCKET until a UDP transport is set up
+    // The live receiver losing the most, the first of them on a tie. NULL while nobody reports.
+    const RtcpReceiverStats *GetWorstReceiver();
+    int     GetReceiverCount(); // live ones
+
+    // Spread each frame's packets over this percentage of the frame interval (from GetFrameRate()),
+    // 0 sends them back to back
+    void    SetPacing(uint8_t percent) { m_PacingPercent = percent; }
+    // Time all streamers together may spend waiting for tokens until the next call. A loop serving
+    // several streamers renews it every tick so pacing can't stall it, unlimited until first called.
+    static void SetPacingBudget(uint32_t usec) { s_PaceBudgetUs = usec; }
+    const RtpPacerStats &GetPacerStats() { return m_PacerStats; }
+
+    // Image size of the last frame and the nominal frame rate (0 if unknown), for session descriptions
+    u_short GetWidth() { return m_width; }
+    u_short GetHeight() { return m_height; }
+    void    SetFrameRate(uint8_t fps) { m_FrameRate = fps; }
+    virtual uint8_t GetFrameRate() { return m_FrameRate; }
+
+    // Named encodings of the same capture, picked by the last element of the stream URL.
+    // Streamers without profiles serve their one stream as "1", and as "2" like they always did.
+    virtual int  FindProfile(const char *name, unsigned len); // -1 if there is no such profile
+    virtual int  GetProfileCount() { return 1; }
+    virtual void SetProfile(int /*profile*/) { } // must also set the image size of that profile
+
+    // Path MTU used to size RTP packets, replaced by the discovered one where the platform can tell
+    void    SetMtu(u_short mtu);
 protected:
 
-    void    streamFrame(unsigned const char *data, uint32_t dataLen, uint32_t curMsec);
+    // captureUsec is the capture time on the usecnow() clock (camera_fb_t::timestamp), 0 for now
+    void    streamFrame(unsigned const char *data, uint32_t dataLen, uint32_t curMsec, uint64_t captureUsec = 0);
+
+    // Called for each new report from our worst receiver, reports of the others only decide which one that is,
+    // so a clean receiver can't undo the backing off for a lossy one
+    virtual void    onReceiverReport(const RtcpReceiverStats & /*stats*/) { }
+
+    void    SetImageSize(u_short width, u_short height) { m_width = width; m_height = height; }
 
 private:
+    void   SendRtcpSenderReport();
+    RtcpReceiverStats *FindReceiver(uint32_t ssrc);
+    void   PaceStartFrame(uint32_t frameBytes);
+    void   PaceWait();
+
     int    SendRtpPacket(unsigned const char *jpeg, int jpegLen, int fragmentOffset, BufPtr quant0tbl = NULL, BufPtr quant1tbl = NULL);// returns new fragmentOffset or 0 if finished with frame
 
     UDPSOCKET m_RtpSocket;           // RTP socket for streaming RTP packets to client
@@ -35,10 +116,33 @@ private:
     int m_SendIdx;
     bool m_TCPTransport;
     SOCKET m_Client;
-    uint32_t m_prevMsec;
+    IPADDRESS m_DestAddr;        // where UDP packets go: the client, or the multicast group
+    bool m_Multicast;
+    uint8_t m_MulticastTtl;
+    int m_Viewers;
+    uint64_t m_FirstCaptureUsec; // capture time of the first frame, RTP timestamp 0
+    uint32_t m_PacketCount;      // RTP packets and payload octets sent, for sender reports
+    uint32_t m_OctetCount;
+
+    // token bucket pacer, bytes and microseconds
+    uint8_t  m_PacingPercent;
+    uint32_t m_PaceRate;         // bytes per second for the current frame, 0 when not pacing
+    int32_t  m_PaceTokens;
+    uint64_t m_PaceUsec;         // last token refill
+    RtpPacerStats m_PacerStats;
+    static uint32_t s_PaceBudgetUs;
 
     u_short m_width; // image data info
     u_short m_height;
+    uint8_t m_FrameRate;
+    uint8_t m_JpegType; // RTP/JPEG type of the current frame
+    u_short m_Mtu;
+    int     m_MaxPayload;  // JPEG bytes per packet, before quant tables
+
+    RtcpReceiverStats m_Receivers[RTCP_MAX_RECEIVERS];
+    int      m_ReceiverCount;  // slots in use, silent receivers keep theirs until it is needed
+    uint32_t m_LastSrNtp;  // middle 32 bits of the NTP time of our last sender report, as echoed in LSR
+    uint32_t m_LastSrMsec; // msecnow() when that report was sent
 };
 
 
@@ -51,6 +155,10 @@ private:
 bool decodeJPEGfile(BufPtr *start, uint32_t *len, BufPtr *qtable0, BufPtr *qtable1);
 bool findJPEGheader(BufPtr *start, uint32_t *len, uint8_t marker);
 
+// Read the RFC 2435 type (0 = 4:2:2, 1 = 4:2:0) and the image size from the SOF0 marker
+// returns false if the image can't be carried by RTP/JPEG
+bool getJPEGformat(BufPtr start, uint32_t len, uint8_t *type, u_short *width, u_short *height);
+
 // Given a jpeg ptr pointing to a pair of length bytes, advance the pointer to
 // the next 0xff marker byte
 void nextJpegBlock(BufPtr *start);
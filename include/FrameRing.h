@@ -0,0 +1,72 @@
+#ifndef FrameRing_H_
+#define FrameRing_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#define FRAME_RING_MAX_FRAMES 256 // index size, 25 s at 10 fps
+
+// Receives the frames of a FrameRing snapshot, oldest first
+class FrameSink
+{
+public:
+    virtual ~FrameSink() {}
+    // false stops the snapshot
+    virtual bool putFrame(const uint8_t *data, size_t len, uint64_t timestamp) = 0;
+};
+
+// The last seconds of encoded frames, for recordings that start before their trigger. Frames are
+// copied into one arena allocated up front (PSRAM when there is some) and written around it, the
+// oldest frames making room for new ones, so recording never allocates.
+// One task pushes, any task may take snapshots.
+class FrameRing
+{
+public:
+    FrameRing();
+    ~FrameRing();
+
+    bool begin(size_t arenaBytes); // false if the arena can't be allocated
+    void end();                    // running snapshots stop sending, they skip the frames that are gone
+    bool isReady(void) { return _arena != NULL; }
+
+    // Copy a frame in, timestamp in us. False if it doesn't fit the arena at all.
+    bool push(const uint8_t *data, size_t len, uint64_t timestamp);
+
+    // Hand the frames captured at or after since (us, 0 for all) to sink, oldest first. Each frame is
+    // copied out under the lock and sent after releasing it, so a slow sink never holds up push().
+    // Frames overwritten before their turn are skipped. Returns the number of frames sent.
+    int snapshot(FrameSink &sink, uint64_t since = 0);
+
+    int getFrameCount(void);
+    size_t getUsedBytes(void);          // frame data held
+    size_t getArenaBytes(void) { return _arena_size; }
+    uint64_t getDuration(void);         // us between the oldest and the newest frame
+    uint32_t getEvicted(void) { return _evicted; } // frames overwritten since begin()
+
+private:
+    struct Entry
+    {
+        uint32_t offset;   // in the arena
+        uint32_t len;
+        uint64_t timestamp;
+    };
+
+    Entry &oldest(void) { return _entries[_first]; }
+    void evictOldest(void);
+
+    uint8_t *_arena;
+    size_t _arena_size;
+    size_t _write;           // where the next frame goes
+    Entry _entries[FRAME_RING_MAX_FRAMES];
+    int _first;              // index of the oldest entry
+    int _count;
+    uint32_t _first_seq;     // frame number of the oldest entry, numbers are consecutive
+    size_t _used;
+    size_t _max_len;         // largest frame pushed, sizes the snapshot copy buffer
+    uint32_t _evicted;
+    SemaphoreHandle_t _lock;
+};
+
+#endif //FrameRing_H_
@@ -8,8 +8,32 @@ class OV7725Streamer : public CStreamer
     bool m_showBig;
     OV7725aiThinker &m_cam;
 
+    // bandwidth adaptation from the client's RTCP receiver reports
+    uint8_t m_frameSkip;     // frames skipped for each one sent, raised once quality can't go lower
+    uint8_t m_skipped;
+    uint8_t m_cleanReports;  // consecutive reports with little loss
+
+    int      m_profile;      // which of the camera's stream profiles we send
+    uint32_t m_nextMsec;     // earliest time for the next frame when the profile limits the rate
+    uint32_t m_lastSentMsec; // for sending unchanged frames now and then
+    uint32_t m_sentSeq;      // camera frame we sent last
+
+    // all streamers, the camera's bitrate follows the worst receiver of any of its streams
+    static OV7725Streamer *s_streamers;
+    OV7725Streamer *m_next;
+    bool drivesBitrate();
+
 public:
     OV7725Streamer(SOCKET aClient, OV7725aiThinker &cam);
+    virtual ~OV7725Streamer();
 
     virtual void    streamImage(uint32_t curMsec);
+
+    virtual int     FindProfile(const char *name, unsigned len);
+    virtual int     GetProfileCount();
+    virtual void    SetProfile(int profile);
+    virtual uint8_t GetFrameRate();
+
+protected:
+    virtual void    onReceiverReport(const RtcpReceiverStats &stats);
 };
@@ -7,9 +7,22 @@
 #include "esp_log.h"
 #include "esp_attr.h"
 #include "esp_camera.h"
+#include "img_converters.h"
+#include "FrameRing.h"
 
 extern camera_config_t esp32cam_aithinker_config;
 
+#define MAX_STREAM_PROFILES 4
+
+// One encoding of the captured frame, RTSP clients pick it with rtsp://host/mjpeg/<name>
+struct StreamProfile
+{
+    const char *name;
+    uint8_t scaleShift; // downscaled by 1 << scaleShift each way while converting, 0 for full size
+    uint8_t quality;    // JPEG quality, 0 for the rate controlled quality
+    uint8_t fps;        // at most this many frames per second, 0 for every frame
+};
+
 class OV7725aiThinker
 {
 public:
@@ -17,8 +30,44 @@ public:
         fb = NULL;
         _jpg_buf_len = 0;
         _jpg_buf = NULL;
+        _quality = 0;
+        _rc_target_bitrate = 0;
+        _rc_target_size = 0;
+        _rc_avg_size = 0;
+        _rc_avg_interval = 0;
+        _rc_last_ms = 0;
+        _profiles = NULL;
+        _profile_count = 0;
+        memset(_profile_buf, 0, sizeof(_profile_buf));
+        memset(_profile_len, 0, sizeof(_profile_len));
+        _grab_tick = 0;
+        _grabbed = false;
+        _coeffs = NULL;
+        _jpg_quality = 0;
+        _blk_sums = NULL;
+        _blk_prev = NULL;
+        _change_map = NULL;
+        _blk_cols = 0;
+        _blk_rows = 0;
+        _change_threshold = 0;
+        _change_min_score = 0;
+        _change_max_idle_ms = 0;
+        _change_valid = false;
+        _change_score = 100;
+        _changed_blocks = 0;
+        _unchanged_frames = 0;
+        _frame_seq = 0;
+        _change_seq = 0;
+        _pre_event_last = 0;
+        _block_cache = NULL;
+        _replenish_tolerance = 0;
     };
     ~OV7725aiThinker(){
+        if (_coeffs) jpg_coeffs_free(_coeffs);
+        free(_blk_sums);
+        free(_blk_prev);
+        free(_change_map);
+        if (_block_cache) jpg_block_cache_free(_block_cache);
     };
     esp_err_t init(camera_config_t config);
     void run(void);
@@ -26,14 +75,74 @@ public:
     uint8_t *getfb(void);
     int getWidth(void);
     int getHeight(void);
+    uint64_t getTimestamp(void); // capture time of the current frame, us since boot
     framesize_t getFrameSize(void);
     pixformat_t getPixelFormat(void);
 
     void setFrameSize(framesize_t size);
     void setPixelFormat(pixformat_t format);
 
+    // Rate control: pick the JPEG quality of each frame from the size of the previous ones.
+    // A target bitrate (bits/s) is turned into a frame size using the measured frame rate.
+    // Setting both targets to 0 (the default) encodes at the fixed config jpeg_quality.
+    void setTargetBitrate(uint32_t bitsPerSec);
+    void setTargetFrameSize(size_t bytes);
+    uint32_t getTargetBitrate(void);
+    uint32_t getBitrate(void); // achieved, averaged over the last frames
+    uint8_t getQuality(void);  // quality used for the last frame
+
+    // Conditional replenishment: the main encoding reuses the coded blocks of the last frame where
+    // no sample moved by more than tolerance levels. Pays off at a fixed quality, every
+    // quality change starts the cache over. Not used while profiles are transcoded from the main encoding.
+    void setReplenishment(bool enable, uint8_t tolerance = 2);
+    uint32_t getReusedBlocks(uint32_t *blocks); // of the last frame
+
+    // Stream profiles, the table must outlive the camera. Without one there is a single
+    // full size, rate controlled profile named "1".
+    void setProfiles(const StreamProfile *profiles, int count);
+    int getProfileCount(void);
+    const StreamProfile &getProfile(int profile);
+    int findProfile(const char *name, size_t len); // -1 if there is none of that name
+    int getProfileWidth(int profile);
+    int getProfileHeight(int profile);
+
+    // Capture a new frame unless one was already captured for this tick, so all the streams
+    // sent in one tick share a capture
+    void grab(uint32_t tick);
+    // The current frame encoded for a profile. Profiles are encoded on first use, at most once
+    // per frame however many streams send them. NULL if encoding failed.
+    uint8_t *getProfileJpeg(int profile, size_t *len);
+
+    // Change detection: the luma sums of each 8x8 block are compared with those of the previous
+    // frame, a block has changed when its mean moved by more than blockThreshold levels. 0 turns it off.
+    // Frames where fewer than minScore percent of the blocks changed count as unchanged, streams skip
+    // encoding and sending them but still send one every maxIdleMs.
+    void setChangeDetection(uint8_t blockThreshold, uint8_t minScore = 1, uint32_t maxIdleMs = 1000);
+    uint8_t getChangeScore(void);      // percent of the blocks that changed, 100 when not detecting
+    uint32_t getChangedBlocks(void);
+    const uint8_t *getChangeMap(int *cols, int *rows); // 1 per changed block, row by row, NULL when not detecting
+    bool isUnchanged(void);            // below the minimum score, not worth sending
+    uint32_t getFrameSeq(void) { return _frame_seq; } // counts captures
+    // Whether a frame since capture seq changed, for streams that don't send every frame
+    bool changedSince(uint32_t seq) { return (int32_t)(_change_seq - seq) > 0; }
+    uint32_t getMaxIdleMs(void) { return _change_max_idle_ms; }
+    uint32_t getUnchangedFrames(void) { return _unchanged_frames; } // count since start
+
+    // Pre-event buffer: main encodings of changed frames, and one every maxIdleMs of a static scene,
+    // are also kept in a ring of this many bytes, so an alarm can save the seconds before it. 0 frees
+    // it. False if the memory isn't there.
+    bool setPreEventBuffer(size_t bytes);
+    // Capture for this tick and encode the frame if the ring wants it, for ticks no stream encodes in
+    void recordPreEvent(uint32_t tick);
+    FrameRing &getPreEventBuffer(void) { return _pre_event; }
+
 private:
     void runIfNeeded(); // grab a frame if we don't already have one
+    void capture();     // new frame buffer, dropping the encodings of the last one
+    bool encode();      // full size at the rate controlled quality, into _jpg_buf
+    void rateControl(size_t frameLen); // update the averages and pick the next quality
+    void detectChange();   // block sums of the new frame against the last one
+    bool preEventDue();    // the frame belongs in the pre-event buffer
 
     // camera_framesize_t _frame_size;
     // camera_pixelformat_t _pixel_format;
@@ -42,6 +151,40 @@ private:
     camera_fb_t *fb;
     uint8_t * _jpg_buf;
     size_t _jpg_buf_len;
+
+    uint8_t _quality;
+    uint32_t _rc_target_bitrate;
+    size_t _rc_target_size;
+    uint32_t _rc_avg_size;     // bytes, exponential average
+    uint32_t _rc_avg_interval; // ms, exponential average
+    uint32_t _rc_last_ms;
+
+    const StreamProfile *_profiles;
+    int _profile_count;
+    uint8_t *_profile_buf[MAX_STREAM_PROFILES]; // encodings of the current frame, NULL until needed
+    size_t _profile_len[MAX_STREAM_PROFILES];
+    uint32_t _grab_tick;
+    bool _grabbed;
+    jpg_coeffs_t *_coeffs;   // coefficients of the main encoding, when fixed quality full size profiles are transcoded from it
+    uint8_t _jpg_quality;    // quality _jpg_buf was encoded at
+    jpg_block_cache_t *_block_cache; // coded blocks of the last frame, when replenishing
+    uint8_t _replenish_tolerance;
+
+    uint16_t *_blk_sums;     // luma sum of each 8x8 block of this frame
+    uint16_t *_blk_prev;     // and of the previous one
+    uint8_t *_change_map;
+    int _blk_cols, _blk_rows;
+    uint8_t _change_threshold;
+    uint8_t _change_min_score;
+    uint32_t _change_max_idle_ms;
+    bool _change_valid;      // _blk_prev holds a frame of the same size
+    uint8_t _change_score;
+    uint32_t _changed_blocks;
+    uint32_t _unchanged_frames;
+    uint32_t _frame_seq;
+    uint32_t _change_seq;    // last capture that wasn't unchanged
+    FrameRing _pre_event;
+    uint64_t _pre_event_last; // timestamp of the last frame it got, us
 };
 
 #endif //OV2640_H_
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "platglue.h"
+
+// supported command types
+enum RTSP_CMD_TYPES
+{
+    RTSP_OPTIONS,
+    RTSP_DESCRIBE,
+    RTSP_SETUP,
+    RTSP_PLAY,
+    RTSP_TEARDOWN,
+    RTSP_UNKNOWN
+};
+
+// A piece of the receive buffer, not NUL terminated
+struct RtspView
+{
+    const char *ptr;
+    unsigned    len;
+};
+
+#define RTSPVIEW(v) (int) (v).len, (v).ptr // printf arguments for "%.*s"
+
+bool rtspViewEquals(RtspView v, const char *s);
+
+// One parsed request, all views point into the buffer it was parsed from
+struct RtspRequest
+{
+    RTSP_CMD_TYPES cmd;
+    RtspView method;
+    RtspView urlHostPort;     // host:port part of an rtsp:// URL
+    RtspView urlPreSuffix;    // path up to the last '/', "mjpeg" in rtsp://host/mjpeg/1
+    RtspView urlSuffix;       // last path element, "1" in rtsp://host/mjpeg/1
+    RtspView cseq;
+    RtspView session;
+    RtspView transport;
+    unsigned contentLength;
+
+    // from the Transport header
+    bool     tcpTransport;
+    bool     multicast;
+    IPPORT   clientRtpPort;   // host byte order, 0 if not given
+    IPPORT   clientRtcpPort;
+};
+
+/**
+   Parse the request at the start of buf in one pass, without copying or allocating.
+
+   Returns the number of bytes the request takes up including its body and any empty
+   lines before it, so pipelined requests follow at buf + result. Returns 0 if the request isn't complete yet and
+   -1 if buf doesn't start with an RTSP request.
+ */
+int parseRtspRequest(const char *buf, unsigned len, RtspRequest *req);
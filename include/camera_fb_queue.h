@@ -0,0 +1,68 @@
+// Frame buffer queue policy, kept free of driver dependencies so it can be tested on a host
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Frame buffer queue policy, used when more than one frame buffer is allocated
+ */
+typedef enum {
+    CAMERA_FB_POLICY_LATEST = 0,    /*!< Queue holds only the newest frame. A new frame evicts the queued one (lowest latency) */
+    CAMERA_FB_POLICY_DROP_OLDEST,   /*!< Queue holds up to fb_queue_depth frames. When full, the oldest queued frame is evicted */
+    CAMERA_FB_POLICY_FIFO,          /*!< Queue holds up to fb_queue_depth frames. When full, the new frame is dropped (no reordering, no eviction) */
+} camera_fb_policy_t;
+
+/**
+ * @brief Depth of the queue of completed frames
+ *
+ * At least one frame buffer always stays free for the capture.
+ *
+ * @param policy    Queue policy
+ * @param depth     Requested depth, 0 for as deep as possible
+ * @param fb_count  Frame buffers allocated, more than one
+ *
+ * @return the depth to create the queue with
+ */
+static inline size_t camera_fb_queue_depth(camera_fb_policy_t policy, size_t depth, size_t fb_count)
+{
+    if (policy == CAMERA_FB_POLICY_LATEST) {
+        return 1;
+    }
+    if (!depth || depth > fb_count - 1) {
+        return fb_count - 1;
+    }
+    return depth;
+}
+
+/**
+ * @brief Whether a frame completed while the queue is full evicts the oldest queued frame
+ *
+ * @return true to evict the oldest frame and queue the new one, false to drop the new frame
+ */
+static inline bool camera_fb_queue_evicts(camera_fb_policy_t policy)
+{
+    return policy != CAMERA_FB_POLICY_FIFO;
+}
+
+/**
+ * @brief Ticks to wait for a frame
+ *
+ * Rounded up, so a timeout shorter than a tick still waits one tick. 0 stays a poll.
+ *
+ * @param timeout_ms        Time to wait
+ * @param tick_period_ms    portTICK_PERIOD_MS
+ */
+static inline uint32_t camera_fb_timeout_ticks(uint32_t timeout_ms, uint32_t tick_period_ms)
+{
+    return timeout_ms / tick_period_ms + (timeout_ms % tick_period_ms != 0);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -69,11 +69,21 @@
 #include "driver/ledc.h"
 #include "sensor.h"
 #include "sys/time.h"
+#include "camera_fb_queue.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @brief Decimation applied by the DMA filter while copying into the frame buffer
+ */
+typedef enum {
+    CAMERA_DECIMATE_NONE = 0,       /*!< Full sensor resolution */
+    CAMERA_DECIMATE_2X,             /*!< Half resolution, keeps every other pixel of every other line */
+    CAMERA_DECIMATE_2X_AVG,         /*!< Half resolution, luma averaged over each 2x2 block (GRAYSCALE and YUV422 only) */
+} camera_decimation_t;
+
 /**
  * @brief Configuration structure for camera initialization
  */
@@ -105,6 +115,8 @@ typedef struct {
 
     int jpeg_quality;               /*!< Quality of JPEG output. 0-63 lower means higher quality  */
     size_t fb_count;                /*!< Number of frame buffers to be allocated. If more than one, then each frame will be acquired (double speed)  */
+    camera_fb_policy_t fb_policy;   /*!< How completed frames are queued when fb_count > 1. Defaults to CAMERA_FB_POLICY_LATEST  */
+    size_t fb_queue_depth;          /*!< Max frames waiting in the queue for DROP_OLDEST and FIFO. 0 or too large means fb_count - 1  */
 } camera_config_t;
 
 /**
@@ -119,6 +131,33 @@ typedef struct {
     struct timeval timestamp;   /*!< Timestamp since boot of the first DMA buffer of the frame */
 } camera_fb_t;
 
+/**
+ * @brief Frame buffer queue counters
+ */
+typedef struct {
+    uint32_t frames_captured;   /*!< Frames completed by the capture path */
+    uint32_t frames_dropped;    /*!< Frames lost because the queue was full (FIFO) or no frame buffer was free */
+    uint32_t frames_stale;      /*!< Queued frames evicted by a newer frame before being taken */
+} camera_fb_counters_t;
+
+/**
+ * @brief Capture path statistics
+ *
+ * Each counter has a single writer (I2S interrupt or DMA filter task) and is
+ * updated without locking. Values are cumulative since init.
+ */
+typedef struct {
+    uint32_t dma_received;          /*!< DMA buffers signalled by the I2S interrupt */
+    uint32_t dma_filtered;          /*!< DMA buffers converted into frame buffer data */
+    uint32_t dma_queue_overflows;   /*!< DMA buffers lost because the filter task fell behind */
+    uint32_t fb_overflows;          /*!< DMA buffers discarded because the frame buffer was full */
+    uint32_t bad_frames;            /*!< Frames discarded after an overflow or a bad header */
+    uint32_t jpeg_header_errors;    /*!< JPEG frames that did not start with an SOI marker */
+    uint32_t fb_evictions;          /*!< Queued frames evicted by a newer frame before being taken */
+    uint32_t filter_time_us;        /*!< Time spent in the DMA filter for the last completed frame */
+    uint32_t filter_time_max_us;    /*!< Longest DMA filter time of a single frame */
+} camera_stats_t;
+
 #define ESP_ERR_CAMERA_BASE 0x20000
 #define ESP_ERR_CAMERA_NOT_DETECTED             (ESP_ERR_CAMERA_BASE + 1)
 #define ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE (ESP_ERR_CAMERA_BASE + 2)
@@ -155,10 +194,23 @@ esp_err_t esp_camera_deinit();
 /**
  * @brief Obtain pointer to a frame buffer.
  *
+ * Blocks for up to 4 seconds. On timeout the capture is restarted.
+ *
  * @return pointer to the frame buffer
  */
 camera_fb_t* esp_camera_fb_get();
 
+/**
+ * @brief Obtain pointer to a frame buffer, waiting at most timeout_ms.
+ *
+ * Unlike esp_camera_fb_get, a timeout is not treated as a capture failure.
+ *
+ * @param timeout_ms    Time to wait for a frame, rounded up to whole ticks. 0 polls without blocking
+ *
+ * @return pointer to the frame buffer or NULL if no frame was ready in time
+ */
+camera_fb_t* esp_camera_fb_get_timeout(uint32_t timeout_ms);
+
 /**
  * @brief Return the frame buffer to be reused again.
  *
@@ -166,6 +218,73 @@ camera_fb_t* esp_camera_fb_get();
  */
 void esp_camera_fb_return(camera_fb_t * fb);
 
+/**
+ * @brief Read the frame buffer queue counters
+ *
+ * @param counters  Filled with the counters accumulated since init
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_STATE if the driver hasn't been initialized yet
+ */
+esp_err_t esp_camera_fb_get_counters(camera_fb_counters_t * counters);
+
+/**
+ * @brief Read the capture path statistics
+ *
+ * @param stats     Filled with the statistics accumulated since init
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_STATE if the driver hasn't been initialized yet
+ */
+esp_err_t esp_camera_get_stats(camera_stats_t * stats);
+
+/**
+ * @brief Select the decimation done by the DMA filter
+ *
+ * Takes effect from the next frame without touching the sensor registers.
+ * Frame buffers report the decimated width and height. Only supported for
+ * GRAYSCALE, YUV422 and RGB565 captured in the normal (non high speed) sampling mode.
+ *
+ * @param mode  Decimation mode
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_STATE if the driver hasn't been initialized yet
+ *      - ESP_ERR_NOT_SUPPORTED if the pixel format or sampling mode can't be decimated
+ *      - ESP_ERR_NO_MEM if the line buffer for averaging could not be allocated
+ */
+esp_err_t esp_camera_set_decimation(camera_decimation_t mode);
+
+/**
+ * @brief Get the decimation mode selected with esp_camera_set_decimation
+ *
+ * @return decimation mode
+ */
+camera_decimation_t esp_camera_get_decimation();
+
+/**
+ * @brief Restrict capture to a region of interest
+ *
+ * The DMA filter skips lines outside the window and copies only the needed
+ * span of each line, so frame buffers hold just the cropped image and report
+ * its width and height. Coordinates are in sensor pixels, before decimation.
+ * Takes effect from the next frame. A zero width or height restores the full frame.
+ *
+ * @param x         Left edge, multiple of 8
+ * @param y         Top edge, multiple of 2
+ * @param width     Window width, multiple of 8
+ * @param height    Window height, multiple of 2
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_STATE if the driver hasn't been initialized yet
+ *      - ESP_ERR_INVALID_ARG if the window is misaligned or outside the frame
+ *      - ESP_ERR_NOT_SUPPORTED if the pixel format or sampling mode can't be cropped
+ */
+esp_err_t esp_camera_set_crop(size_t x, size_t y, size_t width, size_t height);
+
 /**
  * @brief Get a pointer to the image sensor control structure
  *
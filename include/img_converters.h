@@ -25,6 +25,9 @@ extern "C" {
 
 typedef size_t (* jpg_out_cb)(void * arg, size_t index, const void* data, size_t len);
 
+typedef struct jpg_coeffs_s jpg_coeffs_t; // quantized coefficients of an encoded image
+typedef struct jpg_block_cache_s jpg_block_cache_t; // coded blocks of the last frame, see frame2jpg_rtp_cached
+
 /**
  * @brief Convert image buffer to JPEG
  *
@@ -81,6 +84,140 @@ bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixf
  */
 bool frame2jpg(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len);
 
+/**
+ * @brief Convert camera frame buffer to a JPEG buffer that RTP/JPEG (RFC 2435) can carry
+ *
+ * RTP/JPEG only transports 3 component 4:2:0 or 4:2:2 images. GRAYSCALE frames are
+ * encoded as 4:2:0 with flat chroma blocks, coded without any colour conversion.
+ * Other formats give the same result as frame2jpg.
+ *
+ * @param fb        Source camera frame buffer
+ * @param quality   JPEG quality of the resulting image
+ * @param out       Pointer to be populated with the address of the resulting buffer
+ * @param out_len   Pointer to be populated with the length of the output buffer
+ *
+ * @return true on success
+ */
+bool frame2jpg_rtp(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len);
+
+/**
+ * @brief Like frame2jpg_rtp, from the frame downscaled by 1 << scale_shift in each direction
+ *
+ * The frame is box filtered while it is converted for the encoder, so a half size image
+ * costs about a quarter of the encoding work.
+ *
+ * @param fb          Source camera frame buffer
+ * @param quality     JPEG quality of the resulting image
+ * @param scale_shift 0 for full size, 1 for half, 2 for quarter, at most 3
+ * @param out         Pointer to be populated with the address of the resulting buffer
+ * @param out_len     Pointer to be populated with the length of the output buffer
+ *
+ * @return true on success
+ */
+bool frame2jpg_rtp_scaled(camera_fb_t * fb, uint8_t quality, uint8_t scale_shift, uint8_t ** out, size_t * out_len);
+
+/**
+ * @brief Like frame2jpg_rtp, also giving a thumbnail JPEG made from the DCT coefficients of the encode
+ *
+ * The thumbnail pixels come out of the main encode for almost nothing, only the small
+ * thumbnail image itself is encoded again. Both images can be carried by RTP/JPEG.
+ *
+ * @param fb            Source camera frame buffer
+ * @param quality       JPEG quality of the full size image
+ * @param out           Pointer to be populated with the address of the full size image
+ * @param out_len       Pointer to be populated with its length
+ * @param thumb_shift   3 for a 1/8 scale thumbnail (block DC terms), 2 for 1/4 scale
+ * @param thumb_quality JPEG quality of the thumbnail
+ * @param thumb_out     Pointer to be populated with the address of the thumbnail
+ * @param thumb_len     Pointer to be populated with its length
+ *
+ * @return true on success, both buffers are then to be freed by the caller
+ */
+bool frame2jpg_rtp_thumb(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len, uint8_t thumb_shift, uint8_t thumb_quality, uint8_t ** thumb_out, size_t * thumb_len);
+
+/**
+ * @brief Allocate a store for the quantized coefficients of an encoded frame
+ *
+ * Its memory grows to fit the frame and is kept for the next one.
+ *
+ * @return the store, or NULL if out of memory
+ */
+jpg_coeffs_t * jpg_coeffs_new(void);
+
+/**
+ * @brief Free a coefficient store
+ */
+void jpg_coeffs_free(jpg_coeffs_t * coeffs);
+
+/**
+ * @brief Like frame2jpg_rtp, keeping the quantized coefficients for coeffs2jpg
+ *
+ * @param fb        Source camera frame buffer
+ * @param quality   JPEG quality of the resulting image, the highest the frame can be transcoded to
+ * @param coeffs    Store for the coefficients, replacing those of the previous frame
+ * @param out       Pointer to be populated with the address of the resulting buffer
+ * @param out_len   Pointer to be populated with the length of the output buffer
+ *
+ * @return true on success
+ */
+bool frame2jpg_rtp_coeffs(camera_fb_t * fb, uint8_t quality, jpg_coeffs_t * coeffs, uint8_t ** out, size_t * out_len);
+
+/**
+ * @brief Encode the frame kept by frame2jpg_rtp_coeffs again at another quality
+ *
+ * The stored coefficients are requantized and entropy coded, without converting
+ * or transforming the frame again, so extra quality tiers cost a fraction of an encode.
+ *
+ * @param coeffs    Coefficients of the frame
+ * @param quality   JPEG quality, at most that of the stored frame to be of use
+ * @param out       Pointer to be populated with the address of the resulting buffer
+ * @param out_len   Pointer to be populated with the length of the output buffer
+ *
+ * @return true on success
+ */
+bool coeffs2jpg(jpg_coeffs_t * coeffs, uint8_t quality, uint8_t ** out, size_t * out_len);
+
+/**
+ * @brief Allocate a cache of coded blocks for frame2jpg_rtp_cached, empty until its first frame
+ *
+ * @return the cache, or NULL if out of memory
+ */
+jpg_block_cache_t * jpg_block_cache_new(void);
+
+/**
+ * @brief Free a block cache
+ */
+void jpg_block_cache_free(jpg_block_cache_t * cache);
+
+/**
+ * @brief Blocks of the last frame that reused their coded bits
+ *
+ * @param cache     The cache
+ * @param blocks    Populated with the number of blocks per frame, may be NULL
+ *
+ * @return number of reused blocks
+ */
+size_t jpg_block_cache_reused(jpg_block_cache_t * cache, size_t * blocks);
+
+/**
+ * @brief Like frame2jpg_rtp, reusing the coded blocks of the previous frame where it hardly changed
+ *
+ * Conditional replenishment: a block none of whose samples is more than tolerance levels off
+ * those its cached bits were coded from is not transformed or Huffman coded again, its cached
+ * bits are copied. The cache starts over when the frame size or quality changes, so it pays
+ * off with a fixed quality.
+ *
+ * @param fb        Source camera frame buffer
+ * @param quality   JPEG quality of the resulting image
+ * @param cache     Coded blocks, of the previous frame in and of this one out
+ * @param tolerance Change of any one sample, in levels, that still reuses a block. 0 reuses only unchanged blocks
+ * @param out       Pointer to be populated with the address of the resulting buffer
+ * @param out_len   Pointer to be populated with the length of the output buffer
+ *
+ * @return true on success
+ */
+bool frame2jpg_rtp_cached(camera_fb_t * fb, uint8_t quality, jpg_block_cache_t * cache, uint8_t tolerance, uint8_t ** out, size_t * out_len);
+
 /**
  * @brief Convert image buffer to BMP buffer
  *
@@ -7,18 +7,20 @@
 namespace jpge
 {
     typedef unsigned char  uint8;
+    typedef signed char    int8;
     typedef signed short   int16;
     typedef signed int     int32;
     typedef unsigned short uint16;
     typedef unsigned int   uint32;
     typedef unsigned int   uint;
+    typedef unsigned long long uint64;
 
     // JPEG chroma subsampling factors. Y_ONLY (grayscale images) and H2V2 (color images) are the most common.
     enum subsampling_t { Y_ONLY = 0, H1V1 = 1, H2V1 = 2, H2V2 = 3 };
 
     // JPEG compression parameters structure.
     struct params {
-            inline params() : m_quality(85), m_subsampling(H2V2) { }
+            inline params() : m_quality(85), m_subsampling(H2V2), m_flat_chroma(false), m_out_buf_size(512) { }
 
             inline bool check() const {
                 if ((m_quality < 1) || (m_quality > 100)) {
@@ -27,6 +29,9 @@ namespace jpge
                 if ((uint)m_subsampling > (uint)H2V2) {
                     return false;
                 }
+                if (m_out_buf_size < 16) {
+                    return false;
+                }
                 return true;
             }
 
@@ -39,17 +44,107 @@ namespace jpge
             // 2 = H2V1 subsampling (YCbCr 2x1x1, 4 blocks per MCU)
             // 3 = H2V2 subsampling (YCbCr 4x1x1, 6 blocks per MCU-- very common)
             subsampling_t m_subsampling;
+
+            // Source is luma only but a colour image is wanted (e.g. RTP/JPEG can't carry grayscale).
+            // Chroma blocks are coded as flat without any conversion or DCT. Ignored for Y_ONLY.
+            bool m_flat_chroma;
+
+            // Size of the chunks handed to output_stream::put_buf() when the stream has no direct buffer.
+            // Bigger chunks mean fewer put_buf() calls, at the cost of a bigger heap allocation.
+            uint m_out_buf_size;
     };
     
     // Output stream abstract class - used by the jpeg_encoder class to write to the output stream.
-    // put_buf() is generally called with len==JPGE_OUT_BUF_SIZE bytes, but for headers it'll be called with smaller amounts.
+    // put_buf() is generally called with len==params::m_out_buf_size bytes, but for headers it'll be called with smaller amounts.
     class output_stream {
         public:
             virtual ~output_stream() { };
             virtual bool put_buf(const void* Pbuf, int len) = 0;
             virtual uint get_size() const = 0;
+
+            // Optional direct write mode: return memory the encoder may write into (*len bytes of it).
+            // The encoder then calls put_buf() with that same pointer once it is done with it, so the
+            // stream only has to account for the bytes instead of copying them. NULL means not supported.
+            virtual uint8 *get_direct_buf(uint * /*len*/) { return 0; }
     };
     
+    // Quantized coefficients of one encoded image, kept so jpeg_encoder::transcode() can emit it again at other
+    // qualities. Per block a count of non-zero coefficients, then zigzag index and 16 bit value of each.
+    class coefficient_store {
+        public:
+            coefficient_store();
+            ~coefficient_store();
+
+            void clear();                           // forget the image, keeping the memory for the next one
+            uint get_size() const { return m_len; } // bytes of coefficients held
+            int get_quality() const { return m_params.m_quality; }
+            bool is_valid() const { return m_len && !m_failed; }
+
+        private:
+            friend class jpeg_encoder;
+            coefficient_store(const coefficient_store &);
+            coefficient_store &operator =(const coefficient_store &);
+
+            void begin(int width, int height, const params &comp_params, const uint8 * const *pQuant);
+            void add_block(const int16 *pCoeffs); // NULL for a block of zeros
+
+            uint8 *m_pBuf;
+            uint m_len, m_capacity;
+            bool m_failed;          // ran out of memory, the image is incomplete
+            int m_width, m_height;
+            params m_params;
+            uint8 m_quant[2][64];   // zigzag order, as the coefficients were quantized
+    };
+
+    // Coded blocks of the previous frame, for conditional replenishment: a block none of whose samples moved more than a
+    // tolerance from those it was coded from gets its cached AC bits again, skipping the DCT, quantization and Huffman
+    // coding. Its DC difference is coded afresh, so the predictors stay right without restart markers.
+    // Kept by the caller from one frame to the next; it starts over when the size or quality changes.
+    class block_cache {
+        public:
+            block_cache();
+            ~block_cache();
+
+            void reset();                                 // forget the cached frame
+            uint get_blocks() const { return m_count; }   // blocks per frame
+            uint get_reused() const { return m_reused; }  // blocks of the last frame that reused their bits
+
+        private:
+            friend class jpeg_encoder;
+            block_cache(const block_cache &);
+            block_cache &operator =(const block_cache &);
+
+            struct entry {
+                int8 samples[64]; // level shifted samples the bits were coded from
+                int16 dc;       // quantized DC
+                uint16 ac_bits; // length of the block's AC codes in the bit buffer
+            };
+
+            bool begin(int width, int height, const params &comp_params, const uint8 * const *pQuant, uint blocks);
+            void finish();
+            bool reserve(uint bytes);
+            inline void append(uint bits, uint len);
+            inline uint read(uint64 pos, uint len) const;
+
+            entry *m_pEntries;
+            uint m_count, m_index;    // blocks per frame, block being coded
+            uint8 *m_pBits[2];        // AC bits of the previous frame and the one being coded, in turns
+            uint m_bits_size[2];
+            int m_cur;
+            uint64 m_read_pos;        // bit position of the current block's AC codes in the previous frame
+            uint m_write_len;         // bytes written to m_pBits[m_cur]
+            uint64 m_acc;             // bits not yet written, right aligned
+            uint m_acc_bits;
+            uint64 m_block_start;     // bit position where the current block's AC codes started
+            int8 m_samples[64];       // of the block being coded
+            bool m_valid;             // the previous frame is complete and coded the same way
+            bool m_complete;
+            uint m_reused;
+            int m_width, m_height;
+            params m_params;
+            uint8 m_quant[2][64];
+    };
+
     // Lower level jpeg_encoder class - useful if more control is needed than the above helper functions.
     class jpeg_encoder {
         public:
@@ -70,6 +165,35 @@ namespace jpge
             // Returns false on out of memory or if a stream write fails.
             bool process_scanline(const void* pScanline);
 
+            // Compresses a whole 8-bit luma image (1 channel source, Y_ONLY or m_flat_chroma) and finishes it.
+            // When the width is a multiple of the MCU width the MCU rows are read in place, without copying lines.
+            // Returns false on a stream write failure or if the encoder wasn't set up for luma input.
+            bool process_y_image(const uint8 *pImage);
+
+            // Optionally make a thumbnail as a by-product of the encode, from the DCT coefficients of each block:
+            // shift 3 gives a 1/8 scale image from the DC terms, shift 2 a 1/4 scale one from the lowest frequencies.
+            // Call after init() with get_thumbnail_size() bytes at pBuf. Once the image is finished pBuf holds RGB
+            // (3 channels) or luma (1 channel, grayscale or flat chroma), get_thumbnail_stride() bytes per row.
+            bool set_thumbnail(uint8 *pBuf, int shift);
+            uint get_thumbnail_size(int shift) const;
+            int get_thumbnail_width() const { return (m_image_x + (1 << m_thumb_shift) - 1) >> m_thumb_shift; }
+            int get_thumbnail_height() const { return (m_image_y + (1 << m_thumb_shift) - 1) >> m_thumb_shift; }
+            int get_thumbnail_channels() const { return m_y_source ? 1 : 3; }
+            int get_thumbnail_stride() const { return (m_image_x_mcu >> m_thumb_shift) * get_thumbnail_channels(); }
+
+            // Keep the quantized coefficients of the image in pStore while it is encoded. Call after init().
+            bool set_coefficient_store(coefficient_store *pStore);
+
+            // Emits the image held in store at another quality, requantizing its coefficients and entropy coding
+            // them without any colour conversion or DCT. Qualities above the stored one don't look any better.
+            // Returns false if the store holds no complete image or a stream write fails.
+            bool transcode(output_stream *pStream, const coefficient_store &store, int quality);
+
+            // Reuse the coded blocks of the previous frame held in pCache where the source hardly changed: a block is
+            // reused while none of its samples is more than tolerance levels off what it was coded from, 0 for exactly.
+            // Call after init(). Blocks are always coded afresh while a thumbnail or coefficient store is set.
+            bool set_block_cache(block_cache *pCache, int tolerance);
+
             // Deinitializes the compressor, freeing any allocated memory. May be called at any time.
             void deinit();
 
@@ -78,7 +202,8 @@ namespace jpge
             jpeg_encoder &operator =(const jpeg_encoder &);
 
             typedef int32 sample_array_t;
-            enum { JPGE_OUT_BUF_SIZE = 512 };
+            typedef void (*line_converter_t)(uint8 *pDst, const uint8 *pSrc, int num_pixels);
+            typedef void (jpeg_encoder::*row_coder_t)(const uint8 * const *pLines);
 
             output_stream *m_pStream;
             params m_params;
@@ -95,18 +220,34 @@ namespace jpge
             int16 m_coefficient_array[64];
 
             int m_last_dc_val[3];
-            uint8 m_out_buf[JPGE_OUT_BUF_SIZE];
+            const uint8 *m_quant_tables[2]; // luma, chroma; in flash for common qualities
+            uint8 m_own_quant[2][64];       // computed for the other qualities
+            uint8 *m_out_buf;       // own chunk buffer, m_params.m_out_buf_size bytes
+            uint8 *m_pOut_chunk;    // current chunk, either m_out_buf or the stream's direct buffer
+            uint m_out_chunk_size;
             uint8 *m_pOut_buf;
             uint m_out_buf_left;
-            uint32 m_bit_buffer;
+            uint64 m_bit_buffer; // right aligned, m_bits_in valid bits
             uint m_bits_in;
             uint8 m_pass_num;
+            bool m_y_source;
+            line_converter_t m_convert_line;   // source scanline to m_mcu_lines format, picked in jpg_open()
+            row_coder_t m_code_rows;           // MCU row coder for the subsampling mode, picked in jpg_open()
             bool m_all_stream_writes_succeeded;
+            uint8 *m_pThumb;        // thumbnail pixels, NULL when not wanted
+            int m_thumb_shift;
+            int m_thumb_y;          // first thumbnail row of the current MCU row
+            coefficient_store *m_pCoeffs; // where coded blocks are kept, NULL when not wanted
+            block_cache *m_pCache;  // coded blocks of the previous frame, NULL when not wanted
+            int m_cache_tolerance;  // in levels per sample
 
-            bool jpg_open(int p_x_res, int p_y_res, int src_channels);
+            bool jpg_open(int p_x_res, int p_y_res, int src_channels, bool transcoding = false);
 
             void flush_output_buffer();
+            void next_out_chunk();
             void put_bits(uint bits, uint len);
+            void emit_bit_word(uint32 w);
+            void flush_bits();
 
             void emit_byte(uint8 i);
             void emit_word(uint i);
@@ -115,21 +256,30 @@ namespace jpge
             void emit_jfif_app0();
             void emit_dqt();
             void emit_sof();
-            void emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag);
+            void emit_dht(const uint8 *bits, const uint8 *val, int index, bool ac_flag);
             void emit_dhts();
             void emit_sos();
 
-            void compute_quant_table(int32 *dst, const int16 *src);
+            void compute_quant_table(uint8 *dst, const int16 *src);
             void load_quantized_coefficients(int component_num);
 
-            void load_block_8_8_grey(int x);
+            void load_block_8_8_grey(const uint8 * const *pLines, int x);
             void load_block_8_8(int x, int y, int c);
             void load_block_16_8(int x, int c);
             void load_block_16_8_8(int x, int c);
 
             void code_coefficients_pass_two(int component_num);
+            void code_dc(int component_num, int dc);
+            inline void put_ac_bits(uint bits, uint len);
+            bool code_cached_block(int component_num);
             void code_block(int component_num);
+            void code_flat_block(int component_num);
+            void thumb_block(int component_num, int x, int y, int h_rep, int v_rep);
+            void thumb_to_rgb();
 
+            template <int H_SAMP, int V_SAMP, bool FLAT_CHROMA> void process_y_rows(const uint8 * const *pLines);
+            template <int H_SAMP, int V_SAMP> void process_ycc_rows(const uint8 * const *pLines);
+            void select_kernels();
             void process_mcu_row();
             bool process_end_of_image();
             void load_mcu(const void* src);
@@ -12,6 +12,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <esp_timer.h>
 
 
 typedef WiFiClient *SOCKET;
@@ -58,6 +60,127 @@ inline UDPSOCKET udpsocketcreate(unsigned short portNum)
     return s;
 }
 
+// WiFiUDP keeps its socket to itself, so it can't be given the multicast TTL we announce in the SDP,
+// and lwip would send with its default of 255. This one has its own lwip socket behind the same calls.
+class MulticastUDP : public WiFiUDP
+{
+public:
+    MulticastUDP() : m_fd(-1), m_len(0), m_pos(0) {}
+    ~MulticastUDP() { stop(); }
+
+    bool open(IPAddress group, uint16_t port, uint8_t ttl)
+    {
+        m_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if(m_fd < 0)
+            return false;
+
+        int one = 1;
+        unsigned char mttl = ttl; // lwip wants a byte here
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port        = htons(port);
+        ip_mreq mreq;
+        mreq.imr_multiaddr.s_addr = (uint32_t)group;
+        mreq.imr_interface.s_addr = INADDR_ANY;
+        setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_TTL, &mttl, sizeof(mttl)) != 0 ||
+           bind(m_fd, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+           (port && setsockopt(m_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0)) {
+            stop();
+            return false;
+        }
+        return true;
+    }
+
+    void stop()
+    {
+        if(m_fd >= 0)
+            close(m_fd);
+        m_fd = -1;
+    }
+
+    // one datagram at a time in m_buf, being built between beginPacket and endPacket or read after parsePacket
+    int beginPacket(IPAddress ip, uint16_t port)
+    {
+        m_dest = ip;
+        m_port = port;
+        m_len = 0;
+        return 1;
+    }
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t len)
+    {
+        if(len > sizeof(m_buf) - m_len)
+            len = sizeof(m_buf) - m_len;
+        memcpy(m_buf + m_len, buf, len);
+        m_len += len;
+        return len;
+    }
+
+    int endPacket()
+    {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = (uint32_t)m_dest;
+        addr.sin_port        = htons(m_port);
+        return sendto(m_fd, m_buf, m_len, 0, (sockaddr *)&addr, sizeof(addr)) == (int)m_len;
+    }
+
+    int parsePacket()
+    {
+        int res = recv(m_fd, m_buf, sizeof(m_buf), MSG_DONTWAIT);
+        m_len = res > 0 ? res : 0;
+        m_pos = 0;
+        return m_len;
+    }
+
+    int read()
+    {
+        uint8_t c;
+        return read(&c, 1) == 1 ? c : -1;
+    }
+    int read(uint8_t *buf, size_t len)
+    {
+        if(len > m_len - m_pos)
+            len = m_len - m_pos;
+        memcpy(buf, m_buf + m_pos, len);
+        m_pos += len;
+        return len;
+    }
+
+private:
+    int m_fd;
+    IPAddress m_dest;
+    uint16_t m_port;
+    uint8_t m_buf[1500];
+    size_t m_len, m_pos;
+};
+
+// UDP socket for a multicast group: sends with ttl, and if portNum isn't 0 it joins the group to
+// receive on that port
+inline UDPSOCKET udpsocketcreatemulticast(IPADDRESS group, unsigned short portNum, uint8_t ttl)
+{
+    MulticastUDP *s = new MulticastUDP();
+
+    if(!s->open(group, portNum, ttl)) {
+        printf("Can't join multicast group on port %d\n", portNum);
+        delete s;
+        return NULL;
+    }
+
+    return s;
+}
+
+// Dotted quad text of an address, for SDP and transport headers
+inline void ipaddrstr(IPADDRESS addr, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s", addr.toString().c_str());
+}
+
 // TCP sending
 inline ssize_t socketsend(SOCKET sockfd, const void *buf, size_t len)
 {
@@ -75,6 +198,33 @@ inline ssize_t udpsocketsend(UDPSOCKET sockfd, const void *buf, size_t len,
     return len;
 }
 
+// Non blocking UDP receive, returns the number of bytes read or 0 if nothing is waiting
+inline int udpsocketrecv(UDPSOCKET sockfd, void *buf, size_t len)
+{
+    if(!sockfd->parsePacket())
+        return 0;
+    int res = sockfd->read((uint8_t *) buf, len);
+    return res > 0 ? res : 0;
+}
+
+#define msecnow() millis()
+#define usecnow() ((uint64_t) esp_timer_get_time()) // same clock as camera_fb_t::timestamp
+
+// No path MTU discovery in lwip, the caller's configured MTU is used
+inline int udpsocketmtu(IPADDRESS /*destaddr*/, uint16_t /*destport*/)
+{
+    return 0;
+}
+
+// Waits of a tick or more go through delay() so the WiFi task gets to run
+inline void usecsleep(uint32_t usec)
+{
+    if(usec >= 1000)
+        delay(usec / 1000);
+    else
+        delayMicroseconds(usec);
+}
+
 /**
    Read from a socket with a timeout.
 
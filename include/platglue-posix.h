@@ -9,6 +9,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/time.h>
 
 typedef int SOCKET;
 typedef int UDPSOCKET;
@@ -17,7 +19,49 @@ typedef uint16_t IPPORT; // on linux use network byte order
 
 #define NULLSOCKET 0
 
+// Output a nonblocking TCP socket couldn't take yet, sent in order by socketflush() once it is writable
+struct socketqueue
+{
+    char  *buf;
+    size_t sent;  // already sent from buf
+    size_t len;   // still waiting after that
+    size_t size;
+};
+
+// Queue of a socket, indexed by the fd. Only made once a send falls short, which blocking sockets never do,
+// so servers with a thread per client don't share it.
+inline socketqueue *socketgetqueue(SOCKET s, bool create)
+{
+    static socketqueue *queues;
+    static int count;
+
+    if(s >= count) {
+        if(!create)
+            return NULL;
+        int n = s + 16;
+        socketqueue *q = (socketqueue *)realloc(queues, n * sizeof(socketqueue));
+        if(!q)
+            return NULL;
+        memset(q + count, 0, (n - count) * sizeof(socketqueue));
+        queues = q;
+        count = n;
+    }
+    return &queues[s];
+}
+
+// Bytes waiting to be sent on s
+inline size_t socketpending(SOCKET s)
+{
+    socketqueue *q = socketgetqueue(s, false);
+    return q ? q->len : 0;
+}
+
 inline void closesocket(SOCKET s) {
+    socketqueue *q = socketgetqueue(s, false);
+    if(q) {
+        free(q->buf);
+        memset(q, 0, sizeof(*q));
+    }
     close(s);
 }
 
@@ -62,11 +106,100 @@ inline UDPSOCKET udpsocketcreate(unsigned short portNum)
     return s;
 }
 
-// TCP sending
+// UDP socket for a multicast group: sends with ttl, and if portNum isn't 0 it joins the group to
+// receive on that port. The port is shared so other programs on this host can listen to the group too.
+inline UDPSOCKET udpsocketcreatemulticast(IPADDRESS group, unsigned short portNum, uint8_t ttl)
+{
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0)
+        return 0;
+
+    int one = 1;
+    unsigned char mttl = ttl;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, &mttl, sizeof(mttl));
+    if (portNum) {
+        sockaddr_in addr;
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port        = htons(portNum);
+
+        ip_mreq mreq;
+        mreq.imr_multiaddr.s_addr = group;
+        mreq.imr_interface.s_addr = INADDR_ANY;
+        if (bind(s,(sockaddr*)&addr,sizeof(addr)) != 0 ||
+            setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+            printf("Error, can't join multicast group\n");
+            close(s);
+            s = 0;
+        }
+    }
+
+    return s;
+}
+
+// Dotted quad text of an address, for SDP and transport headers
+inline void ipaddrstr(IPADDRESS addr, char *buf, size_t len)
+{
+    in_addr a;
+    a.s_addr = addr;
+    snprintf(buf, len, "%s", inet_ntoa(a));
+}
+
+// TCP sending. What a nonblocking socket doesn't take is queued, so it is sent whole and in order.
 inline ssize_t socketsend(SOCKET sockfd, const void *buf, size_t len)
 {
     // printf("TCP send\n");
-    return send(sockfd, buf, len, 0);
+    ssize_t res = 0;
+    if(!socketpending(sockfd)) {
+        res = send(sockfd, buf, len, 0);
+        if(res == (ssize_t)len)
+            return res;
+        if(res < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            res = 0;
+        }
+    }
+
+    socketqueue *q = socketgetqueue(sockfd, true);
+    if(!q)
+        return -1;
+    if(q->sent + q->len + len - res > q->size) {
+        if(q->sent) {
+            memmove(q->buf, q->buf + q->sent, q->len);
+            q->sent = 0;
+        }
+        if(q->len + len - res > q->size) {
+            size_t size = q->size * 2 > q->len + len - res ? q->size * 2 : q->len + len - res;
+            char *grown = (char *)realloc(q->buf, size);
+            if(!grown)
+                return -1;
+            q->buf = grown;
+            q->size = size;
+        }
+    }
+    memcpy(q->buf + q->sent + q->len, (const char *)buf + res, len - res);
+    q->len += len - res;
+    return len;
+}
+
+// Send what socketsend() queued, for when the socket is writable again.
+// Returns the bytes still waiting, -1 if the connection failed.
+inline ssize_t socketflush(SOCKET sockfd)
+{
+    socketqueue *q = socketgetqueue(sockfd, false);
+    if(!q || !q->len)
+        return 0;
+
+    ssize_t res = send(sockfd, q->buf + q->sent, q->len, 0);
+    if(res < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? (ssize_t)q->len : -1;
+    q->sent += res;
+    q->len -= res;
+    if(!q->len)
+        q->sent = 0;
+    return q->len;
 }
 
 inline ssize_t udpsocketsend(UDPSOCKET sockfd, const void *buf, size_t len,
@@ -82,20 +215,78 @@ inline ssize_t udpsocketsend(UDPSOCKET sockfd, const void *buf, size_t len,
     return sendto(sockfd, buf, len, 0, (sockaddr *) &addr, sizeof(addr));
 }
 
+// Non blocking UDP receive, returns the number of bytes read or 0 if nothing is waiting
+inline int udpsocketrecv(UDPSOCKET sockfd, void *buf, size_t len)
+{
+    ssize_t res = recv(sockfd, buf, len, MSG_DONTWAIT);
+    return res > 0 ? res : 0;
+}
+
+// Monotonic milliseconds, wraps like the Arduino millis()
+inline uint32_t msecnow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Monotonic microseconds, the clock frame capture times are given in
+inline uint64_t usecnow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Path MTU towards destaddr, 0 if unknown
+inline int udpsocketmtu(IPADDRESS destaddr, uint16_t destport)
+{
+#ifdef IP_MTU
+    sockaddr_in addr;
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = destaddr;
+    addr.sin_port        = htons(destport);
+
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if(s < 0)
+        return 0;
+    // IP_MTU is only known on a connected socket
+    if(connect(s, (sockaddr *) &addr, sizeof(addr)) != 0 || getsockopt(s, IPPROTO_IP, IP_MTU, &mtu, &len) != 0)
+        mtu = 0;
+    close(s);
+    return mtu;
+#else
+    return 0;
+#endif
+}
+
+inline void usecsleep(uint32_t usec)
+{
+    usleep(usec);
+}
+
 /**
    Read from a socket with a timeout.
 
    Return 0=socket was closed by client, -1=timeout, >0 number of bytes read
+   A timeout of 0 doesn't wait, for callers that know the socket is readable (epoll).
  */
 inline int socketread(SOCKET sock, char *buf, size_t buflen, int timeoutmsec)
 {
-    // Use a timeout on our socket read to instead serve frames
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = timeoutmsec * 1000; // send a new frame ever
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    int flags = 0;
+    if(timeoutmsec == 0)
+        flags = MSG_DONTWAIT;
+    else {
+        // Use a timeout on our socket read to instead serve frames
+        struct timeval tv;
+        tv.tv_sec = timeoutmsec / 1000;
+        tv.tv_usec = (timeoutmsec % 1000) * 1000; // send a new frame ever
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    }
 
-    int res = recv(sock,buf,buflen,0);
+    int res = recv(sock,buf,buflen,flags);
     if(res > 0) {
         return res;
     }
@@ -0,0 +1,247 @@
+#include "CRtspServer.h"
+
+#ifndef ARDUINO_ARCH_ESP32
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+// epoll tags: what kind of socket in the low 2 bits, session slot + 1 above (0 for server sockets)
+#define TAG_LISTEN  0
+#define TAG_TIMER   1
+#define TAG_RTSP    2
+#define TAG_RTCP    3
+#define TAG(idx, kind) (((uint64_t)((idx) + 1) << 2) | (kind))
+
+CRtspServer::CRtspServer(u_short port, uint32_t msecPerFrame, int maxSessions)
+{
+    m_Port = port;
+    m_MsecPerFrame = msecPerFrame;
+    m_MaxSessions = maxSessions;
+    m_SessionCount = 0;
+    m_DroppedFrames = 0;
+    m_Slots = new Slot[maxSessions];
+    memset(m_Slots, 0, sizeof(Slot) * maxSessions);
+    m_MulticastStreamer = NULL;
+    m_MulticastRtcp = NULLSOCKET;
+
+    m_ListenSocket = -1;
+    m_Epoll = -1;
+    m_Timer = -1;
+    m_Running = false;
+}
+
+CRtspServer::~CRtspServer()
+{
+    for(int i = 0; i < m_MaxSessions; i++)
+        if(m_Slots[i].session)
+            CloseSession(i);
+    delete[] m_Slots;
+
+    if(m_Timer >= 0) close(m_Timer);
+    if(m_Epoll >= 0) close(m_Epoll);
+    if(m_ListenSocket >= 0) close(m_ListenSocket);
+}
+
+bool CRtspServer::Watch(int fd, uint64_t tag)
+{
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag;
+    if(epoll_ctl(m_Epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        printf("epoll_ctl failed %d\n", errno);
+        return false;
+    }
+    return true;
+}
+
+bool CRtspServer::Start()
+{
+    sockaddr_in addr;
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port        = htons(m_Port);
+
+    int one = 1;
+    m_ListenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    setsockopt(m_ListenSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(m_ListenSocket, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(m_ListenSocket, SOMAXCONN) != 0) {
+        printf("Can't listen on port %d\n", m_Port);
+        return false;
+    }
+
+    itimerspec its;
+    its.it_interval.tv_sec  = m_MsecPerFrame / 1000;
+    its.it_interval.tv_nsec = (m_MsecPerFrame % 1000) * 1000000;
+    its.it_value = its.it_interval;
+
+    m_Epoll = epoll_create1(0);
+    m_Timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if(m_Epoll < 0 || m_Timer < 0 || timerfd_settime(m_Timer, 0, &its, NULL) != 0) {
+        printf("Can't set up epoll or the frame timer\n");
+        return false;
+    }
+
+    return Watch(m_ListenSocket, TAG_LISTEN) && Watch(m_Timer, TAG_TIMER);
+}
+
+void CRtspServer::Run()
+{
+    m_Running = true;
+    while(m_Running)
+        Step(-1);
+}
+
+bool CRtspServer::Step(int timeoutMs)
+{
+    epoll_event events[RTSP_SERVER_MAX_EVENTS];
+
+    int n = epoll_wait(m_Epoll, events, RTSP_SERVER_MAX_EVENTS, timeoutMs);
+    if(n < 0)
+        return errno == EINTR;
+
+    for(int i = 0; i < n; i++) {
+        uint64_t tag = events[i].data.u64;
+        int idx = (int)(tag >> 2) - 1;
+
+        switch(tag & 3) {
+        case TAG_LISTEN: Accept(); break;
+        case TAG_TIMER:  Tick(); break;
+        case TAG_RTSP:
+            if(m_Slots[idx].session && (events[i].events & EPOLLOUT)) // may have closed earlier in this round
+                FlushSession(idx);
+            if(m_Slots[idx].session && (events[i].events & ~EPOLLOUT))
+                ServeSession(idx);
+            break;
+        case TAG_RTCP:
+            if(idx < 0)
+                m_MulticastStreamer->PollRtcp();
+            else if(m_Slots[idx].streamer)
+                m_Slots[idx].streamer->PollRtcp();
+            break;
+        }
+    }
+    return true;
+}
+
+void CRtspServer::Accept()
+{
+    int client;
+    while((client = accept4(m_ListenSocket, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        int idx = 0;
+        while(idx < m_MaxSessions && m_Slots[idx].session)
+            idx++;
+        if(idx == m_MaxSessions) {
+            printf("Too many RTSP sessions, refusing client\n");
+            close(client);
+            continue;
+        }
+
+        // The pacer sleeps between packets, which would hold up every other session on this thread,
+        // so frames go out back to back and the kernel's queue spreads them.
+        Slot &s = m_Slots[idx];
+        s.streamer = NewStreamer(client);
+        s.streamer->SetPacing(0);
+        s.streamer->SetFrameRate(1000 / m_MsecPerFrame);
+        s.session = new CRtspSession(client, s.streamer, m_MulticastStreamer);
+        s.client = client;
+        s.rtcpSocket = NULLSOCKET;
+        s.writeWatched = false;
+        m_SessionCount++;
+        Watch(client, TAG(idx, TAG_RTSP));
+    }
+}
+
+void CRtspServer::ServeSession(int idx)
+{
+    Slot &s = m_Slots[idx];
+
+    s.session->handleRequests(0);
+    if(s.session->m_stopped || !WatchOutput(idx)) {
+        CloseSession(idx);
+        return;
+    }
+
+    // SETUP of a UDP transport opens the streamer's RTCP socket
+    UDPSOCKET rtcp = s.streamer->GetRtcpSocket();
+    if(rtcp != NULLSOCKET && rtcp != s.rtcpSocket && Watch(rtcp, TAG(idx, TAG_RTCP)))
+        s.rtcpSocket = rtcp;
+}
+
+void CRtspServer::CloseSession(int idx)
+{
+    Slot &s = m_Slots[idx];
+
+    // closing the sockets also takes them out of the epoll set
+    delete s.session;
+    delete s.streamer;
+    memset(&s, 0, sizeof(s));
+    m_SessionCount--;
+}
+
+// Send what the client's socket couldn't take before
+void CRtspServer::FlushSession(int idx)
+{
+    Slot &s = m_Slots[idx];
+
+    size_t before = socketpending(s.client);
+    ssize_t left = socketflush(s.client);
+    if(left >= 0 && (size_t)left < before)
+        s.stalledMsec = msecnow();
+    if(left < 0 || !WatchOutput(idx))
+        CloseSession(idx);
+}
+
+// Ask for EPOLLOUT while output is queued, false if the client has taken none of it for too long
+bool CRtspServer::WatchOutput(int idx)
+{
+    Slot &s = m_Slots[idx];
+    bool pending = socketpending(s.client) != 0;
+
+    if(pending && !s.writeWatched)
+        s.stalledMsec = msecnow();
+    if(pending != s.writeWatched) {
+        epoll_event ev;
+        ev.events = pending ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        ev.data.u64 = TAG(idx, TAG_RTSP);
+        epoll_ctl(m_Epoll, EPOLL_CTL_MOD, s.client, &ev);
+        s.writeWatched = pending;
+    }
+    if(pending && msecnow() - s.stalledMsec > RTSP_SERVER_STALL_MSEC) {
+        printf("RTSP client stalled, closing it\n");
+        return false;
+    }
+    return true;
+}
+
+void CRtspServer::Tick()
+{
+    uint64_t expirations;
+    if(read(m_Timer, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    uint32_t now = msecnow();
+    for(int i = 0; i < m_MaxSessions; i++) {
+        Slot &s = m_Slots[i];
+        if(!s.session)
+            continue;
+        // a client still taking the last frame skips this one, rather than queueing without end
+        if(socketpending(s.client))
+            m_DroppedFrames++;
+        else
+            s.session->broadcastCurrentFrame(now);
+        if(!WatchOutput(i))
+            CloseSession(i);
+    }
+
+    if(m_MulticastStreamer) {
+        UDPSOCKET rtcp = m_MulticastStreamer->GetRtcpSocket();
+        if(rtcp != NULLSOCKET && rtcp != m_MulticastRtcp && Watch(rtcp, TAG(-1, TAG_RTCP))) {
+            m_MulticastStreamer->SetPacing(0);
+            m_MulticastRtcp = rtcp;
+        }
+        if(m_MulticastStreamer->GetViewers())
+            m_MulticastStreamer->streamImage(now);
+    }
+}
+
+#endif
@@ -2,10 +2,25 @@
 #include <stdio.h>
 #include <time.h>
 
-CRtspSession::CRtspSession(SOCKET aRtspClient, CStreamer * aStreamer) : m_RtspClient(aRtspClient),m_Streamer(aStreamer)
+CRtspSession::CRtspSession(SOCKET aRtspClient, CStreamer * aStreamer, CStreamer * aMulticastStreamer) :
+    m_RtspClient(aRtspClient),m_Streamer(aStreamer),m_MulticastStreamer(aMulticastStreamer)
 {
     printf("Creating RTSP session\n");
-    Init();
+    memset(&m_Request, 0x00, sizeof(m_Request));
+    m_RecvLen = 0;
+    m_Date[0] = 0;
+    m_DateTime = 0;
+
+    int Profiles = aStreamer->GetProfileCount();
+    if (Profiles > RTSP_MAX_PROFILES) Profiles = RTSP_MAX_PROFILES;
+    for (int i = 0; i < Profiles; i++)
+    {
+        aStreamer->SetProfile(i);
+        UpdateSdp(i, aStreamer);
+    }
+    aStreamer->SetProfile(0);
+    if (aMulticastStreamer)
+        UpdateSdp(RTSP_MULTICAST_STREAM, aMulticastStreamer);
 
     m_RtspSessionID  = getRandom();         // create a session ID
     m_RtspSessionID |= 0x80000000;
@@ -13,351 +28,257 @@ CRtspSession::CRtspSession(SOCKET aRtspClient, CStreamer * aStreamer) : m_RtspCl
     m_ClientRTPPort  =  0;
     m_ClientRTCPPort =  0;
     m_TcpTransport   =  false;
+    m_Multicast      =  false;
     m_streaming = false;
     m_stopped = false;
 };
 
 CRtspSession::~CRtspSession()
 {
+    if (m_Multicast && m_streaming)
+        m_MulticastStreamer->RemoveViewer();
     closesocket(m_RtspClient);
 };
 
-void CRtspSession::Init()
+RTSP_CMD_TYPES CRtspSession::Handle_RtspRequest(char const * aRequest, unsigned aRequestSize)
 {
-    m_RtspCmdType   = RTSP_UNKNOWN;
-    memset(m_URLPreSuffix, 0x00, sizeof(m_URLPreSuffix));
-    memset(m_URLSuffix,    0x00, sizeof(m_URLSuffix));
-    memset(m_CSeq,         0x00, sizeof(m_CSeq));
-    memset(m_URLHostPort,  0x00, sizeof(m_URLHostPort));
-    m_ContentLength  =  0;
+    if (parseRtspRequest(aRequest,aRequestSize,&m_Request) <= 0)
+        return RTSP_UNKNOWN;
+    return Dispatch();
 };
 
-bool CRtspSession::ParseRtspRequest(char const * aRequest, unsigned aRequestSize)
+RTSP_CMD_TYPES CRtspSession::Dispatch()
 {
-    char CmdName[RTSP_PARAM_STRING_MAX];
-    static char CurRequest[RTSP_BUFFER_SIZE]; // Note: we assume single threaded, this large buf we keep off of the tiny stack
-    unsigned CurRequestSize;
-
-    Init();
-    CurRequestSize = aRequestSize;
-    memcpy(CurRequest,aRequest,aRequestSize);
-
-    // check whether the request contains information about the RTP/RTCP UDP client ports (SETUP command)
-    char * ClientPortPtr;
-    char * TmpPtr;
-    static char CP[1024];
-    char * pCP;
-
-    ClientPortPtr = strstr(CurRequest,"client_port");
-    if (ClientPortPtr != nullptr)
-    {
-        TmpPtr = strstr(ClientPortPtr,"\r\n");
-        if (TmpPtr != nullptr)
-        {
-            TmpPtr[0] = 0x00;
-            strcpy(CP,ClientPortPtr);
-            pCP = strstr(CP,"=");
-            if (pCP != nullptr)
-            {
-                pCP++;
-                strcpy(CP,pCP);
-                pCP = strstr(CP,"-");
-                if (pCP != nullptr)
-                {
-                    pCP[0] = 0x00;
-                    m_ClientRTPPort  = atoi(CP);
-                    m_ClientRTCPPort = m_ClientRTPPort + 1;
-                };
-            };
-        };
-    };
+    printf("RTSP received %.*s\n", RTSPVIEW(m_Request.method));
 
-    // Read everything up to the first space as the command name
-    bool parseSucceeded = false;
-    unsigned i;
-    for (i = 0; i < sizeof(CmdName)-1 && i < CurRequestSize; ++i)
+    switch (m_Request.cmd)
     {
-        char c = CurRequest[i];
-        if (c == ' ' || c == '\t')
-        {
-            parseSucceeded = true;
-            break;
+    case RTSP_OPTIONS:  { Handle_RtspOPTION();   break; };
+    case RTSP_DESCRIBE: { Handle_RtspDESCRIBE(); break; };
+    case RTSP_SETUP:    { Handle_RtspSETUP();    break; };
+    case RTSP_PLAY:     { Handle_RtspPLAY();     break; };
+    case RTSP_TEARDOWN: break;
+    default:
+        {   // answer anyway, pipelining clients wait for each response in turn
+            snprintf(m_Response,sizeof(m_Response),
+                     "RTSP/1.0 501 Not Implemented\r\nCSeq: %.*s\r\n\r\n",RTSPVIEW(m_Request.cseq));
+            socketsend(m_RtspClient,m_Response,strlen(m_Response));
         }
-        CmdName[i] = c;
-    }
-    CmdName[i] = '\0';
-    if (!parseSucceeded) {
-        printf("failed to parse RTSP\n");
-        return false;
-    }
-
-    printf("RTSP received %s\n", CmdName);
-
-    // find out the command type
-    if (strstr(CmdName,"OPTIONS")   != nullptr) m_RtspCmdType = RTSP_OPTIONS; else
-    if (strstr(CmdName,"DESCRIBE")  != nullptr) m_RtspCmdType = RTSP_DESCRIBE; else
-    if (strstr(CmdName,"SETUP")     != nullptr) m_RtspCmdType = RTSP_SETUP; else
-    if (strstr(CmdName,"PLAY")      != nullptr) m_RtspCmdType = RTSP_PLAY; else
-    if (strstr(CmdName,"TEARDOWN")  != nullptr) m_RtspCmdType = RTSP_TEARDOWN;
-
-    // check whether the request contains transport information (UDP or TCP)
-    if (m_RtspCmdType == RTSP_SETUP)
-    {
-        TmpPtr = strstr(CurRequest,"RTP/AVP/TCP");
-        if (TmpPtr != nullptr) m_TcpTransport = true; else m_TcpTransport = false;
     };
+    return m_Request.cmd;
+};
 
-    // Skip over the prefix of any "rtsp://" or "rtsp:/" URL that follows:
-    unsigned j = i+1;
-    while (j < CurRequestSize && (CurRequest[j] == ' ' || CurRequest[j] == '\t')) ++j; // skip over any additional white space
-    for (; (int)j < (int)(CurRequestSize-8); ++j)
-    {
-        if ((CurRequest[j]   == 'r' || CurRequest[j]   == 'R')   &&
-            (CurRequest[j+1] == 't' || CurRequest[j+1] == 'T') &&
-            (CurRequest[j+2] == 's' || CurRequest[j+2] == 'S') &&
-            (CurRequest[j+3] == 'p' || CurRequest[j+3] == 'P') &&
-            CurRequest[j+4] == ':' && CurRequest[j+5] == '/')
-        {
-            j += 6;
-            if (CurRequest[j] == '/')
-            {   // This is a "rtsp://" URL; skip over the host:port part that follows:
-                ++j;
-                unsigned uidx = 0;
-                while (j < CurRequestSize && CurRequest[j] != '/' && CurRequest[j] != ' ' && uidx < sizeof(m_URLHostPort) - 1)
-                {   // extract the host:port part of the URL here
-                    m_URLHostPort[uidx] = CurRequest[j];
-                    uidx++;
-                    ++j;
-                };
-            }
-            else --j;
-            i = j;
-            break;
-        }
-    }
-
-    // Look for the URL suffix (before the following "RTSP/"):
-    parseSucceeded = false;
-    for (unsigned k = i+1; (int)k < (int)(CurRequestSize-5); ++k)
-    {
-        if (CurRequest[k]   == 'R'   && CurRequest[k+1] == 'T'   &&
-            CurRequest[k+2] == 'S'   && CurRequest[k+3] == 'P'   &&
-            CurRequest[k+4] == '/')
-        {
-            while (--k >= i && CurRequest[k] == ' ') {}
-            unsigned k1 = k;
-            while (k1 > i && CurRequest[k1] != '/') --k1;
-            if (k - k1 + 1 > sizeof(m_URLSuffix)) return false;
-            unsigned n = 0, k2 = k1+1;
-
-            while (k2 <= k) m_URLSuffix[n++] = CurRequest[k2++];
-            m_URLSuffix[n] = '\0';
-
-            if (k1 - i > sizeof(m_URLPreSuffix)) return false;
-            n = 0; k2 = i + 1;
-            while (k2 <= k1 - 1) m_URLPreSuffix[n++] = CurRequest[k2++];
-            m_URLPreSuffix[n] = '\0';
-            i = k + 7;
-            parseSucceeded = true;
-            break;
-        }
-    }
-    if (!parseSucceeded) return false;
+void CRtspSession::Handle_RtspOPTION()
+{
+    snprintf(m_Response,sizeof(m_Response),
+             "RTSP/1.0 200 OK\r\nCSeq: %.*s\r\n"
+             "Public: DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE\r\n\r\n",RTSPVIEW(m_Request.cseq));
 
-    // Look for "CSeq:", skip whitespace, then read everything up to the next \r or \n as 'CSeq':
-    parseSucceeded = false;
-    for (j = i; (int)j < (int)(CurRequestSize-5); ++j)
-    {
-        if (CurRequest[j]   == 'C' && CurRequest[j+1] == 'S' &&
-            CurRequest[j+2] == 'e' && CurRequest[j+3] == 'q' &&
-            CurRequest[j+4] == ':')
-        {
-            j += 5;
-            while (j < CurRequestSize && (CurRequest[j] ==  ' ' || CurRequest[j] == '\t')) ++j;
-            unsigned n;
-            for (n = 0; n < sizeof(m_CSeq)-1 && j < CurRequestSize; ++n,++j)
-            {
-                char c = CurRequest[j];
-                if (c == '\r' || c == '\n')
-                {
-                    parseSucceeded = true;
-                    break;
-                }
-                m_CSeq[n] = c;
-            }
-            m_CSeq[n] = '\0';
-            break;
-        }
-    }
-    if (!parseSucceeded) return false;
+    socketsend(m_RtspClient,m_Response,strlen(m_Response));
+}
 
-    // Also: Look for "Content-Length:" (optional)
-    for (j = i; (int)j < (int)(CurRequestSize-15); ++j)
-    {
-        if (CurRequest[j]    == 'C'  && CurRequest[j+1]  == 'o'  &&
-            CurRequest[j+2]  == 'n'  && CurRequest[j+3]  == 't'  &&
-            CurRequest[j+4]  == 'e'  && CurRequest[j+5]  == 'n'  &&
-            CurRequest[j+6]  == 't'  && CurRequest[j+7]  == '-'  &&
-            (CurRequest[j+8] == 'L' || CurRequest[j+8]   == 'l') &&
-            CurRequest[j+9]  == 'e'  && CurRequest[j+10] == 'n' &&
-            CurRequest[j+11] == 'g' && CurRequest[j+12]  == 't' &&
-            CurRequest[j+13] == 'h' && CurRequest[j+14] == ':')
-        {
-            j += 15;
-            while (j < CurRequestSize && (CurRequest[j] ==  ' ' || CurRequest[j] == '\t')) ++j;
-            unsigned num;
-            if (sscanf(&CurRequest[j], "%u", &num) == 1) m_ContentLength = num;
-        }
-    }
-    return true;
-};
+// Everything in the SDP after the origin line only depends on the stream's configuration, so it is
+// kept per stream and rebuilt when that changes. Sessions are created by one thread, which is the
+// only one writing it.
+RtspSdpCache CRtspSession::s_Sdp[RTSP_STREAM_COUNT];
 
-RTSP_CMD_TYPES CRtspSession::Handle_RtspRequest(char const * aRequest, unsigned aRequestSize)
+void CRtspSession::UpdateSdp(int aStreamID, CStreamer * aStreamer)
 {
-    if (ParseRtspRequest(aRequest,aRequestSize))
-    {
-        switch (m_RtspCmdType)
-        {
-        case RTSP_OPTIONS:  { Handle_RtspOPTION();   break; };
-        case RTSP_DESCRIBE: { Handle_RtspDESCRIBE(); break; };
-        case RTSP_SETUP:    { Handle_RtspSETUP();    break; };
-        case RTSP_PLAY:     { Handle_RtspPLAY();     break; };
-        default: {};
-        };
-    };
-    return m_RtspCmdType;
-};
+    RtspSdpCache & c = s_Sdp[aStreamID];
 
-void CRtspSession::Handle_RtspOPTION()
-{
-    static char Response[1024]; // Note: we assume single threaded, this large buf we keep off of the tiny stack
+    // the multicast stream announces its group, the others are set up per client
+    bool Multicast = aStreamer->IsMulticast();
+    IPADDRESS Group = Multicast ? aStreamer->GetMulticastGroup() : IPADDRESS();
+    IPPORT Port = Multicast ? aStreamer->GetRtpServerPort() : 0;
+    uint8_t Ttl = Multicast ? aStreamer->GetMulticastTtl() : 0;
 
-    snprintf(Response,sizeof(Response),
-             "RTSP/1.0 200 OK\r\nCSeq: %s\r\n"
-             "Public: DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE\r\n\r\n",m_CSeq);
+    if (c.sessionId && c.width == aStreamer->GetWidth() && c.height == aStreamer->GetHeight() &&
+        c.fps == aStreamer->GetFrameRate() && c.group == Group && c.port == Port && c.ttl == Ttl)
+        return;
 
-    socketsend(m_RtspClient,Response,strlen(Response));
+    if (!c.sessionId)
+        c.sessionId = getRandom() | 0x80000000;
+    c.version++;
+    c.width  = aStreamer->GetWidth();
+    c.height = aStreamer->GetHeight();
+    c.fps    = aStreamer->GetFrameRate();
+    c.group  = Group;
+    c.port   = Port;
+    c.ttl    = Ttl;
+
+    char GroupBuf[20] = "0.0.0.0";
+    char TtlBuf[8] = "";
+    char RateBuf[24] = "";
+    if (Multicast) ipaddrstr(Group, GroupBuf, sizeof(GroupBuf));
+    if (Ttl) snprintf(TtlBuf,sizeof(TtlBuf),"/%d",Ttl);
+    if (c.fps) snprintf(RateBuf,sizeof(RateBuf),"a=framerate:%d\r\n",c.fps);
+
+    snprintf(c.body,sizeof(c.body),
+             "s=\r\n"
+             "t=0 0\r\n"                                       // start / stop - 0 -> unbounded and permanent session
+             "a=control:*\r\n"
+             "m=video %d RTP/AVP 26\r\n"
+             "c=IN IP4 %s%s\r\n"
+             "a=control:track1\r\n"
+             "a=x-dimensions:%d,%d\r\n"                        // so clients needn't wait for a frame to size their window
+             "%s",
+             Port,
+             GroupBuf,
+             TtlBuf,
+             c.width,
+             c.height,
+             RateBuf);
+    c.len = strlen(c.body);
 }
 
 void CRtspSession::Handle_RtspDESCRIBE()
 {
-    static char Response[1024]; // Note: we assume single threaded, this large buf we keep off of the tiny stack
-    static char SDPBuf[1024];
-    static char URLBuf[1024];
 
     // check whether we know a stream with the URL which is requested
     m_StreamID = -1;        // invalid URL
-    if ((strcmp(m_URLPreSuffix,"mjpeg") == 0) && (strcmp(m_URLSuffix,"1") == 0)) m_StreamID = 0; else
-    if ((strcmp(m_URLPreSuffix,"mjpeg") == 0) && (strcmp(m_URLSuffix,"2") == 0)) m_StreamID = 1;
+    if (rtspViewEquals(m_Request.urlPreSuffix,"mjpeg"))
+    {
+        if (rtspViewEquals(m_Request.urlSuffix,"multicast"))
+        {
+            if (m_MulticastStreamer) m_StreamID = RTSP_MULTICAST_STREAM;
+        }
+        else
+        {   // the profile names, each an encoding of the same capture
+            m_StreamID = m_Streamer->FindProfile(m_Request.urlSuffix.ptr,m_Request.urlSuffix.len);
+            if (m_StreamID >= RTSP_MAX_PROFILES) m_StreamID = -1;
+            if (m_StreamID >= 0) m_Streamer->SetProfile(m_StreamID);
+        }
+    }
     if (m_StreamID == -1)
     {   // Stream not available
-        snprintf(Response,sizeof(Response),
-                 "RTSP/1.0 404 Stream Not Found\r\nCSeq: %s\r\n%s\r\n",
-                 m_CSeq,
+        snprintf(m_Response,sizeof(m_Response),
+                 "RTSP/1.0 404 Stream Not Found\r\nCSeq: %.*s\r\n%s\r\n",
+                 RTSPVIEW(m_Request.cseq),
                  DateHeader());
 
-        socketsend(m_RtspClient,Response,strlen(Response));
+        socketsend(m_RtspClient,m_Response,strlen(m_Response));
         return;
     };
 
     // simulate DESCRIBE server response
-    static char OBuf[256];
-    char * ColonPtr;
-    strcpy(OBuf,m_URLHostPort);
-    ColonPtr = strstr(OBuf,":");
-    if (ColonPtr != nullptr) ColonPtr[0] = 0x00;
+    RtspView Host = m_Request.urlHostPort;
+    const char * ColonPtr = (const char *) memchr(Host.ptr, ':', Host.len);
+    if (ColonPtr != nullptr) Host.len = ColonPtr - Host.ptr;
 
-    snprintf(SDPBuf,sizeof(SDPBuf),
+    const RtspSdpCache & Sdp = s_Sdp[m_StreamID];
+    char Origin[128];
+    snprintf(Origin,sizeof(Origin),
              "v=0\r\n"
-             "o=- %d 1 IN IP4 %s\r\n"
-             "s=\r\n"
-             "t=0 0\r\n"                                       // start / stop - 0 -> unbounded and permanent session
-             "m=video 0 RTP/AVP 26\r\n"                        // currently we just handle UDP sessions
-             // "a=x-dimensions: 640,480\r\n"
-             "c=IN IP4 0.0.0.0\r\n",
-             rand(),
-             OBuf);
-    char StreamName[64];
-    switch (m_StreamID)
-    {
-    case 0: strcpy(StreamName,"mjpeg/1"); break;
-    case 1: strcpy(StreamName,"mjpeg/2"); break;
-    };
-    snprintf(URLBuf,sizeof(URLBuf),
-             "rtsp://%s/%s",
-             m_URLHostPort,
-             StreamName);
-    snprintf(Response,sizeof(Response),
-             "RTSP/1.0 200 OK\r\nCSeq: %s\r\n"
+             "o=- %u %u IN IP4 %.*s\r\n",
+             (unsigned) Sdp.sessionId,
+             (unsigned) Sdp.version,
+             RTSPVIEW(Host));
+    snprintf(m_Response,sizeof(m_Response),
+             "RTSP/1.0 200 OK\r\nCSeq: %.*s\r\n"
              "%s\r\n"
-             "Content-Base: %s/\r\n"
+             "Content-Base: rtsp://%.*s/mjpeg/%.*s/\r\n"
              "Content-Type: application/sdp\r\n"
              "Content-Length: %d\r\n\r\n"
-             "%s",
-             m_CSeq,
+             "%s%s",
+             RTSPVIEW(m_Request.cseq),
              DateHeader(),
-             URLBuf,
-             (int) strlen(SDPBuf),
-             SDPBuf);
+             RTSPVIEW(m_Request.urlHostPort),
+             RTSPVIEW(m_Request.urlSuffix),
+             (int) (strlen(Origin) + Sdp.len),
+             Origin,
+             Sdp.body);
 
-    socketsend(m_RtspClient,Response,strlen(Response));
+    socketsend(m_RtspClient,m_Response,strlen(m_Response));
 }
 
 void CRtspSession::Handle_RtspSETUP()
 {
-    static char Response[1024];
-    static char Transport[255];
+    char Transport[128];
 
-    // init RTP streamer transport type (UDP or TCP) and ports for UDP transport
-    m_Streamer->InitTransport(m_ClientRTPPort,m_ClientRTCPPort,m_TcpTransport);
+    m_ClientRTPPort  = m_Request.clientRtpPort;
+    m_ClientRTCPPort = m_Request.clientRtcpPort;
+    m_TcpTransport   = m_Request.tcpTransport;
 
-    // simulate SETUP server response
-    if (m_TcpTransport)
-        snprintf(Transport,sizeof(Transport),"RTP/AVP/TCP;unicast;interleaved=0-1");
-    else
+    if (m_Request.multicast || m_StreamID == RTSP_MULTICAST_STREAM)
+    {   // join the shared multicast stream, the group and ports are ours to pick
+        if (!m_MulticastStreamer)
+        {
+            snprintf(m_Response,sizeof(m_Response),
+                     "RTSP/1.0 461 Unsupported Transport\r\nCSeq: %.*s\r\n%s\r\n",
+                     RTSPVIEW(m_Request.cseq),
+                     DateHeader());
+
+            socketsend(m_RtspClient,m_Response,strlen(m_Response));
+            return;
+        }
+        m_Multicast = true;
+
+        char Group[20];
+        ipaddrstr(m_MulticastStreamer->GetMulticastGroup(), Group, sizeof(Group));
         snprintf(Transport,sizeof(Transport),
-                 "RTP/AVP;unicast;destination=127.0.0.1;source=127.0.0.1;client_port=%i-%i;server_port=%i-%i",
-                 m_ClientRTPPort,
-                 m_ClientRTCPPort,
-                 m_Streamer->GetRtpServerPort(),
-                 m_Streamer->GetRtcpServerPort());
-    snprintf(Response,sizeof(Response),
-             "RTSP/1.0 200 OK\r\nCSeq: %s\r\n"
+                 "RTP/AVP;multicast;destination=%s;port=%i-%i;ttl=%i",
+                 Group,
+                 m_MulticastStreamer->GetRtpServerPort(),
+                 m_MulticastStreamer->GetRtcpServerPort(),
+                 m_MulticastStreamer->GetMulticastTtl());
+    }
+    else
+    {
+        // init RTP streamer transport type (UDP or TCP) and ports for UDP transport
+        m_Streamer->InitTransport(m_ClientRTPPort,m_ClientRTCPPort,m_TcpTransport);
+
+        // simulate SETUP server response
+        if (m_TcpTransport)
+            snprintf(Transport,sizeof(Transport),"RTP/AVP/TCP;unicast;interleaved=0-1");
+        else
+            snprintf(Transport,sizeof(Transport),
+                     "RTP/AVP;unicast;destination=127.0.0.1;source=127.0.0.1;client_port=%i-%i;server_port=%i-%i",
+                     m_ClientRTPPort,
+                     m_ClientRTCPPort,
+                     m_Streamer->GetRtpServerPort(),
+                     m_Streamer->GetRtcpServerPort());
+    }
+    snprintf(m_Response,sizeof(m_Response),
+             "RTSP/1.0 200 OK\r\nCSeq: %.*s\r\n"
              "%s\r\n"
              "Transport: %s\r\n"
              "Session: %i\r\n\r\n",
-             m_CSeq,
+             RTSPVIEW(m_Request.cseq),
              DateHeader(),
              Transport,
              m_RtspSessionID);
 
-    socketsend(m_RtspClient,Response,strlen(Response));
+    socketsend(m_RtspClient,m_Response,strlen(m_Response));
 }
 
 void CRtspSession::Handle_RtspPLAY()
 {
-    static char Response[1024];
 
     // simulate SETUP server response
-    snprintf(Response,sizeof(Response),
-             "RTSP/1.0 200 OK\r\nCSeq: %s\r\n"
+    snprintf(m_Response,sizeof(m_Response),
+             "RTSP/1.0 200 OK\r\nCSeq: %.*s\r\n"
              "%s\r\n"
              "Range: npt=0.000-\r\n"
              "Session: %i\r\n"
              "RTP-Info: url=rtsp://127.0.0.1:8554/mjpeg/1/track1\r\n\r\n",
-             m_CSeq,
+             RTSPVIEW(m_Request.cseq),
              DateHeader(),
              m_RtspSessionID);
 
-    socketsend(m_RtspClient,Response,strlen(Response));
+    socketsend(m_RtspClient,m_Response,strlen(m_Response));
 }
 
 char const * CRtspSession::DateHeader()
 {
-    static char buf[200];
+    // a client sends several requests within the same second
     time_t tt = time(NULL);
-    strftime(buf, sizeof buf, "Date: %a, %b %d %Y %H:%M:%S GMT", gmtime(&tt));
-    return buf;
+    if (tt != m_DateTime || !m_Date[0])
+    {
+        struct tm tm;
+        strftime(m_Date, sizeof(m_Date), "Date: %a, %b %d %Y %H:%M:%S GMT", gmtime_r(&tt, &tm));
+        m_DateTime = tt;
+    }
+    return m_Date;
 }
 
 int CRtspSession::GetStreamID()
@@ -375,19 +296,62 @@ bool CRtspSession::handleRequests(uint32_t readTimeoutMs)
     if(m_stopped)
         return false; // Already closed down
 
-    static char RecvBuf[RTSP_BUFFER_SIZE];   // Note: we assume single threaded, this large buf we keep off of the tiny stack
-
-    memset(RecvBuf,0x00,sizeof(RecvBuf));
-    int res = socketread(m_RtspClient,RecvBuf,sizeof(RecvBuf), readTimeoutMs);
+    // anything left over from the last read stays at the start of m_RecvBuf
+    int res = socketread(m_RtspClient,m_RecvBuf + m_RecvLen,sizeof(m_RecvBuf) - m_RecvLen, readTimeoutMs);
     if(res > 0) {
-        // we filter away everything which seems not to be an RTSP command: O-ption, D-escribe, S-etup, P-lay, T-eardown
-        if ((RecvBuf[0] == 'O') || (RecvBuf[0] == 'D') || (RecvBuf[0] == 'S') || (RecvBuf[0] == 'P') || (RecvBuf[0] == 'T'))
+        m_RecvLen += res;
+
+        unsigned pos = 0;
+        while (pos < m_RecvLen && !m_stopped)
         {
-            RTSP_CMD_TYPES C = Handle_RtspRequest(RecvBuf,res);
+            char * p = m_RecvBuf + pos;
+            unsigned avail = m_RecvLen - pos;
+            if (*p == '$')
+            {   // with TCP transport RTCP receiver reports come interleaved: '$', channel, 2 byte length, packet
+                if (avail < 4)
+                    break;
+                unsigned len = ((uint8_t) p[2] << 8) | (uint8_t) p[3];
+                if (4 + len > avail)
+                    break;
+                if (p[1] == 1) // interleaved=0-1, RTCP on channel 1
+                    m_Streamer->HandleRtcpPacket((unsigned const char *) p + 4, len);
+                pos += 4 + len;
+                continue;
+            }
+            if (*p == '\r' || *p == '\n')
+            {   // empty lines between requests are keep alives, don't let them pile up
+                pos++;
+                continue;
+            }
+
+            int used = parseRtspRequest(p, avail, &m_Request);
+            if (used == 0)
+                break; // the rest of it comes with a later read
+            if (used < 0)
+            {   // not RTSP, drop what we have
+                printf("failed to parse RTSP\n");
+                pos = m_RecvLen;
+                break;
+            }
+
+            RTSP_CMD_TYPES C = Dispatch();
             if (C == RTSP_PLAY)
+            {
+                if (m_Multicast && !m_streaming)
+                    m_MulticastStreamer->AddViewer();
                 m_streaming = true;
+            }
             else if (C == RTSP_TEARDOWN)
                 m_stopped = true;
+            pos += used;
+        }
+
+        m_RecvLen -= pos;
+        memmove(m_RecvBuf, m_RecvBuf + pos, m_RecvLen);
+        if (m_RecvLen == sizeof(m_RecvBuf))
+        {   // a request that can never fit
+            printf("RTSP request too long\n");
+            m_RecvLen = 0;
         }
         return true;
     }
@@ -405,7 +369,7 @@ bool CRtspSession::handleRequests(uint32_t readTimeoutMs)
 
 void CRtspSession::broadcastCurrentFrame(uint32_t curMsec) {
     // Send a frame
-    if (m_streaming && !m_stopped) {
+    if (m_streaming && !m_stopped && !m_Multicast) {
         // printf("serving a frame\n");
         m_Streamer->streamImage(curMsec);
     }
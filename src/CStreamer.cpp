@@ -1,7 +1,25 @@
 #include "CStreamer.h"
 
+#include <stdint.h>
 #include <stdio.h>
 
+#define RTP_SSRC 0x13f97e67 // we just use an arbitrary number here to keep it simple
+#define RTCP_SR_INTERVAL_MS 5000 // RFC 3550 minimum report interval
+#define RTCP_CNAME "esp32cam"
+#define NTP_UNIX_OFFSET 2208988800UL // seconds from 1900 to 1970
+#define PACING_DEFAULT_PERCENT 50  // spread a frame over half the frame interval
+#define PACING_BURST_BYTES 3000    // token bucket depth, about two full packets
+
+#define KRtpHeaderSize 12           // size of the RTP header
+#define KJpegHeaderSize 8           // size of the special JPEG payload header
+#define KQuantHeaderSize (4 + 64 * 2) // quant table header and two 64 byte tables
+#define KIpHeaderSize 20
+#define KUdpHeaderSize 8
+#define KTcpHeaderSize (20 + 4)     // TCP header plus the 4 byte RTP over RTSP header
+#define DEFAULT_MTU 1500            // ethernet and WiFi
+#define MIN_MTU 576                 // every IPv4 host must take this
+#define RTP_BUF_SIZE 2048
+
 CStreamer::CStreamer(SOCKET aClient, u_short width, u_short height) : m_Client(aClient)
 {
     printf("Creating TSP streamer\n");
@@ -14,13 +32,33 @@ CStreamer::CStreamer(SOCKET aClient, u_short width, u_short height) : m_Client(a
     m_Timestamp      = 0;
     m_SendIdx        = 0;
     m_TCPTransport   = false;
+    m_DestAddr       = IPADDRESS();
+    m_Multicast      = false;
+    m_MulticastTtl   = 0;
+    m_Viewers        = 0;
 
     m_RtpSocket = NULLSOCKET;
     m_RtcpSocket = NULLSOCKET;
 
     m_width = width;
     m_height = height;
-    m_prevMsec = 0;
+    m_FrameRate = 0;
+    m_JpegType = 1;
+    SetMtu(DEFAULT_MTU);
+    m_FirstCaptureUsec = 0;
+    m_PacketCount = 0;
+    m_OctetCount = 0;
+
+    m_PacingPercent = PACING_DEFAULT_PERCENT;
+    m_PaceRate = 0;
+    m_PaceTokens = 0;
+    m_PaceUsec = 0;
+    memset(&m_PacerStats, 0, sizeof(m_PacerStats));
+
+    memset(m_Receivers, 0, sizeof(m_Receivers));
+    m_ReceiverCount = 0;
+    m_LastSrNtp = 0;
+    m_LastSrMsec = 0;
 };
 
 CStreamer::~CStreamer()
@@ -29,25 +67,43 @@ CStreamer::~CStreamer()
     udpsocketclose(m_RtcpSocket);
 };
 
-int CStreamer::SendRtpPacket(unsigned const char * jpeg, int jpegLen, int fragmentOffset, BufPtr quant0tbl, BufPtr quant1tbl)
+int CStreamer::FindProfile(const char *name, unsigned len)
 {
-#define KRtpHeaderSize 12           // size of the RTP header
-#define KJpegHeaderSize 8           // size of the special JPEG payload header
+    if(len == 1 && (name[0] == '1' || name[0] == '2'))
+        return 0;
+    return -1;
+}
+
+void CStreamer::SetMtu(u_short mtu)
+{
+    if(mtu < MIN_MTU)
+        mtu = MIN_MTU;
+    if(mtu > RTP_BUF_SIZE - 4 + KIpHeaderSize + KUdpHeaderSize) // must fit RtpBuf
+        mtu = RTP_BUF_SIZE - 4 + KIpHeaderSize + KUdpHeaderSize;
+    m_Mtu = mtu;
+
+    int transport = m_TCPTransport ? KIpHeaderSize + KTcpHeaderSize : KIpHeaderSize + KUdpHeaderSize;
+    m_MaxPayload = m_Mtu - transport - KRtpHeaderSize - KJpegHeaderSize;
+}
 
-#define MAX_FRAGMENT_SIZE 1100 // FIXME, pick more carefully
-    int fragmentLen = MAX_FRAGMENT_SIZE;
+int CStreamer::SendRtpPacket(unsigned const char * jpeg, int jpegLen, int fragmentOffset, BufPtr quant0tbl, BufPtr quant1tbl)
+{
+    // Do we have custom quant tables? If so include them per RFC
+    // The tables follow the encoder quality, which rate control changes from frame to frame, so use
+    // Q=255 (dynamic): receivers must not cache tables by Q. They go in every frame's first packet.
+    bool includeQuantTbl = quant0tbl && quant1tbl;
+    uint8_t q = includeQuantTbl ? 255 : 0x5e;
+    includeQuantTbl = includeQuantTbl && fragmentOffset == 0;
+
+    // fill the packet up to the MTU, the first one has the quant tables to fit as well
+    int fragmentLen = m_MaxPayload - (includeQuantTbl ? KQuantHeaderSize : 0);
     if(fragmentLen + fragmentOffset > jpegLen) // Shrink last fragment if needed
         fragmentLen = jpegLen - fragmentOffset;
 
     bool isLastFragment = (fragmentOffset + fragmentLen) == jpegLen;
 
-    // Do we have custom quant tables? If so include them per RFC
-
-    bool includeQuantTbl = quant0tbl && quant1tbl && fragmentOffset == 0;
-    uint8_t q = includeQuantTbl ? 128 : 0x5e;
-
-    static char RtpBuf[2048]; // Note: we assume single threaded, this large buf we keep off of the tiny stack
-    int RtpPacketSize = fragmentLen + KRtpHeaderSize + KJpegHeaderSize + (includeQuantTbl ? (4 + 64 * 2) : 0);
+    static char RtpBuf[RTP_BUF_SIZE]; // Note: we assume single threaded, this large buf we keep off of the tiny stack
+    int RtpPacketSize = fragmentLen + KRtpHeaderSize + KJpegHeaderSize + (includeQuantTbl ? KQuantHeaderSize : 0);
 
     memset(RtpBuf,0x00,sizeof(RtpBuf));
     // Prepare the first 4 byte of the packet. This is the Rtp over Rtsp header in case of TCP based transport
@@ -64,10 +120,10 @@ int CStreamer::SendRtpPacket(unsigned const char * jpeg, int jpegLen, int fragme
     RtpBuf[9]  = (m_Timestamp & 0x00FF0000) >> 16;
     RtpBuf[10] = (m_Timestamp & 0x0000FF00) >> 8;
     RtpBuf[11] = (m_Timestamp & 0x000000FF);
-    RtpBuf[12] = 0x13;                               // 4 byte SSRC (sychronization source identifier)
-    RtpBuf[13] = 0xf9;                               // we just an arbitrary number here to keep it simple
-    RtpBuf[14] = 0x7e;
-    RtpBuf[15] = 0x67;
+    RtpBuf[12] = (RTP_SSRC >> 24) & 0xFF;            // 4 byte SSRC (sychronization source identifier)
+    RtpBuf[13] = (RTP_SSRC >> 16) & 0xFF;
+    RtpBuf[14] = (RTP_SSRC >> 8) & 0xFF;
+    RtpBuf[15] = RTP_SSRC & 0xFF;
 
     // Prepare the 8 byte payload JPEG header
     RtpBuf[16] = 0x00;                               // type specific
@@ -79,7 +135,7 @@ int CStreamer::SendRtpPacket(unsigned const char * jpeg, int jpegLen, int fragme
        type 0 video is downsampled horizontally by 2 (often called 4:2:2)
        while the chrominance components of type 1 video are downsampled both
        horizontally and vertically by 2 (often called 4:2:0). */
-    RtpBuf[20] = 0x01;                               // type (fixme might be wrong for camera data) https://tools.ietf.org/html/rfc2435
+    RtpBuf[20] = m_JpegType;                         // type 0 (4:2:2) or 1 (4:2:0) https://tools.ietf.org/html/rfc2435
     RtpBuf[21] = q;                               // quality scale factor was 0x5e
     RtpBuf[22] = m_width / 8;                           // width  / 8
     RtpBuf[23] = m_height / 8;                           // height / 8
@@ -109,16 +165,14 @@ int CStreamer::SendRtpPacket(unsigned const char * jpeg, int jpegLen, int fragme
     fragmentOffset += fragmentLen;
 
     m_SequenceNumber++;                              // prepare the packet counter for the next packet
-
-    IPADDRESS otherip;
-    IPPORT otherport;
-    socketpeeraddr(m_Client, &otherip, &otherport);
+    m_PacketCount++;
+    m_OctetCount += RtpPacketSize - KRtpHeaderSize;
 
     // RTP marker bit must be set on last fragment
     if (m_TCPTransport) // RTP over RTSP - we send the buffer + 4 byte additional header
         socketsend(m_Client,RtpBuf,RtpPacketSize + 4);
     else                // UDP - we send just the buffer by skipping the 4 byte RTP over RTSP header
-        udpsocketsend(m_RtpSocket,&RtpBuf[4],RtpPacketSize, otherip, m_RtpClientPort);
+        udpsocketsend(m_RtpSocket,&RtpBuf[4],RtpPacketSize, m_DestAddr, m_RtpClientPort);
 
     return isLastFragment ? 0 : fragmentOffset;
 };
@@ -128,6 +182,18 @@ void CStreamer::InitTransport(u_short aRtpPort, u_short aRtcpPort, bool TCP)
     m_RtpClientPort  = aRtpPort;
     m_RtcpClientPort = aRtcpPort;
     m_TCPTransport   = TCP;
+    SetMtu(m_Mtu); // header overhead depends on the transport
+
+    if (!m_TCPTransport)
+    {   // the path may be narrower than the configured MTU (VPN, tunnels to our relays)
+        IPPORT otherport;
+        socketpeeraddr(m_Client, &m_DestAddr, &otherport);
+        int mtu = udpsocketmtu(m_DestAddr, m_RtpClientPort);
+        if (mtu > 0 && mtu < m_Mtu) {
+            printf("path MTU %d\n", mtu);
+            SetMtu(mtu);
+        }
+    }
 
     if (!m_TCPTransport)
     {   // allocate port pairs for RTP/RTCP ports in UDP transport mode
@@ -153,6 +219,118 @@ void CStreamer::InitTransport(u_short aRtpPort, u_short aRtcpPort, bool TCP)
     };
 };
 
+void CStreamer::InitMulticast(IPADDRESS group, u_short aRtpPort, uint8_t ttl)
+{
+    m_Multicast      = true;
+    m_MulticastTtl   = ttl;
+    m_DestAddr       = group;
+    m_RtpClientPort  = aRtpPort;
+    m_RtcpClientPort = aRtpPort + 1;
+    m_TCPTransport   = false;
+    SetMtu(m_Mtu);
+
+    // RTP is only sent, receivers' reports come to the group's RTCP port
+    m_RtpSocket  = udpsocketcreatemulticast(group, 0, ttl);
+    m_RtcpSocket = udpsocketcreatemulticast(group, m_RtcpClientPort, ttl);
+    m_RtpServerPort  = m_RtpClientPort;
+    m_RtcpServerPort = m_RtcpClientPort;
+};
+
+void CStreamer::PollRtcp()
+{
+    static unsigned char RtcpBuf[1500]; // Note: we assume single threaded
+    int len;
+
+    while((len = udpsocketrecv(m_RtcpSocket, RtcpBuf, sizeof(RtcpBuf))) > 0)
+        HandleRtcpPacket(RtcpBuf, len);
+}
+
+static uint32_t get32(BufPtr p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+void CStreamer::HandleRtcpPacket(unsigned const char *buf, int len)
+{
+    // a compound packet is a sequence of RTCP packets, each with a 4 byte header and a length in 32 bit words - 1
+    while(len >= 8) {
+        uint8_t count = buf[0] & 0x1f;
+        uint8_t pt = buf[1];
+        int plen = ((buf[2] << 8) + buf[3] + 1) * 4;
+        if((buf[0] >> 6) != 2 || plen > len)
+            break; // not RTCP version 2 or truncated
+
+        // report blocks follow the sender SSRC (RR, 201) or the sender info (SR, 200)
+        int ofs = (pt == 201) ? 8 : (pt == 200) ? 28 : plen;
+        for(int i = 0; i < count && ofs + 24 <= plen; i++, ofs += 24) {
+            BufPtr rb = buf + ofs;
+            if(get32(rb) != RTP_SSRC)
+                continue; // about some other source
+
+            RtcpReceiverStats *r = FindReceiver(get32(buf + 4));
+            r->lastMsec = msecnow();
+            r->reports++;
+            r->fractionLost = rb[4];
+            r->cumulativeLost = ((int32_t)get32(rb + 4) << 8) >> 8; // 24 bit signed
+            r->highestSeq = get32(rb + 8);
+            r->jitter = get32(rb + 12);
+
+            // RTT per RFC 3550 6.4.1: time since our SR minus the delay at the receiver (DLSR, 1/65536 s)
+            uint32_t lsr = get32(rb + 16), dlsr = get32(rb + 20);
+            if(lsr && lsr == m_LastSrNtp) {
+                uint32_t elapsed = msecnow() - m_LastSrMsec;
+                uint32_t delay = (uint32_t)(((uint64_t)dlsr * 1000) >> 16);
+                r->rttMs = elapsed > delay ? elapsed - delay : 0;
+            }
+            if(GetWorstReceiver() == r)
+                onReceiverReport(*r);
+        }
+
+        buf += plen;
+        len -= plen;
+    }
+}
+
+// Entry of the receiver with this SSRC, a new one takes a free slot or that of the longest silent receiver
+RtcpReceiverStats *CStreamer::FindReceiver(uint32_t ssrc)
+{
+    int oldest = 0;
+    for(int i = 0; i < m_ReceiverCount; i++) {
+        if(m_Receivers[i].ssrc == ssrc)
+            return &m_Receivers[i];
+        if((int32_t)(m_Receivers[i].lastMsec - m_Receivers[oldest].lastMsec) < 0)
+            oldest = i;
+    }
+
+    RtcpReceiverStats *r = &m_Receivers[m_ReceiverCount < RTCP_MAX_RECEIVERS ? m_ReceiverCount++ : oldest];
+    memset(r, 0, sizeof(*r));
+    r->ssrc = ssrc;
+    return r;
+}
+
+const RtcpReceiverStats *CStreamer::GetWorstReceiver()
+{
+    uint32_t now = msecnow();
+    const RtcpReceiverStats *worst = NULL;
+    for(int i = 0; i < m_ReceiverCount; i++) {
+        if(now - m_Receivers[i].lastMsec >= RTCP_RECEIVER_TIMEOUT_MS)
+            continue; // gone
+        if(!worst || m_Receivers[i].fractionLost > worst->fractionLost)
+            worst = &m_Receivers[i];
+    }
+    return worst;
+}
+
+int CStreamer::GetReceiverCount()
+{
+    uint32_t now = msecnow();
+    int count = 0;
+    for(int i = 0; i < m_ReceiverCount; i++)
+        if(now - m_Receivers[i].lastMsec < RTCP_RECEIVER_TIMEOUT_MS)
+            count++;
+    return count;
+}
+
 u_short CStreamer::GetRtpServerPort()
 {
     return m_RtpServerPort;
@@ -163,14 +341,114 @@ u_short CStreamer::GetRtcpServerPort()
     return m_RtcpServerPort;
 };
 
-void CStreamer::streamFrame(unsigned const char *data, uint32_t dataLen, uint32_t curMsec)
+// Sender report + CNAME (RFC 3550 6.4.1), maps our RTP timestamps to wall clock time
+void CStreamer::SendRtcpSenderReport()
 {
-    if(m_prevMsec == 0) // first frame init our timestamp
-        m_prevMsec = curMsec;
+    unsigned char buf[4 + 28 + 20];
+    unsigned char *p = buf + 4;
+    int len = 0;
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t now = usecnow();
+    uint32_t ntpSec = tv.tv_sec + NTP_UNIX_OFFSET;
+    uint32_t ntpFrac = (uint32_t)(((uint64_t)tv.tv_usec << 32) / 1000000);
+    uint32_t rtpNow = (uint32_t)((now - m_FirstCaptureUsec) * 9 / 100); // 90kHz, wraps mod 2^32 like the RTP timestamps
+
+    uint32_t words[] = { 0x80C80006, RTP_SSRC, ntpSec, ntpFrac, rtpNow, m_PacketCount, m_OctetCount,
+                         0x81CA0004, RTP_SSRC };
+    for(unsigned i = 0; i < sizeof(words) / sizeof(words[0]); i++, len += 4) {
+        p[len] = words[i] >> 24; p[len + 1] = words[i] >> 16; p[len + 2] = words[i] >> 8; p[len + 3] = words[i];
+    }
+    p[len++] = 1; // CNAME
+    p[len++] = sizeof(RTCP_CNAME) - 1;
+    memcpy(p + len, RTCP_CNAME, sizeof(RTCP_CNAME) - 1);
+    len += sizeof(RTCP_CNAME) - 1;
+    do { p[len++] = 0; } while(len & 3); // end of items, pad to 32 bits
+
+    m_LastSrNtp = (ntpSec << 16) | (ntpFrac >> 16);
+    m_LastSrMsec = msecnow();
+
+    if(m_TCPTransport) {
+        buf[0] = '$';
+        buf[1] = 1; // RTCP channel
+        buf[2] = len >> 8;
+        buf[3] = len & 0xFF;
+        socketsend(m_Client, buf, len + 4);
+    }
+    else
+        udpsocketsend(m_RtcpSocket, p, len, m_DestAddr, m_RtcpClientPort);
+}
 
-    // compute deltat (being careful to handle clock rollover with a little lie)
-    uint32_t deltams = (curMsec >= m_prevMsec) ? curMsec - m_prevMsec : 100;
-    m_prevMsec = curMsec;
+uint32_t CStreamer::s_PaceBudgetUs = UINT32_MAX;
+
+// Pick the token rate that sends frameBytes in m_PacingPercent of the configured frame interval.
+// Not the measured one, that stretches whenever frames are skipped.
+void CStreamer::PaceStartFrame(uint32_t frameBytes)
+{
+    m_PaceRate = 0;
+    uint8_t fps = GetFrameRate();
+    if(!m_PacingPercent || !fps)
+        return;
+
+    uint64_t window = (uint64_t)1000000 / fps * m_PacingPercent / 100;
+    m_PaceRate = (uint32_t)((uint64_t)frameBytes * 1000000 / (window ? window : 1));
+    m_PaceTokens = PACING_BURST_BYTES;
+    m_PaceUsec = usecnow();
+}
+
+// Wait until the bucket has paid off the previous packets, as far as the shared budget allows
+void CStreamer::PaceWait()
+{
+    if(!m_PaceRate)
+        return;
+
+    uint64_t now = usecnow();
+    int64_t tokens = m_PaceTokens + (int64_t)(now - m_PaceUsec) * m_PaceRate / 1000000;
+    m_PaceUsec = now;
+    if(tokens < 0) {
+        uint32_t wait = (uint32_t)(-tokens * 1000000 / m_PaceRate);
+        if(wait > s_PaceBudgetUs) {
+            wait = s_PaceBudgetUs;
+            m_PacerStats.unpacedPackets++;
+        }
+        if(!wait) {
+            m_PaceTokens = 0; // out of budget, the rest of the frame goes back to back
+            return;
+        }
+        usecsleep(wait);
+        if(s_PaceBudgetUs != UINT32_MAX)
+            s_PaceBudgetUs -= wait;
+        tokens = 0;
+        m_PaceUsec = usecnow();
+
+        uint32_t delay = (uint32_t)(m_PaceUsec - now);
+        m_PacerStats.delayedPackets++;
+        m_PacerStats.avgDelayUs += ((int32_t)delay - (int32_t)m_PacerStats.avgDelayUs) / 16;
+        if(delay > m_PacerStats.maxDelayUs)
+            m_PacerStats.maxDelayUs = delay;
+    }
+    m_PaceTokens = tokens > PACING_BURST_BYTES ? PACING_BURST_BYTES : (int32_t)tokens;
+}
+
+void CStreamer::streamFrame(unsigned const char *data, uint32_t dataLen, uint32_t /*curMsec*/, uint64_t captureUsec)
+{
+    if(!captureUsec)
+        captureUsec = usecnow();
+    if(!m_FirstCaptureUsec) // first frame gets RTP timestamp 0
+        m_FirstCaptureUsec = captureUsec;
+
+    // RTP timestamp from the capture time at 90kHz (RFC 2435). 64 bit math, the result wraps mod 2^32 as RTP expects
+    m_Timestamp = (uint32_t)((captureUsec - m_FirstCaptureUsec) * 9 / 100);
+
+    if(!m_TCPTransport && m_RtcpSocket)
+        PollRtcp(); // over TCP the session hands us the interleaved RTCP packets
+
+    // RTP/JPEG carries the sampling and size in its own header, take them from the frame
+    if(!getJPEGformat(data, dataLen, &m_JpegType, &m_width, &m_height)) {
+        printf("jpeg can't be sent over RTP\n");
+        return;
+    }
 
     // locate quant tables if possible
     BufPtr qtable0, qtable1;
@@ -180,14 +458,22 @@ void CStreamer::streamFrame(unsigned const char *data, uint32_t dataLen, uint32_
         return;
     }
 
+    uint64_t frameStart = usecnow();
+    PaceStartFrame(dataLen);
+
     int offset = 0;
     do {
+        PaceWait();
+        uint32_t octets = m_OctetCount;
         offset = SendRtpPacket(data, dataLen, offset, qtable0, qtable1);
+        m_PaceTokens -= m_OctetCount - octets;
+        m_PacerStats.packets++;
     } while(offset != 0);
+    m_PacerStats.frameSendUs = (uint32_t)(usecnow() - frameStart);
 
-    // Increment ONLY after a full frame
-    uint32_t units = 90000; // Hz per RFC 2435
-    m_Timestamp += (units * deltams / 1000);                             // fixed timestamp increment for a frame rate of 25fps
+    // first report right away so receivers can sync, then periodically (unsigned math handles the ms wrap)
+    if(!m_LastSrMsec || msecnow() - m_LastSrMsec >= RTCP_SR_INTERVAL_MS)
+        SendRtcpSenderReport();
 
     m_SendIdx++;
     if (m_SendIdx > 1) m_SendIdx = 0;
@@ -265,6 +551,29 @@ bool findJPEGheader(BufPtr *start, uint32_t *len, uint8_t marker) {
     return false;
 }
 
+// Read the RTP/JPEG type and the image size from the SOF0 marker.
+// Returns false if the image can't be carried by RFC 2435 (not 3 components, or luma not 2x1/2x2)
+bool getJPEGformat(BufPtr start, uint32_t len, uint8_t *type, u_short *width, u_short *height) {
+    if(!findJPEGheader(&start, &len, 0xc0))
+        return false;
+
+    // length(2) precision(1) height(2) width(2) components(1), then id/sampling/table per component
+    if(start[7] != 3) {
+        printf("RTP/JPEG needs 3 components, got %d\n", start[7]);
+        return false;
+    }
+    switch(start[9]) {
+    case 0x21: *type = 0; break; // 4:2:2
+    case 0x22: *type = 1; break; // 4:2:0
+    default:
+        printf("unsupported luma sampling 0x%x\n", start[9]);
+        return false;
+    }
+    *height = start[3] * 256 + start[4];
+    *width = start[5] * 256 + start[6];
+    return true;
+}
+
 // the scan data uses byte stuffing to guarantee anything that starts with 0xff
 // followed by something not zero, is a new section.  Look for that marker and return the ptr
 // pointing there
@@ -312,9 +621,9 @@ bool decodeJPEGfile(BufPtr *start, uint32_t *len, BufPtr *qtable0, BufPtr *qtabl
             printf("error can't find quant table 1\n");
         } else {
             // printf("found quant table %x\n", quantstart[2]);
+            *qtable1 = quantstart + 3;
+            nextJpegBlock(&quantstart);
         }
-        *qtable1 = quantstart + 3;
-        nextJpegBlock(&quantstart);
     }
 
     if(!findJPEGheader(start, len, 0xda))
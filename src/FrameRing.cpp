@@ -0,0 +1,152 @@
+#include "FrameRing.h"
+#include <stdlib.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+
+// Frames start on word boundaries so the copies run word at a time
+#define FRAME_ALIGN(n) (((n) + 3) & ~(size_t)3)
+
+static void *_ring_malloc(size_t size)
+{
+    void *p = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    return p ? p : malloc(size);
+}
+
+FrameRing::FrameRing()
+{
+    _arena = NULL;
+    _arena_size = 0;
+    _write = 0;
+    _first = 0;
+    _count = 0;
+    _first_seq = 0;
+    _used = 0;
+    _max_len = 0;
+    _evicted = 0;
+    _lock = xSemaphoreCreateMutex();
+}
+
+FrameRing::~FrameRing()
+{
+    end();
+    vSemaphoreDelete(_lock);
+}
+
+bool FrameRing::begin(size_t arenaBytes)
+{
+    end();
+    _arena = (uint8_t *)_ring_malloc(arenaBytes);
+    if (!_arena) return false;
+    _arena_size = arenaBytes;
+    return true;
+}
+
+void FrameRing::end()
+{
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    free(_arena);
+    _arena = NULL;
+    _arena_size = 0;
+    _write = 0;
+    _first = 0;
+    _first_seq += _count; // snapshots still running find their frames overwritten
+    _count = 0;
+    _used = 0;
+    _max_len = 0;
+    _evicted = 0;
+    xSemaphoreGive(_lock);
+}
+
+void FrameRing::evictOldest(void)
+{
+    _used -= FRAME_ALIGN(oldest().len);
+    _first = (_first + 1) % FRAME_RING_MAX_FRAMES;
+    _first_seq++;
+    _count--;
+    _evicted++;
+}
+
+bool FrameRing::push(const uint8_t *data, size_t len, uint64_t timestamp)
+{
+    size_t size = FRAME_ALIGN(len);
+    if (!_arena || size > _arena_size) return false;
+
+    // Make room under the lock, then copy without it: the space is no longer in the index,
+    // so snapshots can't be reading it
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    size_t pos = _write;
+    if (pos + size > _arena_size) {
+        // wrap, the frames still left at the end are the oldest ones
+        while (_count && oldest().offset >= _write) evictOldest();
+        pos = 0;
+    }
+    while (_count && (_count == FRAME_RING_MAX_FRAMES ||
+                      (oldest().offset < pos + size && oldest().offset + oldest().len > pos)))
+        evictOldest();
+    if (!_count) pos = 0;
+    xSemaphoreGive(_lock);
+
+    memcpy(_arena + pos, data, len);
+
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    Entry &e = _entries[(_first + _count) % FRAME_RING_MAX_FRAMES];
+    e.offset = pos;
+    e.len = len;
+    e.timestamp = timestamp;
+    _count++;
+    _used += size;
+    _write = pos + size;
+    if (len > _max_len) _max_len = len;
+    xSemaphoreGive(_lock);
+    return true;
+}
+
+int FrameRing::snapshot(FrameSink &sink, uint64_t since)
+{
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    uint32_t seq = _first_seq;
+    uint32_t end = _first_seq + _count; // frames pushed from now on aren't part of it
+    for (int i = 0; i < _count && _entries[(_first + i) % FRAME_RING_MAX_FRAMES].timestamp < since; i++)
+        seq++;
+    size_t max_len = _max_len;
+    xSemaphoreGive(_lock);
+
+    uint8_t *buf = seq != end ? (uint8_t *)_ring_malloc(max_len) : NULL;
+    if (!buf) return 0;
+
+    int sent = 0;
+    for (; seq != end; seq++) {
+        xSemaphoreTake(_lock, portMAX_DELAY);
+        bool present = (int32_t)(seq - _first_seq) >= 0;
+        Entry e;
+        if (present) {
+            e = _entries[(_first + (seq - _first_seq)) % FRAME_RING_MAX_FRAMES];
+            memcpy(buf, _arena + e.offset, e.len);
+        }
+        xSemaphoreGive(_lock);
+
+        if (!present) continue; // overwritten meanwhile
+        if (!sink.putFrame(buf, e.len, e.timestamp)) break;
+        sent++;
+    }
+    free(buf);
+    return sent;
+}
+
+int FrameRing::getFrameCount(void)
+{
+    return _count;
+}
+
+size_t FrameRing::getUsedBytes(void)
+{
+    return _used;
+}
+
+uint64_t FrameRing::getDuration(void)
+{
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    uint64_t d = _count ? _entries[(_first + _count - 1) % FRAME_RING_MAX_FRAMES].timestamp - oldest().timestamp : 0;
+    xSemaphoreGive(_lock);
+    return d;
+}
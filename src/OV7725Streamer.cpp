@@ -1,21 +1,143 @@
-
-#include "OV7725Streamer.h"
-#include <assert.h>
-
-
-
-OV7725Streamer::OV7725Streamer(SOCKET aClient, OV7725aiThinker &cam) : CStreamer(aClient, cam.getWidth(), cam.getHeight()), m_cam(cam)
-{
-    printf("Created streamer width=%d, height=%d\n", cam.getWidth(), cam.getHeight());
-}
-
-void OV7725Streamer::streamImage(uint32_t curMsec)
-{
-    ledcWrite(0, 250);
-    m_cam.run();// queue up a read for next time
-    BufPtr bytes = m_cam.getfb();
-    printf("streamFrame(), size: %d \n", m_cam.getSize());
-    ledcWrite(0, 200);
-    streamFrame(bytes, m_cam.getSize(), curMsec);
-
-}
+
+#include "OV7725Streamer.h"
+#include <assert.h>
+
+// Bandwidth adaptation: back off the target bitrate under loss, probe upwards when the link is clean
+#define ADAPT_LOSS_HIGH      13        // fraction lost (1/256) above which we back off, ~5%
+#define ADAPT_LOSS_LOW       3         // below this a report counts as clean, ~1%
+#define ADAPT_CLEAN_REPORTS  3         // clean reports in a row before stepping up
+#define ADAPT_MIN_BITRATE    200000
+#define ADAPT_MAX_BITRATE    8000000
+#define ADAPT_MAX_SKIP       3         // send at least every 4th frame
+
+
+OV7725Streamer *OV7725Streamer::s_streamers = NULL;
+
+OV7725Streamer::OV7725Streamer(SOCKET aClient, OV7725aiThinker &cam) : CStreamer(aClient, cam.getWidth(), cam.getHeight()), m_cam(cam)
+{
+    m_next = s_streamers;
+    s_streamers = this;
+    m_frameSkip = 0;
+    m_skipped = 0;
+    m_cleanReports = 0;
+    m_profile = 0;
+    m_nextMsec = 0;
+    m_lastSentMsec = 0;
+    m_sentSeq = 0;
+    printf("Created streamer width=%d, height=%d\n", cam.getWidth(), cam.getHeight());
+}
+
+OV7725Streamer::~OV7725Streamer()
+{
+    OV7725Streamer **p = &s_streamers;
+    while (*p != this) p = &(*p)->m_next;
+    *p = m_next;
+}
+
+// Whether our worst receiver is also the worst of all the streams of our camera.
+// Only that receiver moves the camera's target bitrate, so viewers with clean links can't
+// raise it again while another one is losing packets.
+bool OV7725Streamer::drivesBitrate()
+{
+    OV7725Streamer *driver = NULL;
+    uint8_t worstLoss = 0;
+    for (OV7725Streamer *s = s_streamers; s; s = s->m_next) {
+        if (&s->m_cam != &m_cam) continue;
+        const RtcpReceiverStats *r = s->GetWorstReceiver();
+        if (r && (!driver || r->fractionLost > worstLoss)) {
+            driver = s;
+            worstLoss = r->fractionLost;
+        }
+    }
+    return driver == this;
+}
+
+int OV7725Streamer::FindProfile(const char *name, unsigned len)
+{
+    return m_cam.findProfile(name, len);
+}
+
+int OV7725Streamer::GetProfileCount()
+{
+    return m_cam.getProfileCount();
+}
+
+void OV7725Streamer::SetProfile(int profile)
+{
+    m_profile = profile;
+    SetImageSize(m_cam.getProfileWidth(profile), m_cam.getProfileHeight(profile));
+}
+
+uint8_t OV7725Streamer::GetFrameRate()
+{
+    uint8_t fps = m_cam.getProfile(m_profile).fps;
+    uint8_t tickRate = CStreamer::GetFrameRate();
+    if (!fps || (tickRate && tickRate < fps)) return tickRate;
+    return fps;
+}
+
+void OV7725Streamer::streamImage(uint32_t curMsec)
+{
+    uint8_t fps = m_cam.getProfile(m_profile).fps;
+    if (fps) { // the profile sends fewer frames than we are asked for
+        if ((int32_t)(curMsec - m_nextMsec) < 0) return;
+        m_nextMsec += 1000 / fps;
+        if ((int32_t)(curMsec - m_nextMsec) >= 0) m_nextMsec = curMsec + 1000 / fps; // fell behind, don't burst
+    }
+
+    if (m_skipped < m_frameSkip) { // lowering the frame rate under loss
+        m_skipped++;
+        return;
+    }
+    m_skipped = 0;
+
+    ledcWrite(0, 250);
+    m_cam.grab(curMsec); // one capture for all the streams sent at this time
+    if (!m_cam.changedSince(m_sentSeq) && curMsec - m_lastSentMsec < m_cam.getMaxIdleMs()) {
+        ledcWrite(0, 200);
+        return; // static scene, the client already shows this
+    }
+    m_lastSentMsec = curMsec;
+    m_sentSeq = m_cam.getFrameSeq();
+    size_t size;
+    BufPtr bytes = m_cam.getProfileJpeg(m_profile, &size);
+    ledcWrite(0, 200);
+    if (!bytes) return;
+    printf("streamFrame(), size: %d \n", (int) size);
+    streamFrame(bytes, size, curMsec, m_cam.getTimestamp());
+
+}
+
+// stats is our worst receiver's. Frame skipping is ours alone, the bitrate is shared by all the
+// streams and only moves for the worst receiver of them all.
+void OV7725Streamer::onReceiverReport(const RtcpReceiverStats &stats)
+{
+    uint32_t target = m_cam.getTargetBitrate();
+    if (!target) target = m_cam.getBitrate(); // rate control was off, start from what we send now
+    if (!target) return;
+    bool drives = drivesBitrate();
+
+    if (stats.fractionLost > ADAPT_LOSS_HIGH) {
+        m_cleanReports = 0;
+        // the rate controller can't follow when it is already at its lowest quality, drop frames then
+        if (m_cam.getBitrate() > target + target / 2 && m_frameSkip < ADAPT_MAX_SKIP)
+            m_frameSkip++;
+        if (drives) {
+            target -= target / 4;
+            if (target < ADAPT_MIN_BITRATE) target = ADAPT_MIN_BITRATE;
+            m_cam.setTargetBitrate(target);
+        }
+        printf("RTCP loss %d/256 from %08x, jitter %u, rtt %u ms: target %u bit/s, skip %d\n",
+               stats.fractionLost, stats.ssrc, stats.jitter, stats.rttMs, m_cam.getTargetBitrate(), m_frameSkip);
+    }
+    else if (stats.fractionLost < ADAPT_LOSS_LOW && ++m_cleanReports >= ADAPT_CLEAN_REPORTS) {
+        m_cleanReports = 0;
+        // frame rate comes back first, then quality
+        if (m_frameSkip) m_frameSkip--;
+        else if (drives && m_cam.getTargetBitrate()) {
+            target += target / 8;
+            if (target > ADAPT_MAX_BITRATE) target = ADAPT_MAX_BITRATE;
+            m_cam.setTargetBitrate(target);
+        }
+    }
+}
@@ -4,6 +4,13 @@
 
 #define TAG "OV7725aiThinker"
 
+// Rate control: qualities are kept on multiples of RC_QUALITY_STEP, which the encoder has
+// precomputed quant tables for, so changing quality between frames costs nothing
+#define RC_QUALITY_STEP 5
+#define RC_QUALITY_MIN  10
+#define RC_QUALITY_MAX  95
+#define RC_AVG_SHIFT    3   // averages weight the newest frame 1/8
+
 camera_config_t esp32cam_aithinker_config {
 
     .pin_pwdn = 32,
@@ -37,7 +44,15 @@ camera_config_t esp32cam_aithinker_config {
 };
 
 
+static const StreamProfile default_profile = { "1", 0, 0, 0 };
+
 void OV7725aiThinker::run(void)
+{
+    capture();
+    encode();
+}
+
+void OV7725aiThinker::capture(void)
 {
     if(fb) {
         esp_camera_fb_return(fb);//return the frame buffer back to the driver for reuse
@@ -47,11 +62,336 @@ void OV7725aiThinker::run(void)
         free(_jpg_buf);
         _jpg_buf = NULL;
     }
+    for (int i = 0; i < MAX_STREAM_PROFILES; i++) {
+        free(_profile_buf[i]);
+        _profile_buf[i] = NULL;
+    }
 
     fb = esp_camera_fb_get();
-    bool jpeg_converted = frame2jpg(fb, _cam_config.jpeg_quality, &_jpg_buf, &_jpg_buf_len);
+    _frame_seq++;
+    if (_change_threshold) detectChange();
+    if (!isUnchanged()) _change_seq = _frame_seq;
+}
+
+void OV7725aiThinker::setChangeDetection(uint8_t blockThreshold, uint8_t minScore, uint32_t maxIdleMs)
+{
+    _change_threshold = blockThreshold;
+    _change_min_score = minScore;
+    _change_max_idle_ms = maxIdleMs;
+    _change_valid = false;
+    _change_score = 100;
+}
+
+// Luma of each pixel summed per 8x8 block, in one pass over the frame buffer, then compared
+// with the previous frame's sums. 64 pixels of 255 still fit 16 bits.
+void OV7725aiThinker::detectChange(void)
+{
+    if (!fb || fb->format == PIXFORMAT_JPEG) {
+        _change_valid = false;
+        _change_score = 100;
+        return;
+    }
+
+    int cols = fb->width / 8, rows = fb->height / 8;
+    if (cols != _blk_cols || rows != _blk_rows) {
+        free(_blk_sums);
+        free(_blk_prev);
+        free(_change_map);
+        _blk_sums = (uint16_t *)malloc(cols * rows * sizeof(uint16_t));
+        _blk_prev = (uint16_t *)malloc(cols * rows * sizeof(uint16_t));
+        _change_map = (uint8_t *)malloc(cols * rows);
+        _blk_cols = cols;
+        _blk_rows = rows;
+        _change_valid = false;
+    }
+    if (!_blk_sums || !_blk_prev || !_change_map) {
+        _blk_cols = _blk_rows = 0;
+        _change_score = 100;
+        return;
+    }
+
+    memset(_blk_sums, 0, cols * rows * sizeof(uint16_t));
+    for (int y = 0; y < rows * 8; y++) {
+        uint16_t *sum = _blk_sums + (y / 8) * cols;
+        if (fb->format == PIXFORMAT_GRAYSCALE) {
+            const uint8_t *p = fb->buf + y * fb->width;
+            for (int x = 0; x < cols; x++, p += 8) {
+                sum[x] += p[0] + p[1] + p[2] + p[3] + p[4] + p[5] + p[6] + p[7];
+            }
+        } else if (fb->format == PIXFORMAT_RGB565) {
+            // (r + 2g + b) / 4 is close enough to tell a change
+            const uint8_t *p = fb->buf + y * fb->width * 2;
+            for (int x = 0; x < cols; x++) {
+                uint16_t s = 0;
+                for (int i = 0; i < 8; i++, p += 2) {
+                    s += ((p[0] & 0xF8) + (((p[0] & 0x07) << 6) | ((p[1] & 0xE0) >> 2)) + ((p[1] & 0x1F) << 3)) >> 2;
+                }
+                sum[x] += s;
+            }
+        } else { // YUV422 and RGB888, luma or green in every other byte or third byte
+            int bpp = fb->format == PIXFORMAT_RGB888 ? 3 : 2;
+            const uint8_t *p = fb->buf + y * fb->width * bpp + (bpp == 3);
+            for (int x = 0; x < cols; x++) {
+                uint16_t s = 0;
+                for (int i = 0; i < 8; i++, p += bpp) {
+                    s += p[0];
+                }
+                sum[x] += s;
+            }
+        }
+    }
+
+    uint32_t changed = 0;
+    if (_change_valid) {
+        int limit = _change_threshold * 64;
+        for (int i = 0; i < cols * rows; i++) {
+            int d = (int)_blk_sums[i] - (int)_blk_prev[i];
+            _change_map[i] = d > limit || d < -limit;
+            changed += _change_map[i];
+        }
+    } else {
+        memset(_change_map, 1, cols * rows); // nothing to compare with, all new
+        changed = cols * rows;
+    }
+    _changed_blocks = changed;
+    _change_score = (cols && rows) ? changed * 100 / (cols * rows) : 100;
+    if (_change_valid && changed && !_change_score) _change_score = 1; // any change at all shows
+    if (isUnchanged()) _unchanged_frames++;
+
+    uint16_t *t = _blk_prev;
+    _blk_prev = _blk_sums;
+    _blk_sums = t;
+    _change_valid = true;
+}
+
+uint8_t OV7725aiThinker::getChangeScore(void)
+{
+    return _change_score;
+}
+
+uint32_t OV7725aiThinker::getChangedBlocks(void)
+{
+    return _changed_blocks;
+}
+
+const uint8_t *OV7725aiThinker::getChangeMap(int *cols, int *rows)
+{
+    if (!_change_threshold || !_blk_cols) return NULL;
+    *cols = _blk_cols;
+    *rows = _blk_rows;
+    return _change_map;
+}
+
+bool OV7725aiThinker::isUnchanged(void)
+{
+    return _change_threshold && _change_score < _change_min_score;
+}
+
+bool OV7725aiThinker::encode(void)
+{
+    if (!_quality || (!_rc_target_bitrate && !_rc_target_size)) _quality = _cam_config.jpeg_quality;
+    _jpg_quality = _quality;
+    // grayscale frames are encoded with flat chroma so RTP/JPEG can carry them
+    bool jpeg_converted;
+    if (_coeffs) jpeg_converted = frame2jpg_rtp_coeffs(fb, _quality, _coeffs, &_jpg_buf, &_jpg_buf_len);
+    else if (_block_cache) jpeg_converted = frame2jpg_rtp_cached(fb, _quality, _block_cache, _replenish_tolerance, &_jpg_buf, &_jpg_buf_len);
+    else jpeg_converted = frame2jpg_rtp(fb, _quality, &_jpg_buf, &_jpg_buf_len);
     
     if(!jpeg_converted) Serial.println("JPEG compression failed");
+    else {
+        rateControl(_jpg_buf_len);
+        if (preEventDue()) {
+            _pre_event_last = getTimestamp();
+            _pre_event.push(_jpg_buf, _jpg_buf_len, _pre_event_last);
+        }
+    }
+    return jpeg_converted;
+}
+
+bool OV7725aiThinker::preEventDue(void)
+{
+    return _pre_event.isReady() &&
+           (!isUnchanged() || getTimestamp() - _pre_event_last >= (uint64_t)_change_max_idle_ms * 1000);
+}
+
+void OV7725aiThinker::recordPreEvent(uint32_t tick)
+{
+    if (!_pre_event.isReady()) return;
+    grab(tick);
+    if (!_jpg_buf && preEventDue()) encode();
+}
+
+bool OV7725aiThinker::setPreEventBuffer(size_t bytes)
+{
+    if (!bytes) {
+        _pre_event.end();
+        return true;
+    }
+    return _pre_event.begin(bytes);
+}
+
+void OV7725aiThinker::setReplenishment(bool enable, uint8_t tolerance)
+{
+    _replenish_tolerance = tolerance;
+    if (enable && !_block_cache) _block_cache = jpg_block_cache_new();
+    else if (!enable && _block_cache) {
+        jpg_block_cache_free(_block_cache);
+        _block_cache = NULL;
+    }
+}
+
+uint32_t OV7725aiThinker::getReusedBlocks(uint32_t *blocks)
+{
+    size_t total = 0, reused = 0;
+    if (_block_cache) reused = jpg_block_cache_reused(_block_cache, &total);
+    if (blocks) *blocks = total;
+    return reused;
+}
+
+void OV7725aiThinker::grab(uint32_t tick)
+{
+    if (!_grabbed || tick != _grab_tick) {
+        capture();
+        _grab_tick = tick;
+        _grabbed = true;
+    }
+}
+
+uint8_t *OV7725aiThinker::getProfileJpeg(int profile, size_t *len)
+{
+    runIfNeeded();
+    const StreamProfile &p = getProfile(profile);
+
+    // the full size rate controlled encoding is the one run() makes
+    if (!p.scaleShift && !p.quality) {
+        if (!_jpg_buf && !encode()) return NULL;
+        *len = _jpg_buf_len;
+        return _jpg_buf;
+    }
+
+    if (!_profile_buf[profile]) {
+        bool jpeg_converted;
+        if (!p.scaleShift && _coeffs && (_jpg_buf || encode()) && p.quality <= _jpg_quality) {
+            // a lower quality tier of the main encoding, only requantized and entropy coded again
+            jpeg_converted = coeffs2jpg(_coeffs, p.quality, &_profile_buf[profile], &_profile_len[profile]);
+        } else {
+            jpeg_converted = frame2jpg_rtp_scaled(fb, p.quality ? p.quality : _quality, p.scaleShift, &_profile_buf[profile], &_profile_len[profile]);
+        }
+        if (!jpeg_converted) {
+            Serial.println("JPEG compression failed");
+            return NULL;
+        }
+    }
+    *len = _profile_len[profile];
+    return _profile_buf[profile];
+}
+
+void OV7725aiThinker::setProfiles(const StreamProfile *profiles, int count)
+{
+    _profiles = profiles;
+    _profile_count = count > MAX_STREAM_PROFILES ? MAX_STREAM_PROFILES : count;
+
+    // full size profiles at a fixed quality are transcoded from the main encoding
+    bool tiers = false;
+    for (int i = 0; i < _profile_count; i++) {
+        if (!_profiles[i].scaleShift && _profiles[i].quality) tiers = true;
+    }
+    if (tiers && !_coeffs) _coeffs = jpg_coeffs_new();
+    else if (!tiers && _coeffs) {
+        jpg_coeffs_free(_coeffs);
+        _coeffs = NULL;
+    }
+}
+
+int OV7725aiThinker::getProfileCount(void)
+{
+    return _profiles ? _profile_count : 1;
+}
+
+const StreamProfile &OV7725aiThinker::getProfile(int profile)
+{
+    if (!_profiles || profile < 0 || profile >= _profile_count) return default_profile;
+    return _profiles[profile];
+}
+
+int OV7725aiThinker::findProfile(const char *name, size_t len)
+{
+    for (int i = 0; i < getProfileCount(); i++) {
+        const char *n = getProfile(i).name;
+        if (strlen(n) == len && !memcmp(n, name, len)) return i;
+    }
+    return -1;
+}
+
+int OV7725aiThinker::getProfileWidth(int profile)
+{
+    return getWidth() >> getProfile(profile).scaleShift;
+}
+
+int OV7725aiThinker::getProfileHeight(int profile)
+{
+    return getHeight() >> getProfile(profile).scaleShift;
+}
+
+void OV7725aiThinker::rateControl(size_t frameLen)
+{
+    uint32_t now = millis();
+    if (_rc_last_ms && now > _rc_last_ms) {
+        uint32_t interval = now - _rc_last_ms;
+        if (_rc_avg_interval) _rc_avg_interval += ((int32_t)interval - (int32_t)_rc_avg_interval) >> RC_AVG_SHIFT;
+        else _rc_avg_interval = interval;
+    }
+    _rc_last_ms = now;
+    if (_rc_avg_size) _rc_avg_size += ((int32_t)frameLen - (int32_t)_rc_avg_size) >> RC_AVG_SHIFT;
+    else _rc_avg_size = frameLen;
+
+    size_t target = _rc_target_size;
+    if (_rc_target_bitrate) {
+        if (!_rc_avg_interval) return; // frame rate not known yet
+        target = (uint64_t)_rc_target_bitrate * _rc_avg_interval / 8000;
+    }
+    if (!target) return;
+
+    // react to the last frame rather than the average, a busy scene must not wait for the average
+    // to catch up. Step down faster than up, and leave a dead band so static scenes don't oscillate
+    int q = _quality - (_quality % RC_QUALITY_STEP);
+    if (frameLen > target + target / 2) q -= 2 * RC_QUALITY_STEP;
+    else if (frameLen > target + target / 10) q -= RC_QUALITY_STEP;
+    else if (frameLen < target - target / 4) q += RC_QUALITY_STEP;
+
+    if (q < RC_QUALITY_MIN) q = RC_QUALITY_MIN;
+    if (q > RC_QUALITY_MAX) q = RC_QUALITY_MAX;
+    _quality = q;
+}
+
+void OV7725aiThinker::setTargetBitrate(uint32_t bitsPerSec)
+{
+    _rc_target_bitrate = bitsPerSec;
+    _rc_target_size = 0;
+}
+
+void OV7725aiThinker::setTargetFrameSize(size_t bytes)
+{
+    _rc_target_size = bytes;
+    _rc_target_bitrate = 0;
+}
+
+uint32_t OV7725aiThinker::getTargetBitrate(void)
+{
+    if (_rc_target_bitrate) return _rc_target_bitrate;
+    if (_rc_target_size && _rc_avg_interval) return (uint64_t)_rc_target_size * 8000 / _rc_avg_interval;
+    return 0;
+}
+
+uint32_t OV7725aiThinker::getBitrate(void)
+{
+    if (!_rc_avg_interval) return 0;
+    return (uint64_t)_rc_avg_size * 8000 / _rc_avg_interval;
+}
+
+uint8_t OV7725aiThinker::getQuality(void)
+{
+    return _quality;
 }
 
 void OV7725aiThinker::runIfNeeded(void)
@@ -72,6 +412,12 @@ int OV7725aiThinker::getHeight(void)
     return fb->height;
 }
 
+uint64_t OV7725aiThinker::getTimestamp(void)
+{
+    runIfNeeded();
+    return (uint64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+}
+
 size_t OV7725aiThinker::getSize(void)
 {
     runIfNeeded();
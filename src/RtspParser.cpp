@@ -0,0 +1,165 @@
+#include "RtspParser.h"
+
+static char lower(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// Header names are case insensitive (RFC 2326 4.2)
+static bool nameEquals(const char *p, unsigned len, const char *name)
+{
+    unsigned i;
+    for (i = 0; i < len && name[i]; i++)
+        if (lower(p[i]) != lower(name[i]))
+            return false;
+    return i == len && !name[i];
+}
+
+bool rtspViewEquals(RtspView v, const char *s)
+{
+    return strlen(s) == v.len && memcmp(v.ptr, s, v.len) == 0;
+}
+
+// Transport specifiers and parameters are case insensitive too
+static const char *viewFind(RtspView v, const char *s)
+{
+    unsigned n = strlen(s);
+    for (unsigned i = 0; i + n <= v.len; i++)
+        if (nameEquals(v.ptr + i, n, s))
+            return v.ptr + i;
+    return NULL;
+}
+
+static unsigned parseNumber(const char **p, const char *end)
+{
+    unsigned n = 0;
+    while (*p < end && **p >= '0' && **p <= '9')
+        n = n * 10 + *(*p)++ - '0';
+    return n;
+}
+
+static RTSP_CMD_TYPES commandType(RtspView m)
+{
+    if (rtspViewEquals(m, "OPTIONS"))  return RTSP_OPTIONS;
+    if (rtspViewEquals(m, "DESCRIBE")) return RTSP_DESCRIBE;
+    if (rtspViewEquals(m, "SETUP"))    return RTSP_SETUP;
+    if (rtspViewEquals(m, "PLAY"))     return RTSP_PLAY;
+    if (rtspViewEquals(m, "TEARDOWN")) return RTSP_TEARDOWN;
+    return RTSP_UNKNOWN;
+}
+
+// METHOD SP URL SP RTSP/1.0
+static bool parseRequestLine(const char *p, const char *end, RtspRequest *req)
+{
+    const char *s = p;
+    while (p < end && *p != ' ' && *p != '\t') p++;
+    if (p == s || p == end) return false;
+    req->method.ptr = s;
+    req->method.len = p - s;
+    req->cmd = commandType(req->method);
+
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    const char *url = p;
+    while (p < end && *p != ' ' && *p != '\t') p++;
+    const char *urlEnd = p;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (end - p < 5 || memcmp(p, "RTSP/", 5) != 0) return false;
+
+    // skip over the "rtsp://host:port" prefix, keeping host:port
+    if (urlEnd - url >= 6 && nameEquals(url, 6, "rtsp:/")) {
+        url += 6;
+        if (url < urlEnd && *url == '/') {
+            const char *host = ++url;
+            while (url < urlEnd && *url != '/') url++;
+            req->urlHostPort.ptr = host;
+            req->urlHostPort.len = url - host;
+        }
+    }
+    if (url < urlEnd && *url == '/') url++;
+
+    // the suffix is the last path element, the pre suffix everything before it
+    const char *slash = urlEnd;
+    while (slash > url && slash[-1] != '/') slash--;
+    req->urlSuffix.ptr = slash;
+    req->urlSuffix.len = urlEnd - slash;
+    req->urlPreSuffix.ptr = url;
+    req->urlPreSuffix.len = slash > url ? slash - 1 - url : 0;
+    return true;
+}
+
+static void parseTransport(RtspRequest *req)
+{
+    RtspView t = req->transport;
+    req->tcpTransport = viewFind(t, "RTP/AVP/TCP") != NULL;
+    req->multicast = viewFind(t, "multicast") != NULL;
+
+    const char *p = viewFind(t, "client_port=");
+    if (p) {
+        const char *end = t.ptr + t.len;
+        p += 12;
+        req->clientRtpPort = parseNumber(&p, end);
+        req->clientRtcpPort = req->clientRtpPort + 1;
+        if (p < end && *p == '-') {
+            p++;
+            req->clientRtcpPort = parseNumber(&p, end);
+        }
+    }
+}
+
+static void parseHeader(const char *p, const char *end, RtspRequest *req)
+{
+    const char *colon = (const char *) memchr(p, ':', end - p);
+    if (!colon) return;
+
+    RtspView value;
+    value.ptr = colon + 1;
+    while (value.ptr < end && (*value.ptr == ' ' || *value.ptr == '\t')) value.ptr++;
+    while (end > value.ptr && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    value.len = end - value.ptr;
+
+    unsigned nameLen = colon - p;
+    if (nameEquals(p, nameLen, "CSeq"))
+        req->cseq = value;
+    else if (nameEquals(p, nameLen, "Session"))
+        req->session = value;
+    else if (nameEquals(p, nameLen, "Transport")) {
+        req->transport = value;
+        parseTransport(req);
+    }
+    else if (nameEquals(p, nameLen, "Content-Length")) {
+        const char *n = value.ptr;
+        req->contentLength = parseNumber(&n, end);
+    }
+}
+
+int parseRtspRequest(const char *buf, unsigned len, RtspRequest *req)
+{
+    memset(req, 0, sizeof(*req));
+    req->cmd = RTSP_UNKNOWN;
+
+    const char *p = buf, *end = buf + len;
+    while (p < end && (*p == '\r' || *p == '\n'))
+        p++; // empty lines between requests, clients send them as keep alives
+    bool first = true;
+    for (;;) {
+        const char *nl = (const char *) memchr(p, '\n', end - p);
+        if (!nl)
+            return 0; // wait for the rest of the line
+        const char *lineEnd = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+
+        if (first) {
+            if (!parseRequestLine(p, lineEnd, req))
+                return -1;
+            first = false;
+        }
+        else if (lineEnd == p) { // empty line, the headers are done
+            unsigned used = nl + 1 - buf;
+            if (len - used < req->contentLength)
+                return 0; // body not all there yet
+            return used + req->contentLength;
+        }
+        else
+            parseHeader(p, lineEnd, req);
+        p = nl + 1;
+    }
+}
@@ -91,6 +91,15 @@ typedef struct camera_fb_s {
     struct camera_fb_s * next;
 } camera_fb_int_t;
 
+typedef struct {
+    camera_decimation_t decimation;
+    dma_filter_t decimation_filter;
+    size_t crop_x;          // crop window in sensor pixels, width/height 0 means no crop
+    size_t crop_y;
+    size_t crop_width;
+    size_t crop_height;
+} frame_geometry_t;
+
 typedef struct fb_s {
     uint8_t * buf;
     size_t len;
@@ -123,16 +132,25 @@ typedef struct {
 
     i2s_sampling_mode_t sampling_mode;
     dma_filter_t dma_filter;
+    frame_geometry_t geometry;              // requested geometry, latched at the start of each frame
+    frame_geometry_t frame_geometry;        // geometry in effect for the frame being filled
+    uint8_t *dma_line_buf;                  // scratch line for vertical averaging
+    size_t dma_buf_index;                   // DMA buffers seen in the current frame
+    size_t fb_fill;                         // end of the data written to the current frame buffer
     intr_handle_t i2s_intr_handle;
     QueueHandle_t data_ready;
     QueueHandle_t fb_in;
     QueueHandle_t fb_out;
+    camera_fb_counters_t fb_counters;
+    camera_stats_t stats;
+    uint32_t frame_filter_us;
 
     SemaphoreHandle_t frame_ready;
     TaskHandle_t dma_filter_task;
 } camera_state_t;
 
 camera_state_t* s_state = NULL;
+static portMUX_TYPE s_geometry_lock = portMUX_INITIALIZER_UNLOCKED;
 
 static void i2s_init();
 static int i2s_run();
@@ -146,6 +164,11 @@ static void dma_filter_grayscale_highspeed(const dma_elem_t* src, lldesc_t* dma_
 static void dma_filter_yuyv(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
 static void dma_filter_yuyv_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
 static void dma_filter_jpeg(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+static void dma_filter_grayscale_half(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+static void dma_filter_grayscale_half_avg(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+static void dma_filter_yuyv_half(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+static void dma_filter_yuyv_half_avg(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+static void dma_filter_rgb565_half(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
 static void i2s_stop(bool* need_yield);
 
 static bool is_hs_mode()
@@ -539,6 +562,7 @@ static void IRAM_ATTR signal_dma_buf_received(bool* need_yield)
     size_t dma_desc_filled = s_state->dma_desc_cur;
     s_state->dma_desc_cur = (dma_desc_filled + 1) % s_state->dma_desc_count;
     s_state->dma_received_count++;
+    s_state->stats.dma_received++;
     if(!s_state->fb->ref && s_state->fb->bad){
         *need_yield = false;
         return;
@@ -546,6 +570,7 @@ static void IRAM_ATTR signal_dma_buf_received(bool* need_yield)
     BaseType_t higher_priority_task_woken;
     BaseType_t ret = xQueueSendFromISR(s_state->data_ready, &dma_desc_filled, &higher_priority_task_woken);
     if (ret != pdTRUE) {
+        s_state->stats.dma_queue_overflows++;
         if(!s_state->fb->ref) {
             s_state->fb->bad = 1;
         }
@@ -618,13 +643,20 @@ static void IRAM_ATTR camera_fb_done()
         //add reference
         fb->ref = 1;
 
+        s_state->fb_counters.frames_captured++;
+
         //check if the queue is full
         if(xQueueIsQueueFullFromISR(s_state->fb_out) == pdTRUE) {
-            //pop frame buffer from the queue
-            if(xQueueReceiveFromISR(s_state->fb_out, &fb2, &taskAwoken) == pdTRUE) {
+            if(!camera_fb_queue_evicts(s_state->config.fb_policy)) {
+                //keep the queued frames and reuse this buffer for the next one
+                fb->ref = 0;
+                fb->len = 0;
+                s_state->fb_counters.frames_dropped++;
+            } else if(xQueueReceiveFromISR(s_state->fb_out, &fb2, &taskAwoken) == pdTRUE) {
                 //free the popped buffer
                 fb2->ref = 0;
                 fb2->len = 0;
+                s_state->fb_counters.frames_stale++;
                 //push the new frame to the end of the queue
                 xQueueSendFromISR(s_state->fb_out, &fb, &taskAwoken);
             } else {
@@ -665,11 +697,10 @@ static void IRAM_ATTR camera_fb_done()
 
 static void IRAM_ATTR dma_finish_frame()
 {
-    size_t buf_len = s_state->width * s_state->fb_bytes_per_pixel / s_state->dma_per_line;
-
     if(!s_state->fb->ref) {
         // is the frame bad?
         if(s_state->fb->bad){
+            s_state->stats.bad_frames++;
             s_state->fb->bad = 0;
             s_state->fb->len = 0;
             *((uint32_t *)s_state->fb->buf) = 0;
@@ -678,8 +709,12 @@ static void IRAM_ATTR dma_finish_frame()
             }
             //ets_printf("bad\n");
         } else {
-            s_state->fb->len = s_state->dma_filtered_count * buf_len;
+            s_state->fb->len = s_state->fb_fill;
             if(s_state->fb->len) {
+                s_state->stats.filter_time_us = s_state->frame_filter_us;
+                if(s_state->frame_filter_us > s_state->stats.filter_time_max_us) {
+                    s_state->stats.filter_time_max_us = s_state->frame_filter_us;
+                }
                 //find the end marker for JPEG. Data after that can be discarded
                 if(s_state->fb->format == PIXFORMAT_JPEG){
                     uint8_t * dptr = &s_state->fb->buf[s_state->fb->len - 1];
@@ -708,9 +743,14 @@ static void IRAM_ATTR dma_finish_frame()
             }
         }
     } else if(s_state->fb->len) {
+        //no free frame buffer was available for this frame
+        s_state->fb_counters.frames_dropped++;
         camera_fb_done();
     }
     s_state->dma_filtered_count = 0;
+    s_state->dma_buf_index = 0;
+    s_state->fb_fill = 0;
+    s_state->frame_filter_us = 0;
 }
 
 static void IRAM_ATTR dma_filter_buffer(size_t buf_idx)
@@ -720,17 +760,91 @@ static void IRAM_ATTR dma_filter_buffer(size_t buf_idx)
         return;
     }
 
+    //decimation and crop can only change between frames
+    frame_geometry_t * geometry = &s_state->frame_geometry;
+    if(!s_state->dma_buf_index) {
+        portENTER_CRITICAL(&s_geometry_lock);
+        memcpy(geometry, &s_state->geometry, sizeof(*geometry));
+        portEXIT_CRITICAL(&s_geometry_lock);
+    }
+    size_t dma_buf_index = s_state->dma_buf_index++;
+
     //check if there is enough space in the frame buffer for the new data
     size_t buf_len = s_state->width * s_state->fb_bytes_per_pixel / s_state->dma_per_line;
     size_t fb_pos = s_state->dma_filtered_count * buf_len;
+    const dma_elem_t * src = s_state->dma_buf[buf_idx];
+    lldesc_t * dma_desc = &s_state->dma_desc[buf_idx];
+    lldesc_t span_desc;
+    dma_filter_t dma_filter = s_state->dma_filter;
+    bool merge_line = false;
+    if(geometry->decimation != CAMERA_DECIMATE_NONE || geometry->crop_width) {
+        size_t line = dma_buf_index / s_state->dma_per_line;
+        size_t x0 = 0, y0 = 0, width = s_state->width, height = s_state->height;
+        if(geometry->crop_width) {
+            x0 = geometry->crop_x;
+            y0 = geometry->crop_y;
+            width = geometry->crop_width;
+            height = geometry->crop_height;
+        }
+        //skip lines outside of the crop window
+        if(line < y0 || line >= y0 + height) {
+            return;
+        }
+        line -= y0;
+        size_t shift = 0;
+        if(geometry->decimation != CAMERA_DECIMATE_NONE) {
+            if(line & 1) {
+                if(geometry->decimation != CAMERA_DECIMATE_2X_AVG) {
+                    return;
+                }
+                //odd lines are averaged into the even line before them
+                merge_line = true;
+            }
+            line /= 2;
+            shift = 1;
+            dma_filter = geometry->decimation_filter;
+        }
+        //horizontal span of the crop window covered by this DMA buffer
+        size_t buf_pixels = s_state->width / s_state->dma_per_line;
+        size_t buf_x = (dma_buf_index % s_state->dma_per_line) * buf_pixels;
+        size_t span_start = (buf_x > x0) ? buf_x : x0;
+        size_t span_end = (buf_x + buf_pixels < x0 + width) ? buf_x + buf_pixels : x0 + width;
+        if(span_start >= span_end) {
+            return;
+        }
+        if(geometry->crop_width) {
+            //one DMA element per pixel in the sampling modes that allow cropping
+            memcpy(&span_desc, dma_desc, sizeof(span_desc));
+            span_desc.length = (span_end - span_start) * sizeof(dma_elem_t);
+            src += span_start - buf_x;
+            dma_desc = &span_desc;
+        }
+        buf_len = ((span_end - span_start) * s_state->fb_bytes_per_pixel) >> shift;
+        fb_pos = ((line * width + span_start - x0) * s_state->fb_bytes_per_pixel) >> shift;
+    }
     if(fb_pos > s_state->fb_size - buf_len) {
+        s_state->stats.fb_overflows++;
         //size_t processed = s_state->dma_received_count * buf_len;
         //ets_printf("[%s:%u] ovf pos: %u, processed: %u\n", __FUNCTION__, __LINE__, fb_pos, processed);
         return;
     }
 
     //convert I2S DMA buffer to pixel data
-    (*s_state->dma_filter)(s_state->dma_buf[buf_idx], &s_state->dma_desc[buf_idx], s_state->fb->buf + fb_pos);
+    int64_t filter_start = esp_timer_get_time();
+    if(merge_line) {
+        (*dma_filter)(src, dma_desc, s_state->dma_line_buf);
+        uint8_t * dst = s_state->fb->buf + fb_pos;
+        for(size_t i = 0; i < buf_len; i++) {
+            dst[i] = (dst[i] + s_state->dma_line_buf[i] + 1) >> 1;
+        }
+    } else {
+        (*dma_filter)(src, dma_desc, s_state->fb->buf + fb_pos);
+    }
+    s_state->frame_filter_us += (uint32_t)(esp_timer_get_time() - filter_start);
+    s_state->stats.dma_filtered++;
+    if(merge_line) {
+        return;
+    }
 
     //first frame buffer
     if(!s_state->dma_filtered_count) {
@@ -738,14 +852,24 @@ static void IRAM_ATTR dma_filter_buffer(size_t buf_idx)
         if(s_state->sensor.pixformat == PIXFORMAT_JPEG) {
             uint32_t sig = *((uint32_t *)s_state->fb->buf) & 0xFFFFFF;
             if(sig != 0xffd8ff) {
+                s_state->stats.jpeg_header_errors++;
                 ets_printf("bh 0x%08x\n", sig);
                 s_state->fb->bad = 1;
                 return;
             }
         }
         //set the frame properties
-        s_state->fb->width = resolution[s_state->sensor.status.framesize].width;
-        s_state->fb->height = resolution[s_state->sensor.status.framesize].height;
+        if(geometry->crop_width) {
+            s_state->fb->width = geometry->crop_width;
+            s_state->fb->height = geometry->crop_height;
+        } else {
+            s_state->fb->width = resolution[s_state->sensor.status.framesize].width;
+            s_state->fb->height = resolution[s_state->sensor.status.framesize].height;
+        }
+        if(geometry->decimation != CAMERA_DECIMATE_NONE) {
+            s_state->fb->width /= 2;
+            s_state->fb->height /= 2;
+        }
         s_state->fb->format = s_state->sensor.pixformat;
 
         uint64_t us = (uint64_t)esp_timer_get_time();
@@ -753,6 +877,7 @@ static void IRAM_ATTR dma_filter_buffer(size_t buf_idx)
         s_state->fb->timestamp.tv_usec = us % 1000000UL;
     }
     s_state->dma_filtered_count++;
+    s_state->fb_fill = fb_pos + buf_len;
 }
 
 static void IRAM_ATTR dma_filter_task(void *pvParameters)
@@ -860,6 +985,69 @@ static void IRAM_ATTR dma_filter_yuyv_highspeed(const dma_elem_t* src, lldesc_t*
     }
 }
 
+static void IRAM_ATTR dma_filter_grayscale_half(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
+    for (size_t i = 0; i < end; ++i) {
+        // keep every other pixel
+        dst[0] = src[0].sample1;
+        dst[1] = src[2].sample1;
+        src += 4;
+        dst += 2;
+    }
+}
+
+static void IRAM_ATTR dma_filter_grayscale_half_avg(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
+    for (size_t i = 0; i < end; ++i) {
+        // average horizontal pairs, vertical pairs are merged by the caller
+        dst[0] = (src[0].sample1 + src[1].sample1 + 1) >> 1;
+        dst[1] = (src[2].sample1 + src[3].sample1 + 1) >> 1;
+        src += 4;
+        dst += 2;
+    }
+}
+
+static void IRAM_ATTR dma_filter_yuyv_half(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
+    for (size_t i = 0; i < end; ++i) {
+        dst[0] = src[0].sample1;//y0
+        dst[1] = src[0].sample2;//u
+        dst[2] = src[2].sample1;//y2
+        dst[3] = src[1].sample2;//v
+        src += 4;
+        dst += 4;
+    }
+}
+
+static void IRAM_ATTR dma_filter_yuyv_half_avg(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
+    for (size_t i = 0; i < end; ++i) {
+        dst[0] = (src[0].sample1 + src[1].sample1 + 1) >> 1;//y0+y1
+        dst[1] = src[0].sample2;//u
+        dst[2] = (src[2].sample1 + src[3].sample1 + 1) >> 1;//y2+y3
+        dst[3] = src[1].sample2;//v
+        src += 4;
+        dst += 4;
+    }
+}
+
+static void IRAM_ATTR dma_filter_rgb565_half(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
+    for (size_t i = 0; i < end; ++i) {
+        dst[0] = src[0].sample1;
+        dst[1] = src[0].sample2;
+        dst[2] = src[2].sample1;
+        dst[3] = src[2].sample2;
+        src += 4;
+        dst += 4;
+    }
+}
+
 static void IRAM_ATTR dma_filter_rgb888(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
 {
     size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
@@ -1230,8 +1418,12 @@ esp_err_t camera_init(const camera_config_t* config)
             goto fail;
         }
     } else {
+        //at least one frame buffer must stay free for the capture
+        size_t queue_depth = camera_fb_queue_depth(s_state->config.fb_policy, s_state->config.fb_queue_depth, s_state->config.fb_count);
+        s_state->config.fb_queue_depth = queue_depth;
+        ESP_LOGD(TAG, "Frame buffer policy: %d, queue depth: %u", s_state->config.fb_policy, queue_depth);
         s_state->fb_in = xQueueCreate(s_state->config.fb_count, sizeof(camera_fb_t *));
-        s_state->fb_out = xQueueCreate(1, sizeof(camera_fb_t *));
+        s_state->fb_out = xQueueCreate(queue_depth, sizeof(camera_fb_t *));
         if (s_state->fb_in == NULL || s_state->fb_out == NULL) {
             ESP_LOGE(TAG, "Failed to fb queues");
             err = ESP_ERR_NO_MEM;
@@ -1366,6 +1558,7 @@ esp_err_t esp_camera_deinit()
     }
     dma_desc_deinit();
     camera_fb_deinit();
+    free(s_state->dma_line_buf);
     free(s_state);
     s_state = NULL;
     camera_disable_out_clock();
@@ -1375,11 +1568,8 @@ esp_err_t esp_camera_deinit()
 
 #define FB_GET_TIMEOUT (4000 / portTICK_PERIOD_MS)
 
-camera_fb_t* esp_camera_fb_get()
+static camera_fb_t* camera_fb_wait(TickType_t ticks)
 {
-    if (s_state == NULL) {
-        return NULL;
-    }
     if(!I2S0.conf.rx_start) {
         if(s_state->config.fb_count > 1) {
             ESP_LOGD(TAG, "i2s_run");
@@ -1388,26 +1578,55 @@ camera_fb_t* esp_camera_fb_get()
             return NULL;
         }
     }
-    bool need_yield = false;
     if (s_state->config.fb_count == 1) {
-        if (xSemaphoreTake(s_state->frame_ready, FB_GET_TIMEOUT) != pdTRUE){
-            i2s_stop(&need_yield);
-            ESP_LOGE(TAG, "Failed to get the frame on time!");
+        if (xSemaphoreTake(s_state->frame_ready, ticks) != pdTRUE){
             return NULL;
         }
         return (camera_fb_t*)s_state->fb;
     }
     camera_fb_int_t * fb = NULL;
     if(s_state->fb_out) {
-        if (xQueueReceive(s_state->fb_out, &fb, FB_GET_TIMEOUT) != pdTRUE) {
-            i2s_stop(&need_yield);
-            ESP_LOGE(TAG, "Failed to get the frame on time!");
+        if (xQueueReceive(s_state->fb_out, &fb, ticks) != pdTRUE) {
             return NULL;
         }
     }
     return (camera_fb_t*)fb;
 }
 
+camera_fb_t* esp_camera_fb_get()
+{
+    if (s_state == NULL) {
+        return NULL;
+    }
+    camera_fb_t * fb = camera_fb_wait(FB_GET_TIMEOUT);
+    if (fb == NULL && I2S0.conf.rx_start) {
+        bool need_yield = false;
+        i2s_stop(&need_yield);
+        ESP_LOGE(TAG, "Failed to get the frame on time!");
+    }
+    return fb;
+}
+
+camera_fb_t* esp_camera_fb_get_timeout(uint32_t timeout_ms)
+{
+    if (s_state == NULL) {
+        return NULL;
+    }
+    return camera_fb_wait(camera_fb_timeout_ticks(timeout_ms, portTICK_PERIOD_MS));
+}
+
+esp_err_t esp_camera_fb_get_counters(camera_fb_counters_t * counters)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (counters == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(counters, &s_state->fb_counters, sizeof(*counters));
+    return ESP_OK;
+}
+
 void esp_camera_fb_return(camera_fb_t * fb)
 {
     if(fb == NULL || s_state == NULL || s_state->config.fb_count == 1 || s_state->fb_in == NULL) {
@@ -1416,6 +1635,93 @@ void esp_camera_fb_return(camera_fb_t * fb)
     xQueueSend(s_state->fb_in, &fb, portMAX_DELAY);
 }
 
+esp_err_t esp_camera_get_stats(camera_stats_t * stats)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(stats, &s_state->stats, sizeof(*stats));
+    stats->fb_evictions = s_state->fb_counters.frames_stale;
+    return ESP_OK;
+}
+
+esp_err_t esp_camera_set_decimation(camera_decimation_t mode)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    dma_filter_t filter = NULL;
+    if (mode == CAMERA_DECIMATE_NONE) {
+        portENTER_CRITICAL(&s_geometry_lock);
+        s_state->geometry.decimation = mode;
+        portEXIT_CRITICAL(&s_geometry_lock);
+        return ESP_OK;
+    }
+    if (s_state->sampling_mode != SM_0A0B_0C0D || s_state->in_bytes_per_pixel != 2) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    bool avg = (mode == CAMERA_DECIMATE_2X_AVG);
+    if (s_state->dma_filter == &dma_filter_grayscale) {
+        filter = avg ? &dma_filter_grayscale_half_avg : &dma_filter_grayscale_half;
+    } else if (s_state->dma_filter == &dma_filter_yuyv && s_state->sensor.pixformat == PIXFORMAT_YUV422) {
+        filter = avg ? &dma_filter_yuyv_half_avg : &dma_filter_yuyv_half;
+    } else if (s_state->dma_filter == &dma_filter_yuyv && s_state->sensor.pixformat == PIXFORMAT_RGB565 && !avg) {
+        filter = &dma_filter_rgb565_half;
+    } else {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (avg && s_state->dma_line_buf == NULL) {
+        s_state->dma_line_buf = (uint8_t*) malloc(s_state->width * s_state->fb_bytes_per_pixel / s_state->dma_per_line / 2);
+        if (s_state->dma_line_buf == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    portENTER_CRITICAL(&s_geometry_lock);
+    s_state->geometry.decimation_filter = filter;
+    s_state->geometry.decimation = mode;
+    portEXIT_CRITICAL(&s_geometry_lock);
+    return ESP_OK;
+}
+
+camera_decimation_t esp_camera_get_decimation()
+{
+    if (s_state == NULL) {
+        return CAMERA_DECIMATE_NONE;
+    }
+    return s_state->geometry.decimation;
+}
+
+esp_err_t esp_camera_set_crop(size_t x, size_t y, size_t width, size_t height)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!width || !height || (x == 0 && y == 0 && width == s_state->width && height == s_state->height)) {
+        width = 0;
+        height = 0;
+        x = 0;
+        y = 0;
+    } else {
+        if (s_state->sampling_mode != SM_0A0B_0C0D || s_state->in_bytes_per_pixel != 2) {
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        if ((x % 8) || (width % 8) || (y % 2) || (height % 2)
+         || x + width > s_state->width || y + height > s_state->height) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    portENTER_CRITICAL(&s_geometry_lock);
+    s_state->geometry.crop_x = x;
+    s_state->geometry.crop_y = y;
+    s_state->geometry.crop_width = width;
+    s_state->geometry.crop_height = height;
+    portEXIT_CRITICAL(&s_geometry_lock);
+    return ESP_OK;
+}
+
 sensor_t * esp_camera_sensor_get()
 {
     if (s_state == NULL) {
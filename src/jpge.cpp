@@ -38,12 +38,12 @@ namespace jpge {
     enum { DC_LUM_CODES = 12, AC_LUM_CODES = 256, DC_CHROMA_CODES = 12, AC_CHROMA_CODES = 256, MAX_HUFF_SYMBOLS = 257, MAX_HUFF_CODESIZE = 32 };
 
     static const uint8 s_zag[64] = { 0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
-    static const int16 s_std_lum_quant[64] = { 16,11,12,14,12,10,16,14,13,14,18,17,16,19,24,40,26,24,22,22,24,49,35,37,29,40,58,51,61,60,57,51,56,55,64,72,92,78,64,68,87,69,55,56,80,109,81,87,95,98,103,104,103,62,77,113,121,112,100,120,92,101,103,99 };
-    static const int16 s_std_croma_quant[64] = { 17,18,18,24,21,24,47,26,26,47,99,66,56,66,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99 };
-    static const uint8 s_dc_lum_bits[17] = { 0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0 };
-    static const uint8 s_dc_lum_val[DC_LUM_CODES] = { 0,1,2,3,4,5,6,7,8,9,10,11 };
-    static const uint8 s_ac_lum_bits[17] = { 0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d };
-    static const uint8 s_ac_lum_val[AC_LUM_CODES]  = {
+    static constexpr int16 s_std_lum_quant[64] = { 16,11,12,14,12,10,16,14,13,14,18,17,16,19,24,40,26,24,22,22,24,49,35,37,29,40,58,51,61,60,57,51,56,55,64,72,92,78,64,68,87,69,55,56,80,109,81,87,95,98,103,104,103,62,77,113,121,112,100,120,92,101,103,99 };
+    static constexpr int16 s_std_croma_quant[64] = { 17,18,18,24,21,24,47,26,26,47,99,66,56,66,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99 };
+    static constexpr uint8 s_dc_lum_bits[17] = { 0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0 };
+    static constexpr uint8 s_dc_lum_val[DC_LUM_CODES] = { 0,1,2,3,4,5,6,7,8,9,10,11 };
+    static constexpr uint8 s_ac_lum_bits[17] = { 0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d };
+    static constexpr uint8 s_ac_lum_val[AC_LUM_CODES]  = {
         0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,
         0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,
         0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
@@ -51,10 +51,10 @@ namespace jpge {
         0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
         0xf9,0xfa
     };
-    static const uint8 s_dc_chroma_bits[17] = { 0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0 };
-    static const uint8 s_dc_chroma_val[DC_CHROMA_CODES]  = { 0,1,2,3,4,5,6,7,8,9,10,11 };
-    static const uint8 s_ac_chroma_bits[17] = { 0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77 };
-    static const uint8 s_ac_chroma_val[AC_CHROMA_CODES] = {
+    static constexpr uint8 s_dc_chroma_bits[17] = { 0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0 };
+    static constexpr uint8 s_dc_chroma_val[DC_CHROMA_CODES]  = { 0,1,2,3,4,5,6,7,8,9,10,11 };
+    static constexpr uint8 s_ac_chroma_bits[17] = { 0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77 };
+    static constexpr uint8 s_ac_chroma_val[AC_CHROMA_CODES] = {
         0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,
         0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,
         0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
@@ -65,14 +65,81 @@ namespace jpge {
 
     const int YR = 19595, YG = 38470, YB = 7471, CB_R = -11059, CB_G = -21709, CB_B = 32768, CR_R = 32768, CR_G = -27439, CR_B = -5329;
 
-    static int32 m_last_quality = 0;
-    static int32 m_quantization_tables[2][64];
+    // Compile time generation of the Huffman code tables (Annex K) and of the quantization tables for
+    // common qualities, so they live in flash instead of being computed into DRAM at run time.
+    // C++11 constexpr functions are limited to a single return statement, hence the recursion.
 
-    static bool m_huff_initialized = false;
-    static uint m_huff_codes[4][256];
-    static uint8 m_huff_code_sizes[4][256];
-    static uint8 m_huff_bits[4][17];
-    static uint8 m_huff_val[4][256];
+    // Number of codes shorter than l bits.
+    static constexpr int huff_count_below(const uint8 *bits, int l) {
+        return (l <= 1) ? 0 : bits[l - 1] + huff_count_below(bits, l - 1);
+    }
+    // First (canonical) code of length l.
+    static constexpr uint huff_first_code(const uint8 *bits, int l) {
+        return (l <= 1) ? 0 : (huff_first_code(bits, l - 1) + bits[l - 1]) << 1;
+    }
+    // Length of the p'th code.
+    static constexpr int huff_size_at(const uint8 *bits, int p, int l) {
+        return (l > 16) ? 0 : ((p < huff_count_below(bits, l + 1)) ? l : huff_size_at(bits, p, l + 1));
+    }
+    static constexpr uint huff_code_at(const uint8 *bits, int p, int l) {
+        return huff_first_code(bits, l) + (p - huff_count_below(bits, l));
+    }
+    // Position of symbol s in the n entries of val, -1 if it has no code.
+    static constexpr int huff_pos(const uint8 *val, int n, int s, int p) {
+        return (p >= n) ? -1 : ((val[p] == s) ? p : huff_pos(val, n, s, p + 1));
+    }
+    static constexpr uint16 huff_code_p(const uint8 *bits, int p) {
+        return (p < 0) ? 0 : huff_code_at(bits, p, huff_size_at(bits, p, 1));
+    }
+    static constexpr uint8 huff_size_p(const uint8 *bits, int p) {
+        return (p < 0) ? 0 : huff_size_at(bits, p, 1);
+    }
+    static constexpr uint16 huff_code(const uint8 *bits, const uint8 *val, int s) {
+        return huff_code_p(bits, huff_pos(val, huff_count_below(bits, 17), s, 0));
+    }
+    static constexpr uint8 huff_size(const uint8 *bits, const uint8 *val, int s) {
+        return huff_size_p(bits, huff_pos(val, huff_count_below(bits, 17), s, 0));
+    }
+
+#define JPGE_X4(f, b, v, s)   f(b, v, (s)), f(b, v, (s) + 1), f(b, v, (s) + 2), f(b, v, (s) + 3)
+#define JPGE_X16(f, b, v, s)  JPGE_X4(f, b, v, s), JPGE_X4(f, b, v, (s) + 4), JPGE_X4(f, b, v, (s) + 8), JPGE_X4(f, b, v, (s) + 12)
+#define JPGE_X64(f, b, v, s)  JPGE_X16(f, b, v, s), JPGE_X16(f, b, v, (s) + 16), JPGE_X16(f, b, v, (s) + 32), JPGE_X16(f, b, v, (s) + 48)
+#define JPGE_X256(f, b, v)    { JPGE_X64(f, b, v, 0), JPGE_X64(f, b, v, 64), JPGE_X64(f, b, v, 128), JPGE_X64(f, b, v, 192) }
+
+    // Indexed like the DHT table classes: 0 = DC luma, 1 = DC chroma, 2 = AC luma, 3 = AC chroma.
+    static constexpr uint16 s_huff_codes[4][256] = {
+        JPGE_X256(huff_code, s_dc_lum_bits, s_dc_lum_val),   JPGE_X256(huff_code, s_dc_chroma_bits, s_dc_chroma_val),
+        JPGE_X256(huff_code, s_ac_lum_bits, s_ac_lum_val),   JPGE_X256(huff_code, s_ac_chroma_bits, s_ac_chroma_val)
+    };
+    static constexpr uint8 s_huff_code_sizes[4][256] = {
+        JPGE_X256(huff_size, s_dc_lum_bits, s_dc_lum_val),   JPGE_X256(huff_size, s_dc_chroma_bits, s_dc_chroma_val),
+        JPGE_X256(huff_size, s_ac_lum_bits, s_ac_lum_val),   JPGE_X256(huff_size, s_ac_chroma_bits, s_ac_chroma_val)
+    };
+    static const uint8 * const s_huff_bits[4] = { s_dc_lum_bits, s_dc_chroma_bits, s_ac_lum_bits, s_ac_chroma_bits };
+    static const uint8 * const s_huff_val[4] = { s_dc_lum_val, s_dc_chroma_val, s_ac_lum_val, s_ac_chroma_val };
+
+    // IJG style quality scaling of the standard tables.
+    static constexpr int32 quant_scale(int quality) {
+        return (quality < 50) ? 5000 / quality : 200 - quality * 2;
+    }
+    static constexpr uint8 quant_clamp(int32 j) {
+        return (j < 1) ? 1 : ((j > 255) ? 255 : j);
+    }
+#define JPGE_QV(t, q, i)   quant_clamp((t[i] * quant_scale(q) + 50) / 100)
+#define JPGE_Q8(t, q, i)   JPGE_QV(t, q, (i)), JPGE_QV(t, q, (i) + 1), JPGE_QV(t, q, (i) + 2), JPGE_QV(t, q, (i) + 3), \
+                           JPGE_QV(t, q, (i) + 4), JPGE_QV(t, q, (i) + 5), JPGE_QV(t, q, (i) + 6), JPGE_QV(t, q, (i) + 7)
+#define JPGE_Q64(t, q)     { JPGE_Q8(t, q, 0), JPGE_Q8(t, q, 8), JPGE_Q8(t, q, 16), JPGE_Q8(t, q, 24), \
+                             JPGE_Q8(t, q, 32), JPGE_Q8(t, q, 40), JPGE_Q8(t, q, 48), JPGE_Q8(t, q, 56) }
+#define JPGE_QUALITY(q)    { JPGE_Q64(s_std_lum_quant, q), JPGE_Q64(s_std_croma_quant, q) }
+
+    // Luma and chroma tables for qualities 5, 10, ... 100 (QUANT_QUALITY_STEP apart), other qualities are computed.
+    enum { QUANT_QUALITY_STEP = 5 };
+    static constexpr uint8 s_quant_tables[100 / QUANT_QUALITY_STEP][2][64] = {
+        JPGE_QUALITY(5),  JPGE_QUALITY(10), JPGE_QUALITY(15), JPGE_QUALITY(20), JPGE_QUALITY(25),
+        JPGE_QUALITY(30), JPGE_QUALITY(35), JPGE_QUALITY(40), JPGE_QUALITY(45), JPGE_QUALITY(50),
+        JPGE_QUALITY(55), JPGE_QUALITY(60), JPGE_QUALITY(65), JPGE_QUALITY(70), JPGE_QUALITY(75),
+        JPGE_QUALITY(80), JPGE_QUALITY(85), JPGE_QUALITY(90), JPGE_QUALITY(95), JPGE_QUALITY(100)
+    };
 
     static inline uint8 clamp(int i) {
         if (i < 0) {
@@ -98,6 +165,10 @@ namespace jpge {
         }
     }
 
+    static void Y_to_Y(uint8* pDst, const uint8* pSrc, int num_pixels) {
+        memcpy(pDst, pSrc, num_pixels);
+    }
+
     static void Y_to_YCC(uint8* pDst, const uint8* pSrc, int num_pixels) {
         for( ; num_pixels; pDst += 3, pSrc++, num_pixels--) {
             pDst[0] = pSrc[0];
@@ -142,49 +213,29 @@ namespace jpge {
         }
     }
 
-    // Compute the actual canonical Huffman codes/code sizes given the JPEG huff bits and val arrays.
-    static void compute_huffman_table(uint *codes, uint8 *code_sizes, uint8 *bits, uint8 *val)
+    // Pick where the next output bytes go: straight into the stream's memory if it offers some,
+    // otherwise into our own chunk buffer.
+    void jpeg_encoder::next_out_chunk()
     {
-        int i, l, last_p, si;
-        static uint8 huff_size[257];
-        static uint huff_code[257];
-        uint code;
-
-        int p = 0;
-        for (l = 1; l <= 16; l++) {
-            for (i = 1; i <= bits[l]; i++) {
-                huff_size[p++] = (char)l;
-            }
-        }
-
-        huff_size[p] = 0;
-        last_p = p; // write sentinel
-
-        code = 0; si = huff_size[0]; p = 0;
-
-        while (huff_size[p]) {
-            while (huff_size[p] == si) {
-                huff_code[p++] = code++;
-            }
-            code <<= 1;
-            si++;
-        }
-
-        memset(codes, 0, sizeof(codes[0])*256);
-        memset(code_sizes, 0, sizeof(code_sizes[0])*256);
-        for (p = 0; p < last_p; p++) {
-            codes[val[p]]      = huff_code[p];
-            code_sizes[val[p]] = huff_size[p];
+        uint len = 0;
+        uint8 *pDirect = m_pStream->get_direct_buf(&len);
+        if (pDirect && len) {
+            m_pOut_chunk = pDirect;
+            m_out_chunk_size = len;
+        } else {
+            m_pOut_chunk = m_out_buf;
+            m_out_chunk_size = m_params.m_out_buf_size;
         }
+        m_pOut_buf = m_pOut_chunk;
+        m_out_buf_left = m_out_chunk_size;
     }
 
     void jpeg_encoder::flush_output_buffer()
     {
-        if (m_out_buf_left != JPGE_OUT_BUF_SIZE) {
-            m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_out_buf, JPGE_OUT_BUF_SIZE - m_out_buf_left);
+        if (m_out_buf_left != m_out_chunk_size) {
+            m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_pOut_chunk, m_out_chunk_size - m_out_buf_left);
         }
-        m_pOut_buf = m_out_buf;
-        m_out_buf_left = JPGE_OUT_BUF_SIZE;
+        next_out_chunk();
     }
 
     void jpeg_encoder::emit_byte(uint8 i)
@@ -195,18 +246,54 @@ namespace jpge {
         }
     }
 
+    // Number of bits needed to hold v (0 for 0).
+    static inline int bit_count(uint v)
+    {
+        return v ? 32 - __builtin_clz(v) : 0;
+    }
+
+    // Write 32 entropy coded bits. Words without a 0xFF byte (the common case) need no stuffing
+    // and are stored in one go, otherwise fall back to byte at a time.
+    void jpeg_encoder::emit_bit_word(uint32 w)
+    {
+        if (m_out_buf_left >= 4 && !((~w - 0x01010101U) & w & 0x80808080U)) {
+            m_pOut_buf[0] = uint8(w >> 24); m_pOut_buf[1] = uint8(w >> 16);
+            m_pOut_buf[2] = uint8(w >> 8);  m_pOut_buf[3] = uint8(w);
+            m_pOut_buf += 4;
+            if ((m_out_buf_left -= 4) == 0) {
+                flush_output_buffer();
+            }
+            return;
+        }
+        for (int s = 24; s >= 0; s -= 8) {
+            uint8 c = uint8(w >> s);
+            emit_byte(c);
+            if (c == 0xFF) {
+                emit_byte(0);
+            }
+        }
+    }
+
+    // bits must fit in len, len <= 32. Callers merge a Huffman code and its value into one call.
     void jpeg_encoder::put_bits(uint bits, uint len)
     {
-        uint8 c = 0;
-        m_bit_buffer |= ((uint32)bits << (24 - (m_bits_in += len)));
+        m_bit_buffer = (m_bit_buffer << len) | bits;
+        if ((m_bits_in += len) >= 32) {
+            m_bits_in -= 32;
+            emit_bit_word(uint32(m_bit_buffer >> m_bits_in));
+        }
+    }
+
+    // Write out the remaining whole bytes of the bit buffer, the caller pads to a byte boundary first.
+    void jpeg_encoder::flush_bits()
+    {
         while (m_bits_in >= 8) {
-            c = (uint8)((m_bit_buffer >> 16) & 0xFF);
+            m_bits_in -= 8;
+            uint8 c = uint8(m_bit_buffer >> m_bits_in);
             emit_byte(c);
             if (c == 0xFF) {
                 emit_byte(0);
             }
-            m_bit_buffer <<= 8;
-            m_bits_in -= 8;
         }
     }
 
@@ -246,7 +333,7 @@ namespace jpge {
             emit_word(64 + 1 + 2);
             emit_byte(static_cast<uint8>(i));
             for (int j = 0; j < 64; j++)
-                emit_byte(static_cast<uint8>(m_quantization_tables[i][j]));
+                emit_byte(m_quant_tables[i][j]);
         }
     }
 
@@ -268,7 +355,7 @@ namespace jpge {
     }
 
     // Emit Huffman table.
-    void jpeg_encoder::emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag)
+    void jpeg_encoder::emit_dht(const uint8 *bits, const uint8 *val, int index, bool ac_flag)
     {
         emit_marker(M_DHT);
 
@@ -289,11 +376,11 @@ namespace jpge {
     // Emit all Huffman tables.
     void jpeg_encoder::emit_dhts()
     {
-        emit_dht(m_huff_bits[0+0], m_huff_val[0+0], 0, false);
-        emit_dht(m_huff_bits[2+0], m_huff_val[2+0], 0, true);
+        emit_dht(s_huff_bits[0+0], s_huff_val[0+0], 0, false);
+        emit_dht(s_huff_bits[2+0], s_huff_val[2+0], 0, true);
         if (m_num_components == 3) {
-            emit_dht(m_huff_bits[0+1], m_huff_val[0+1], 1, false);
-            emit_dht(m_huff_bits[2+1], m_huff_val[2+1], 1, true);
+            emit_dht(s_huff_bits[0+1], s_huff_val[0+1], 1, false);
+            emit_dht(s_huff_bits[2+1], s_huff_val[2+1], 1, true);
         }
     }
 
@@ -316,14 +403,14 @@ namespace jpge {
         emit_byte(0);
     }
 
-    void jpeg_encoder::load_block_8_8_grey(int x)
+    void jpeg_encoder::load_block_8_8_grey(const uint8 * const *pLines, int x)
     {
-        uint8 *pSrc;
+        const uint8 *pSrc;
         sample_array_t *pDst = m_sample_array;
         x <<= 3;
         for (int i = 0; i < 8; i++, pDst += 8)
         {
-            pSrc = m_mcu_lines[i] + x;
+            pSrc = pLines[i] + x;
             pDst[0] = pSrc[0] - 128; pDst[1] = pSrc[1] - 128; pDst[2] = pSrc[2] - 128; pDst[3] = pSrc[3] - 128;
             pDst[4] = pSrc[4] - 128; pDst[5] = pSrc[5] - 128; pDst[6] = pSrc[6] - 128; pDst[7] = pSrc[7] - 128;
         }
@@ -378,7 +465,7 @@ namespace jpge {
 
     void jpeg_encoder::load_quantized_coefficients(int component_num)
     {
-        int32 *q = m_quantization_tables[component_num > 0];
+        const uint8 *q = m_quant_tables[component_num > 0];
         int16 *pDst = m_coefficient_array;
         for (int i = 0; i < 64; i++)
         {
@@ -405,36 +492,21 @@ namespace jpge {
     {
         int i, j, run_len, nbits, temp1, temp2;
         int16 *pSrc = m_coefficient_array;
-        uint *codes[2];
-        uint8 *code_sizes[2];
+        const uint16 *codes[2];
+        const uint8 *code_sizes[2];
 
         if (component_num == 0)
         {
-            codes[0] = m_huff_codes[0 + 0]; codes[1] = m_huff_codes[2 + 0];
-            code_sizes[0] = m_huff_code_sizes[0 + 0]; code_sizes[1] = m_huff_code_sizes[2 + 0];
+            codes[0] = s_huff_codes[0 + 0]; codes[1] = s_huff_codes[2 + 0];
+            code_sizes[0] = s_huff_code_sizes[0 + 0]; code_sizes[1] = s_huff_code_sizes[2 + 0];
         }
         else
         {
-            codes[0] = m_huff_codes[0 + 1]; codes[1] = m_huff_codes[2 + 1];
-            code_sizes[0] = m_huff_code_sizes[0 + 1]; code_sizes[1] = m_huff_code_sizes[2 + 1];
+            codes[0] = s_huff_codes[0 + 1]; codes[1] = s_huff_codes[2 + 1];
+            code_sizes[0] = s_huff_code_sizes[0 + 1]; code_sizes[1] = s_huff_code_sizes[2 + 1];
         }
 
-        temp1 = temp2 = pSrc[0] - m_last_dc_val[component_num];
-        m_last_dc_val[component_num] = pSrc[0];
-
-        if (temp1 < 0)
-        {
-            temp1 = -temp1; temp2--;
-        }
-
-        nbits = 0;
-        while (temp1)
-        {
-            nbits++; temp1 >>= 1;
-        }
-
-        put_bits(codes[0][nbits], code_sizes[0][nbits]);
-        if (nbits) put_bits(temp2 & ((1 << nbits) - 1), nbits);
+        code_dc(component_num, pSrc[0]);
 
         for (run_len = 0, i = 1; i < 64; i++)
         {
@@ -444,7 +516,7 @@ namespace jpge {
             {
                 while (run_len >= 16)
                 {
-                    put_bits(codes[1][0xF0], code_sizes[1][0xF0]);
+                    put_ac_bits(codes[1][0xF0], code_sizes[1][0xF0]);
                     run_len -= 16;
                 }
                 if ((temp2 = temp1) < 0)
@@ -452,81 +524,259 @@ namespace jpge {
                     temp1 = -temp1;
                     temp2--;
                 }
-                nbits = 1;
-                while (temp1 >>= 1)
-                    nbits++;
+                nbits = bit_count(temp1);
                 j = (run_len << 4) + nbits;
-                put_bits(codes[1][j], code_sizes[1][j]);
-                put_bits(temp2 & ((1 << nbits) - 1), nbits);
+                put_ac_bits((codes[1][j] << nbits) | (temp2 & ((1 << nbits) - 1)), code_sizes[1][j] + nbits);
                 run_len = 0;
             }
         }
         if (run_len)
-            put_bits(codes[1][0], code_sizes[1][0]);
+            put_ac_bits(codes[1][0], code_sizes[1][0]);
+    }
+
+    // DC difference to the component's predictor, which becomes dc.
+    void jpeg_encoder::code_dc(int component_num, int dc)
+    {
+        const int t = component_num > 0;
+        int temp1, temp2;
+        temp1 = temp2 = dc - m_last_dc_val[component_num];
+        m_last_dc_val[component_num] = dc;
+
+        if (temp1 < 0)
+        {
+            temp1 = -temp1; temp2--;
+        }
+
+        const int nbits = bit_count(temp1);
+        put_bits((s_huff_codes[0 + t][nbits] << nbits) | (temp2 & ((1 << nbits) - 1)), s_huff_code_sizes[0 + t][nbits] + nbits);
+    }
+
+    // AC codes also go to the block cache, so the block can be reused in the next frame.
+    inline void jpeg_encoder::put_ac_bits(uint bits, uint len)
+    {
+        put_bits(bits, len);
+        if (m_pCache) m_pCache->append(bits, len);
+    }
+
+    // Code the block in m_sample_array from the cache if no sample is further than the tolerance from what the
+    // cached bits were coded from. Otherwise note its samples for the fresh coding and return false.
+    bool jpeg_encoder::code_cached_block(int component_num)
+    {
+        block_cache &cache = *m_pCache;
+        if (!cache.reserve(256)) { // a block's AC codes take at most 63 * 27 bits
+            m_pCache = NULL;
+            return false;
+        }
+
+        // level shifted samples fit a byte, whatever subsampling averaged them
+        int8 *s = cache.m_samples;
+        for (int i = 0; i < 64; i++) {
+            s[i] = static_cast<int8>(m_sample_array[i]);
+        }
+
+        block_cache::entry &e = cache.m_pEntries[cache.m_index];
+        bool reuse = cache.m_valid && !m_pThumb && !m_pCoeffs;
+        if (reuse && !m_cache_tolerance) {
+            reuse = !memcmp(s, e.samples, 64);
+        } else {
+            for (int i = 0; reuse && i < 64; i++) {
+                const int d = s[i] - e.samples[i];
+                reuse = (d <= m_cache_tolerance) && (d >= -m_cache_tolerance);
+            }
+        }
+        if (!reuse) {
+            cache.m_block_start = (uint64)cache.m_write_len * 8 + cache.m_acc_bits;
+            return false;
+        }
+
+        code_dc(component_num, e.dc);
+        uint64 pos = cache.m_read_pos;
+        for (uint n = e.ac_bits; n; ) {
+            const uint len = JPGE_MIN(n, 24U);
+            const uint bits = cache.read(pos, len);
+            put_bits(bits, len);
+            cache.append(bits, len);
+            pos += len;
+            n -= len;
+        }
+        cache.m_read_pos = pos;
+        cache.m_index++;
+        cache.m_reused++;
+        return true;
     }
 
     void jpeg_encoder::code_block(int component_num)
     {
+        if (m_pCache && code_cached_block(component_num)) {
+            return;
+        }
         DCT2D(m_sample_array);
         load_quantized_coefficients(component_num);
         code_coefficients_pass_two(component_num);
+        if (m_pCoeffs) m_pCoeffs->add_block(m_coefficient_array);
+        if (m_pCache) {
+            block_cache &cache = *m_pCache;
+            block_cache::entry &e = cache.m_pEntries[cache.m_index++];
+            if (cache.m_valid) {
+                cache.m_read_pos += e.ac_bits; // skip the old codes
+            }
+            memcpy(e.samples, cache.m_samples, sizeof(e.samples));
+            e.dc = m_coefficient_array[0];
+            e.ac_bits = static_cast<uint16>((uint64)cache.m_write_len * 8 + cache.m_acc_bits - cache.m_block_start);
+        }
     }
 
-    void jpeg_encoder::process_mcu_row()
+    // Code a block whose samples are all 128 (0 after level shift): a zero DC difference followed by EOB.
+    // The DC predictor of the component stays 0, so it must only be used for components coded this way.
+    void jpeg_encoder::code_flat_block(int component_num)
     {
-        if (m_num_components == 1)
-        {
-            for (int i = 0; i < m_mcus_per_row; i++)
-            {
-                load_block_8_8_grey(i); code_block(0);
+        const int t = component_num > 0;
+        put_bits(s_huff_codes[0 + t][0], s_huff_code_sizes[0 + t][0]);
+        put_bits(s_huff_codes[2 + t][0], s_huff_code_sizes[2 + t][0]);
+        if (m_pCoeffs) m_pCoeffs->add_block(NULL);
+    }
+
+    // Thumbnail samples of the block just coded, from the unquantized DCT coefficients left in m_sample_array.
+    // Each sample is written h_rep x v_rep times, for chroma blocks that cover more than 8x8 pixels.
+    void jpeg_encoder::thumb_block(int component_num, int x, int y, int h_rep, int v_rep)
+    {
+        const int k = 8 >> m_thumb_shift, channels = get_thumbnail_channels(), stride = get_thumbnail_stride();
+        const sample_array_t *p = m_sample_array;
+        int32 s[4];
+        if (k == 1) {
+            s[0] = DCT_DESCALE(p[0], 3); // DC is 8 times the block mean
+        } else {
+            // Means of the 4x4 quadrants. Even frequencies above 0 sum to zero over half a block, so only 0, 1, 3, 5
+            // and 7 contribute, the odd ones with opposite signs in the two halves. Weights are Q12.
+            static const uint8 f[5] = { 0, 1, 3, 5, 7 };
+            static const int16 w[8] = { 1448, 1312, 0, -461, 0, 308, 0, -261 };
+            int32 e[8], o[8];
+            for (int i = 0; i < 5; i++) {
+                const sample_array_t *r = p + f[i] * 8;
+                e[f[i]] = r[0] * w[0];
+                o[f[i]] = r[1] * w[1] + r[3] * w[3] + r[5] * w[5] + r[7] * w[7];
+            }
+            for (int qx = 0; qx < 2; qx++) {
+                int32 c[8];
+                for (int i = 0; i < 5; i++) {
+                    c[f[i]] = DCT_DESCALE(qx ? e[f[i]] - o[f[i]] : e[f[i]] + o[f[i]], 12);
+                }
+                const int32 ev = c[0] * w[0], ov = c[1] * w[1] + c[3] * w[3] + c[5] * w[5] + c[7] * w[7];
+                s[qx] = DCT_DESCALE(ev + ov, 12);
+                s[2 + qx] = DCT_DESCALE(ev - ov, 12);
             }
         }
-        else if ((m_comp_h_samp[0] == 1) && (m_comp_v_samp[0] == 1))
-        {
-            for (int i = 0; i < m_mcus_per_row; i++)
-            {
-                load_block_8_8(i, 0, 0); code_block(0); load_block_8_8(i, 0, 1); code_block(1); load_block_8_8(i, 0, 2); code_block(2);
+
+        uint8 *pRow = m_pThumb + (m_thumb_y + y * k * v_rep) * stride + x * k * h_rep * channels + component_num;
+        for (int qy = 0; qy < k; qy++) {
+            for (int j = 0; j < v_rep; j++, pRow += stride) {
+                uint8 *pDst = pRow;
+                for (int qx = 0; qx < k; qx++) {
+                    const uint8 val = clamp(s[qy * k + qx] + 128);
+                    for (int i = 0; i < h_rep; i++, pDst += channels) {
+                        *pDst = val;
+                    }
+                }
             }
         }
-        else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 1))
+    }
+
+    // The thumbnail is built as YCbCr, hand it out as RGB.
+    void jpeg_encoder::thumb_to_rgb()
+    {
+        uint8 *pEnd = m_pThumb + get_thumbnail_size(m_thumb_shift);
+        for (uint8 *p = m_pThumb; p < pEnd; p += 3) {
+            const int y = p[0] << 16, cb = p[1] - 128, cr = p[2] - 128;
+            p[0] = clamp((y + 91881 * cr + 32768) >> 16);
+            p[1] = clamp((y - 22554 * cb - 46802 * cr + 32768) >> 16);
+            p[2] = clamp((y + 116130 * cb + 32768) >> 16);
+        }
+    }
+
+    // Code one MCU row from luma lines (m_mcu_y of them), with flat chroma blocks when FLAT_CHROMA is set.
+    template <int H_SAMP, int V_SAMP, bool FLAT_CHROMA>
+    void jpeg_encoder::process_y_rows(const uint8 * const *pLines)
+    {
+        for (int i = 0; i < m_mcus_per_row; i++)
         {
-            for (int i = 0; i < m_mcus_per_row; i++)
+            for (int v = 0; v < V_SAMP; v++)
+            {
+                for (int h = 0; h < H_SAMP; h++)
+                {
+                    load_block_8_8_grey(pLines + v * 8, i * H_SAMP + h); code_block(0);
+                    if (m_pThumb) thumb_block(0, i * H_SAMP + h, v, 1, 1);
+                }
+            }
+            if (FLAT_CHROMA)
             {
-                load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
-                load_block_16_8_8(i, 1); code_block(1); load_block_16_8_8(i, 2); code_block(2);
+                code_flat_block(1); code_flat_block(2);
             }
         }
-        else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 2))
+        if (m_pThumb) m_thumb_y += (V_SAMP * 8) >> m_thumb_shift;
+    }
+
+    // Code one MCU row from interleaved YCbCr lines in m_mcu_lines.
+    template <int H_SAMP, int V_SAMP>
+    void jpeg_encoder::process_ycc_rows(const uint8 * const *)
+    {
+        for (int i = 0; i < m_mcus_per_row; i++)
         {
-            for (int i = 0; i < m_mcus_per_row; i++)
+            for (int v = 0; v < V_SAMP; v++)
             {
-                load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
-                load_block_8_8(i * 2 + 0, 1, 0); code_block(0); load_block_8_8(i * 2 + 1, 1, 0); code_block(0);
-                load_block_16_8(i, 1); code_block(1); load_block_16_8(i, 2); code_block(2);
+                for (int h = 0; h < H_SAMP; h++)
+                {
+                    load_block_8_8(i * H_SAMP + h, v, 0); code_block(0);
+                    if (m_pThumb) thumb_block(0, i * H_SAMP + h, v, 1, 1);
+                }
             }
+            for (int c = 1; c < 3; c++)
+            {
+                if (H_SAMP == 1)
+                    load_block_8_8(i, 0, c);
+                else if (V_SAMP == 1)
+                    load_block_16_8_8(i, c);
+                else
+                    load_block_16_8(i, c);
+                code_block(c);
+                if (m_pThumb) thumb_block(c, i, 0, H_SAMP, V_SAMP);
+            }
+        }
+        if (m_pThumb) m_thumb_y += (V_SAMP * 8) >> m_thumb_shift;
+    }
+
+    // Pick the scanline converter and MCU row coder once per image, so the per line and
+    // per MCU paths don't branch on the source format and subsampling.
+    void jpeg_encoder::select_kernels()
+    {
+        if (m_y_source) {
+            m_convert_line = (m_image_bpp == 3) ? RGB_to_Y : Y_to_Y;
+        } else {
+            m_convert_line = (m_image_bpp == 3) ? RGB_to_YCC : Y_to_YCC;
+        }
+
+        switch (m_params.m_subsampling) {
+            case Y_ONLY: m_code_rows = &jpeg_encoder::process_y_rows<1, 1, false>; break;
+            case H1V1:   m_code_rows = m_y_source ? &jpeg_encoder::process_y_rows<1, 1, true> : &jpeg_encoder::process_ycc_rows<1, 1>; break;
+            case H2V1:   m_code_rows = m_y_source ? &jpeg_encoder::process_y_rows<2, 1, true> : &jpeg_encoder::process_ycc_rows<2, 1>; break;
+            case H2V2:   m_code_rows = m_y_source ? &jpeg_encoder::process_y_rows<2, 2, true> : &jpeg_encoder::process_ycc_rows<2, 2>; break;
         }
     }
 
+    void jpeg_encoder::process_mcu_row()
+    {
+        (this->*m_code_rows)(m_mcu_lines);
+    }
+
     void jpeg_encoder::load_mcu(const void *pSrc)
     {
         const uint8* Psrc = reinterpret_cast<const uint8*>(pSrc);
 
         uint8* pDst = m_mcu_lines[m_mcu_y_ofs]; // OK to write up to m_image_bpl_xlt bytes to pDst
 
-        if (m_num_components == 1) {
-            if (m_image_bpp == 3)
-                RGB_to_Y(pDst, Psrc, m_image_x);
-            else
-                memcpy(pDst, Psrc, m_image_x);
-        } else {
-            if (m_image_bpp == 3)
-                RGB_to_YCC(pDst, Psrc, m_image_x);
-            else
-                Y_to_YCC(pDst, Psrc, m_image_x);
-        }
+        m_convert_line(pDst, Psrc, m_image_x);
 
         // Possibly duplicate pixels at end of scanline if not a multiple of 8 or 16
-        if (m_num_components == 1)
+        if (m_y_source)
             memset(m_mcu_lines[m_mcu_y_ofs] + m_image_bpl_xlt, pDst[m_image_bpl_xlt - 1], m_image_x_mcu - m_image_x);
         else
         {
@@ -546,13 +796,9 @@ namespace jpge {
     }
 
     // Quantization table generation.
-    void jpeg_encoder::compute_quant_table(int32 *pDst, const int16 *pSrc)
+    void jpeg_encoder::compute_quant_table(uint8 *pDst, const int16 *pSrc)
     {
-        int32 q;
-        if (m_params.m_quality < 50)
-            q = 5000 / m_params.m_quality;
-        else
-            q = 200 - m_params.m_quality * 2;
+        int32 q = quant_scale(m_params.m_quality);
         for (int i = 0; i < 64; i++)
         {
             int32 j = *pSrc++; j = (j * q + 50L) / 100L;
@@ -561,7 +807,7 @@ namespace jpge {
     }
 
     // Higher-level methods.
-    bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_channels)
+    bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_channels, bool transcoding)
     {
         m_num_components = 3;
         switch (m_params.m_subsampling)
@@ -603,38 +849,37 @@ namespace jpge {
         m_image_bpl      = m_image_x * src_channels;
         m_image_x_mcu    = (m_image_x + m_mcu_x - 1) & (~(m_mcu_x - 1));
         m_image_y_mcu    = (m_image_y + m_mcu_y - 1) & (~(m_mcu_y - 1));
-        m_image_bpl_xlt  = m_image_x * m_num_components;
-        m_image_bpl_mcu  = m_image_x_mcu * m_num_components;
+        m_y_source       = (m_num_components == 1) || m_params.m_flat_chroma;
+        m_image_bpl_xlt  = m_image_x * (m_y_source ? 1 : m_num_components);
+        m_image_bpl_mcu  = m_image_x_mcu * (m_y_source ? 1 : m_num_components);
         m_mcus_per_row   = m_image_x_mcu / m_mcu_x;
+        select_kernels();
 
-        if ((m_mcu_lines[0] = static_cast<uint8*>(jpge_malloc(m_image_bpl_mcu * m_mcu_y))) == NULL) {
-            return false;
+        // transcoding codes stored coefficients, there are no source lines
+        if (!transcoding) {
+            if ((m_mcu_lines[0] = static_cast<uint8*>(jpge_malloc(m_image_bpl_mcu * m_mcu_y))) == NULL) {
+                return false;
+            }
+            for (int i = 1; i < m_mcu_y; i++)
+                m_mcu_lines[i] = m_mcu_lines[i-1] + m_image_bpl_mcu;
         }
-        for (int i = 1; i < m_mcu_y; i++)
-            m_mcu_lines[i] = m_mcu_lines[i-1] + m_image_bpl_mcu;
 
-        if(m_last_quality != m_params.m_quality){
-            m_last_quality = m_params.m_quality;
-            compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
-            compute_quant_table(m_quantization_tables[1], s_std_croma_quant);
+        if((m_params.m_quality % QUANT_QUALITY_STEP) == 0){
+            m_quant_tables[0] = s_quant_tables[m_params.m_quality / QUANT_QUALITY_STEP - 1][0];
+            m_quant_tables[1] = s_quant_tables[m_params.m_quality / QUANT_QUALITY_STEP - 1][1];
+        } else {
+            // per encoder, so encoders running at different qualities don't share tables
+            compute_quant_table(m_own_quant[0], s_std_lum_quant);
+            if (m_num_components == 3)
+                compute_quant_table(m_own_quant[1], s_std_croma_quant);
+            m_quant_tables[0] = m_own_quant[0];
+            m_quant_tables[1] = m_own_quant[1];
         }
 
-        if(!m_huff_initialized){
-            m_huff_initialized = true;
-
-            memcpy(m_huff_bits[0+0], s_dc_lum_bits, 17);    memcpy(m_huff_val[0+0], s_dc_lum_val, DC_LUM_CODES);
-            memcpy(m_huff_bits[2+0], s_ac_lum_bits, 17);    memcpy(m_huff_val[2+0], s_ac_lum_val, AC_LUM_CODES);
-            memcpy(m_huff_bits[0+1], s_dc_chroma_bits, 17); memcpy(m_huff_val[0+1], s_dc_chroma_val, DC_CHROMA_CODES);
-            memcpy(m_huff_bits[2+1], s_ac_chroma_bits, 17); memcpy(m_huff_val[2+1], s_ac_chroma_val, AC_CHROMA_CODES);
-
-            compute_huffman_table(&m_huff_codes[0+0][0], &m_huff_code_sizes[0+0][0], m_huff_bits[0+0], m_huff_val[0+0]);
-            compute_huffman_table(&m_huff_codes[2+0][0], &m_huff_code_sizes[2+0][0], m_huff_bits[2+0], m_huff_val[2+0]);
-            compute_huffman_table(&m_huff_codes[0+1][0], &m_huff_code_sizes[0+1][0], m_huff_bits[0+1], m_huff_val[0+1]);
-            compute_huffman_table(&m_huff_codes[2+1][0], &m_huff_code_sizes[2+1][0], m_huff_bits[2+1], m_huff_val[2+1]);
+        if ((m_out_buf = static_cast<uint8*>(jpge_malloc(m_params.m_out_buf_size))) == NULL) {
+            return false;
         }
-
-        m_out_buf_left = JPGE_OUT_BUF_SIZE;
-        m_pOut_buf = m_out_buf;
+        next_out_chunk();
         m_bit_buffer = 0;
         m_bits_in = 0;
         m_mcu_y_ofs = 0;
@@ -662,8 +907,15 @@ namespace jpge {
             }
             process_mcu_row();
         }
+        if (m_pThumb && get_thumbnail_channels() == 3) {
+            thumb_to_rgb();
+        }
+        if (m_pCache) {
+            m_pCache->finish();
+        }
 
         put_bits(0x7F, 7);
+        flush_bits();
         emit_marker(M_EOI);
         flush_output_buffer();
         m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(NULL, 0);
@@ -674,8 +926,15 @@ namespace jpge {
     void jpeg_encoder::clear()
     {
         m_mcu_lines[0] = NULL;
+        m_out_buf = NULL;
         m_pass_num = 0;
         m_all_stream_writes_succeeded = true;
+        m_pThumb = NULL;
+        m_thumb_shift = 0;
+        m_thumb_y = 0;
+        m_pCoeffs = NULL;
+        m_pCache = NULL;
+        m_cache_tolerance = 0;
     }
 
     jpeg_encoder::jpeg_encoder()
@@ -700,9 +959,268 @@ namespace jpge {
     void jpeg_encoder::deinit()
     {
         jpge_free(m_mcu_lines[0]);
+        jpge_free(m_out_buf);
         clear();
     }
 
+    bool jpeg_encoder::process_y_image(const uint8 *pImage)
+    {
+        if ((m_pass_num != 2) || (!m_y_source) || (m_image_bpp != 1) || (m_mcu_y_ofs != 0)) {
+            return false;
+        }
+        int y = 0;
+        if (m_image_x == m_image_x_mcu) {
+            // whole MCU rows are coded straight from the source image
+            const uint8 *lines[16];
+            for ( ; (y + m_mcu_y <= m_image_y) && m_all_stream_writes_succeeded; y += m_mcu_y) {
+                for (int i = 0; i < m_mcu_y; i++) {
+                    lines[i] = pImage + (y + i) * m_image_x;
+                }
+                (this->*m_code_rows)(lines);
+            }
+        }
+        // remaining lines need padding, go through the MCU line buffer
+        for ( ; (y < m_image_y) && m_all_stream_writes_succeeded; y++) {
+            load_mcu(pImage + y * m_image_x);
+        }
+        return process_scanline(NULL);
+    }
+
+    uint jpeg_encoder::get_thumbnail_size(int shift) const
+    {
+        return (m_image_x_mcu >> shift) * get_thumbnail_channels() * (m_image_y_mcu >> shift);
+    }
+
+    bool jpeg_encoder::set_thumbnail(uint8 *pBuf, int shift)
+    {
+        if ((m_pass_num != 2) || (!pBuf) || (shift < 2) || (shift > 3)) {
+            return false;
+        }
+        m_pThumb = pBuf;
+        m_thumb_shift = shift;
+        m_thumb_y = 0;
+        return true;
+    }
+
+    bool jpeg_encoder::set_coefficient_store(coefficient_store *pStore)
+    {
+        if ((m_pass_num != 2) || (!pStore)) {
+            return false;
+        }
+        m_pCoeffs = pStore;
+        m_pCoeffs->begin(m_image_x, m_image_y, m_params, m_quant_tables);
+        return true;
+    }
+
+    bool jpeg_encoder::transcode(output_stream *pStream, const coefficient_store &store, int quality)
+    {
+        deinit();
+        params comp_params = store.m_params;
+        comp_params.m_quality = quality;
+        if ((!pStream) || (!store.is_valid()) || (!comp_params.check())) return false;
+        m_pStream = pStream;
+        m_params = comp_params;
+        if (!jpg_open(store.m_width, store.m_height, (m_params.m_subsampling == Y_ONLY) ? 1 : 3, true)) return false;
+
+        // blocks are stored in coding order: the luma blocks of an MCU, then its Cb and Cr blocks
+        const int luma_blocks = m_comp_h_samp[0] * m_comp_v_samp[0];
+        const int blocks_per_mcu = luma_blocks + m_num_components - 1;
+        const uint8 *p = store.m_pBuf, *pEnd = store.m_pBuf + store.m_len;
+        for (int b = 0; (p < pEnd) && m_all_stream_writes_succeeded; b = (b + 1 == blocks_per_mcu) ? 0 : b + 1)
+        {
+            const int c = (b < luma_blocks) ? 0 : b - luma_blocks + 1;
+            const uint8 *q_old = store.m_quant[c > 0], *q_new = m_quant_tables[c > 0];
+            memset(m_coefficient_array, 0, sizeof(m_coefficient_array));
+            for (int n = *p++; n; n--, p += 3)
+            {
+                const int i = p[0];
+                // Dead zone rounding: the stored value is already off by up to half a step of the old table,
+                // so rounding half up again could make it bigger than quantizing the original would. Taking
+                // that half step off the rounding keeps every coefficient at most what a direct encode at
+                // this quality gives, and leaves it as it was when the table is the same.
+                const int32 j = static_cast<int16>(p[1] | (p[2] << 8)) * q_old[i];
+                const int32 round = JPGE_MAX(q_new[i] - q_old[i], 0) >> 1;
+                m_coefficient_array[i] = static_cast<int16>((j < 0) ? -((-j + round) / q_new[i]) : (j + round) / q_new[i]);
+            }
+            code_coefficients_pass_two(c);
+        }
+        return process_end_of_image() && m_all_stream_writes_succeeded;
+    }
+
+    bool jpeg_encoder::set_block_cache(block_cache *pCache, int tolerance)
+    {
+        if ((m_pass_num != 2) || (!pCache) || (tolerance < 0)) {
+            return false;
+        }
+        // blocks coded with code_block() per frame, flat chroma blocks aren't
+        const int mcus = (m_image_x_mcu / m_mcu_x) * (m_image_y_mcu / m_mcu_y);
+        const int blocks = m_comp_h_samp[0] * m_comp_v_samp[0] + ((m_y_source) ? 0 : 2);
+        if (!pCache->begin(m_image_x, m_image_y, m_params, m_quant_tables, mcus * blocks)) {
+            return false;
+        }
+        m_pCache = pCache;
+        m_cache_tolerance = JPGE_MIN(tolerance, 255);
+        return true;
+    }
+
+    block_cache::block_cache() : m_pEntries(NULL), m_count(0), m_index(0), m_cur(0), m_read_pos(0), m_write_len(0), m_acc(0), m_acc_bits(0),
+        m_block_start(0), m_valid(false), m_complete(false), m_reused(0), m_width(0), m_height(0)
+    {
+        m_pBits[0] = m_pBits[1] = NULL;
+        m_bits_size[0] = m_bits_size[1] = 0;
+    }
+
+    block_cache::~block_cache()
+    {
+        jpge_free(m_pEntries);
+        jpge_free(m_pBits[0]);
+        jpge_free(m_pBits[1]);
+    }
+
+    void block_cache::reset()
+    {
+        m_complete = false;
+    }
+
+    bool block_cache::begin(int width, int height, const params &comp_params, const uint8 * const *pQuant, uint blocks)
+    {
+        m_valid = m_complete && (blocks == m_count) && (width == m_width) && (height == m_height) &&
+                  (comp_params.m_subsampling == m_params.m_subsampling) && (comp_params.m_flat_chroma == m_params.m_flat_chroma) &&
+                  !memcmp(m_quant[0], pQuant[0], 64) && !memcmp(m_quant[1], pQuant[1], 64);
+        if (blocks != m_count) {
+            jpge_free(m_pEntries);
+            if ((m_pEntries = static_cast<entry*>(jpge_malloc(blocks * sizeof(entry)))) == NULL) {
+                m_count = 0;
+                m_complete = false;
+                return false;
+            }
+            m_count = blocks;
+        }
+        m_width = width;
+        m_height = height;
+        m_params = comp_params;
+        memcpy(m_quant[0], pQuant[0], 64);
+        memcpy(m_quant[1], pQuant[1], 64);
+
+        m_cur ^= 1; // the last frame's bits become the ones to read
+        m_index = 0;
+        m_read_pos = 0;
+        m_write_len = 0;
+        m_acc = 0;
+        m_acc_bits = 0;
+        m_reused = 0;
+        m_complete = false;
+        return true;
+    }
+
+    void block_cache::finish()
+    {
+        if (m_acc_bits) {
+            m_pBits[m_cur][m_write_len++] = static_cast<uint8>(m_acc << (8 - m_acc_bits));
+            m_acc_bits = 0;
+        }
+        m_complete = (m_index == m_count);
+    }
+
+    // Room for bytes more plus the 4 bytes read() may look past the end, growing without realloc so the
+    // buffer may come from PSRAM.
+    bool block_cache::reserve(uint bytes)
+    {
+        if (m_write_len + bytes + 4 <= m_bits_size[m_cur]) {
+            return true;
+        }
+        const uint size = JPGE_MAX(m_bits_size[m_cur] + m_bits_size[m_cur] / 2, m_write_len + bytes + 16384);
+        uint8 *pBuf = static_cast<uint8*>(jpge_malloc(size));
+        if (!pBuf) {
+            return false; // the frame goes on without the cache and won't be reused
+        }
+        if (m_write_len) {
+            memcpy(pBuf, m_pBits[m_cur], m_write_len);
+        }
+        jpge_free(m_pBits[m_cur]);
+        m_pBits[m_cur] = pBuf;
+        m_bits_size[m_cur] = size;
+        return true;
+    }
+
+    inline void block_cache::append(uint bits, uint len)
+    {
+        m_acc = (m_acc << len) | bits;
+        m_acc_bits += len;
+        while (m_acc_bits >= 8) {
+            m_acc_bits -= 8;
+            m_pBits[m_cur][m_write_len++] = static_cast<uint8>(m_acc >> m_acc_bits);
+        }
+    }
+
+    // len <= 24 bits at bit position pos of the previous frame's codes
+    inline uint block_cache::read(uint64 pos, uint len) const
+    {
+        const uint8 *p = m_pBits[m_cur ^ 1] + (pos >> 3);
+        const uint32 w = (uint32(p[0]) << 24) | (uint32(p[1]) << 16) | (uint32(p[2]) << 8) | p[3];
+        return (w << (pos & 7)) >> (32 - len);
+    }
+
+    coefficient_store::coefficient_store() : m_pBuf(NULL), m_len(0), m_capacity(0), m_failed(false), m_width(0), m_height(0) { }
+
+    coefficient_store::~coefficient_store()
+    {
+        jpge_free(m_pBuf);
+    }
+
+    void coefficient_store::clear()
+    {
+        m_len = 0;
+        m_failed = false;
+    }
+
+    void coefficient_store::begin(int width, int height, const params &comp_params, const uint8 * const *pQuant)
+    {
+        clear();
+        m_width = width;
+        m_height = height;
+        m_params = comp_params;
+        memcpy(m_quant[0], pQuant[0], 64);
+        memcpy(m_quant[1], pQuant[1], 64);
+    }
+
+    void coefficient_store::add_block(const int16 *pCoeffs)
+    {
+        if (m_failed) {
+            return;
+        }
+        if (m_capacity - m_len < 1 + 64 * 3) {
+            // grow by half, without realloc so the buffer may come from PSRAM
+            uint capacity = JPGE_MAX(m_capacity + m_capacity / 2, 16384U);
+            uint8 *pBuf = static_cast<uint8*>(jpge_malloc(capacity));
+            if (!pBuf) {
+                m_failed = true;
+                return;
+            }
+            if (m_len) {
+                memcpy(pBuf, m_pBuf, m_len);
+            }
+            jpge_free(m_pBuf);
+            m_pBuf = pBuf;
+            m_capacity = capacity;
+        }
+
+        uint8 *pCount = m_pBuf + m_len++;
+        uint8 *pDst = pCount + 1;
+        *pCount = 0;
+        if (pCoeffs) {
+            for (int i = 0; i < 64; i++) {
+                if (pCoeffs[i]) {
+                    *pDst++ = static_cast<uint8>(i);
+                    *pDst++ = static_cast<uint8>(pCoeffs[i] & 0xFF);
+                    *pDst++ = static_cast<uint8>((pCoeffs[i] >> 8) & 0xFF);
+                    ++*pCount;
+                }
+            }
+        }
+        m_len = pDst - m_pBuf;
+    }
+
     bool jpeg_encoder::process_scanline(const void* pScanline)
     {
         if ((m_pass_num < 1) || (m_pass_num > 2)) {
@@ -14,6 +14,14 @@ const char* password = "xxxx";
 
 OV7725aiThinker cam;
 
+// rtsp://<ip>:8554/mjpeg/1 full size, mjpeg/2 quarter size at 5 fps for small links,
+// mjpeg/3 full size at a low quality, requantized from the mjpeg/1 encoding
+const StreamProfile profiles[] = {
+    { "1", 0, 0, 0 },  // rate controlled quality, every frame
+    { "2", 1, 40, 5 },
+    { "3", 0, 20, 0 },
+};
+
 WebServer server(80);
 WiFiServer rtspServer(8554);
 uint8_t newMACAddress[] = {0x30, 0xAE, 0xA4, 0x90, 0xDA, 0x21}; // 30-AE-A4-90-DA-20
@@ -30,7 +38,8 @@ void handle_jpg_stream(void) {
         if (!client.connected())
             break;
         response = "--frame\r\n";
-        response += "Content-Type: image/jpeg\r\n\r\n";
+        response += "Content-Type: image/jpeg\r\n";
+        response += "X-Change-Score: " + String(cam.getChangeScore()) + "\r\n\r\n";
         server.sendContent(response);
 
         client.write((char *)cam.getfb(), cam.getSize());
@@ -50,11 +59,94 @@ void handle_jpg(void) {
     }
     String response = "HTTP/1.1 200 OK\r\n";
     response += "Content-disposition: inline; filename=capture.jpg\r\n";
-    response += "Content-type: image/jpeg\r\n\r\n";
+    response += "Content-type: image/jpeg\r\n";
+    response += "X-Change-Score: " + String(cam.getChangeScore()) + "\r\n\r\n";
     server.sendContent(response);
     client.write((char *)cam.getfb(), cam.getSize());
 }
 
+// Prometheus style text for monitoring
+void handle_metrics(void) {
+    String message = "# TYPE camera_change_score gauge\n";
+    message += "camera_change_score " + String(cam.getChangeScore()) + "\n";
+    message += "# TYPE camera_changed_blocks gauge\n";
+    message += "camera_changed_blocks " + String(cam.getChangedBlocks()) + "\n";
+    message += "# TYPE camera_unchanged_frames_total counter\n";
+    message += "camera_unchanged_frames_total " + String(cam.getUnchangedFrames()) + "\n";
+    message += "# TYPE camera_frames_total counter\n";
+    message += "camera_frames_total " + String(cam.getFrameSeq()) + "\n";
+    message += "# TYPE camera_bitrate gauge\n";
+    message += "camera_bitrate " + String(cam.getBitrate()) + "\n";
+    message += "# TYPE camera_jpeg_quality gauge\n";
+    message += "camera_jpeg_quality " + String(cam.getQuality()) + "\n";
+    message += "# TYPE camera_reused_blocks gauge\n";
+    message += "camera_reused_blocks " + String(cam.getReusedBlocks(NULL)) + "\n";
+    server.send(200, "text/plain; version=0.0.4", message);
+}
+
+// Writes pre-event frames as the parts of a multipart download
+class MultipartSink : public FrameSink
+{
+public:
+    MultipartSink(WiFiClient &client) : _client(client) {}
+    bool putFrame(const uint8_t *data, size_t len, uint64_t timestamp) {
+        String part = "--frame\r\n";
+        part += "Content-Type: image/jpeg\r\n";
+        part += "Content-Length: " + String(len) + "\r\n";
+        part += "X-Timestamp: " + String((uint32_t)(timestamp / 1000)) + "\r\n\r\n"; // ms since boot
+        _client.print(part);
+        _client.write(data, len);
+        _client.print("\r\n");
+        return _client.connected();
+    }
+
+private:
+    WiFiClient &_client;
+};
+
+struct PreEventDownload
+{
+    WiFiClient client;
+    uint64_t since;
+};
+
+// Sends from its own task so the loop keeps capturing into the ring meanwhile
+void preEventTask(void *arg) {
+    PreEventDownload *d = (PreEventDownload *)arg;
+    MultipartSink sink(d->client);
+    int frames = cam.getPreEventBuffer().snapshot(sink, d->since);
+    d->client.print("--frame--\r\n");
+    d->client.stop();
+    Serial.printf("pre-event download sent %d frames\n", frames);
+    delete d;
+    vTaskDelete(NULL);
+}
+
+// /prerecord?seconds=n downloads the last n seconds (all of the ring without it)
+void handle_prerecord(void) {
+    if (!cam.getPreEventBuffer().isReady()) {
+        server.send(503, "text/plain", "no pre-event buffer\n");
+        return;
+    }
+    PreEventDownload *d = new PreEventDownload;
+    d->client = server.client();
+    d->since = 0;
+    if (server.hasArg("seconds")) {
+        uint64_t back = (uint64_t)server.arg("seconds").toInt() * 1000000;
+        uint64_t now = usecnow();
+        d->since = now > back ? now - back : 0;
+    }
+
+    String response = "HTTP/1.1 200 OK\r\n";
+    response += "Content-disposition: attachment; filename=prerecord.mjpeg\r\n";
+    response += "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n\r\n";
+    server.sendContent(response);
+    if (xTaskCreate(preEventTask, "prerecord", 4096, d, 1, NULL) != pdPASS) {
+        d->client.stop();
+        delete d;
+    }
+}
+
 void handleNotFound() {
     String message = "Server is running!\n\n";
     message += "URI: ";
@@ -119,11 +211,17 @@ void setup() {
 
     int camInit = cam.init(esp32cam_aithinker_config);
     Serial.printf("Camera init returned %d\n", camInit);
+    cam.setProfiles(profiles, sizeof(profiles) / sizeof(profiles[0]));
+    cam.setChangeDetection(4); // RTSP streams skip frames where no block's mean moved by more than 4
+    if (!cam.setPreEventBuffer(1536 * 1024)) // the ring keeps up to 256 frames, 25 s at 10 fps
+        Serial.println("No memory for the pre-event buffer");
 
     connectWiFi();
 
     server.on("/", HTTP_GET, handle_jpg_stream);
     server.on("/jpg", HTTP_GET, handle_jpg);
+    server.on("/metrics", HTTP_GET, handle_metrics);
+    server.on("/prerecord", HTTP_GET, handle_prerecord);
     server.onNotFound(handleNotFound);
     server.begin();
 
@@ -154,45 +252,74 @@ void setup() {
     // ledc_channel_config(&ledc_channel);
 }
 
-CStreamer *streamer;
-CRtspSession *session;
-WiFiClient client; // FIXME, support multiple clients
+#define MAX_RTSP_SESSIONS 4
+#define MULTICAST_PORT 5004 // RTP, RTCP on the next port
+#define MULTICAST_TTL 1     // stay on the local network
+#define PACING_BUDGET_PERCENT 25 // of each tick all streams may spend waiting to pace packets
+IPAddress multicastGroup(239, 255, 0, 1);
+
+CStreamer *multicastStreamer; // one stream for all rtsp://.../mjpeg/multicast viewers
+CStreamer *streamers[MAX_RTSP_SESSIONS];
+CRtspSession *sessions[MAX_RTSP_SESSIONS];
+WiFiClient clients[MAX_RTSP_SESSIONS];
+
+const uint32_t msecPerFrame = 100;
 
 void loop() {
 
     server.handleClient();
 
-    uint32_t msecPerFrame = 100;
     static uint32_t lastimage = millis();
 
-    // If we have an active client connection, just service that until gone
-    // (FIXME - support multiple simultaneous clients)
-    if(session) {
-        session->handleRequests(0); // we don't use a timeout here,
-        // instead we send only if we have new enough frames
-
-        uint32_t now = millis();
-        if(now > lastimage + msecPerFrame || now < lastimage) { // handle clock rollover
-            session->broadcastCurrentFrame(now);
-            lastimage = now;
+    for(int i = 0; i < MAX_RTSP_SESSIONS; i++)
+        if(sessions[i])
+            sessions[i]->handleRequests(0); // we don't use a timeout here,
+            // instead we send only if we have new enough frames
+
+    uint32_t now = millis();
+    if(now > lastimage + msecPerFrame || now < lastimage) { // handle clock rollover
+        CStreamer::SetPacingBudget(msecPerFrame * 1000 * PACING_BUDGET_PERCENT / 100);
+        for(int i = 0; i < MAX_RTSP_SESSIONS; i++)
+            if(sessions[i])
+                sessions[i]->broadcastCurrentFrame(now);
+        // sent once however many sessions watch it
+        if(multicastStreamer && multicastStreamer->GetViewers())
+            multicastStreamer->streamImage(now);
+        // keep the pre-event buffer filling when nobody watches, shares the streams' capture otherwise.
+        // Unchanged frames are only encoded for it once every maxIdleMs.
+        cam.recordPreEvent(now);
+        lastimage = now;
+
+        // check if we are overrunning our max frame rate
+        now = millis();
+        printf("time between frame %d ms\n", now - lastimage);
+    }
 
-            // check if we are overrunning our max frame rate
-            now = millis();
-            printf("time between frame %d ms\n", now - lastimage);
+    int freeSlot = -1;
+    for(int i = 0; i < MAX_RTSP_SESSIONS; i++) {
+        if(sessions[i] && sessions[i]->m_stopped) {
+            delete sessions[i];
+            delete streamers[i];
+            sessions[i] = NULL;
+            streamers[i] = NULL;
         }
+        if(!sessions[i])
+            freeSlot = i;
+    }
 
-        if(session->m_stopped) {
-            delete session;
-            delete streamer;
-            session = NULL;
-            streamer = NULL;
-        }
-    } else {
+    if(freeSlot >= 0) {
+        WiFiClient &client = clients[freeSlot];
         client = rtspServer.accept();
 
         if(client) {
-            streamer = new OV7725Streamer(&client, cam);             // our streamer for UDP/TCP based RTP transport
-            session = new CRtspSession(&client, streamer); // our threads RTSP session and state
+            if(!multicastStreamer) { // joined once the network is up
+                multicastStreamer = new OV7725Streamer(NULL, cam);
+                multicastStreamer->SetFrameRate(1000 / msecPerFrame);
+                multicastStreamer->InitMulticast(multicastGroup, MULTICAST_PORT, MULTICAST_TTL);
+            }
+            streamers[freeSlot] = new OV7725Streamer(&client, cam);             // our streamer for UDP/TCP based RTP transport
+            streamers[freeSlot]->SetFrameRate(1000 / msecPerFrame);
+            sessions[freeSlot] = new CRtspSession(&client, streamers[freeSlot], multicastStreamer); // our threads RTSP session and state
         }
     }
 }
@@ -40,6 +40,9 @@
 static const char* TAG = "to_jpg";
 #endif
 
+//output is handed to the stream in chunks of this size, unless the stream takes direct writes
+#define JPG_OUT_CHUNK_SIZE 2048
+
 static void *_malloc(size_t size)
 {
     void * res = malloc(size);
@@ -94,14 +97,72 @@ static IRAM_ATTR void convert_line_format(uint8_t * src, pixformat_t format, uin
     }
 }
 
-bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpge::output_stream *dst_stream)
+//box filter 1 << shift source lines and pixels into each output pixel, so smaller stream
+//profiles are encoded from a smaller image. line holds a source line, sums an output line
+static void downscale_line(uint8_t * src, pixformat_t format, uint8_t * line, uint16_t * sums, size_t width, size_t channels, size_t out_line, uint8_t shift)
 {
+    size_t n = 1 << shift;
+    size_t out_len = (width >> shift) * channels;
+
+    memset(sums, 0, out_len * sizeof(uint16_t));
+    for(size_t k = 0; k < n; k++) {
+        convert_line_format(src, format, line, width, channels, (out_line << shift) + k);
+        const uint8_t * p = line;
+        for(size_t o = 0; o < out_len; o += channels) {
+            for(size_t x = 0; x < n; x++) {
+                for(size_t c = 0; c < channels; c++) {
+                    sums[o + c] += *p++;
+                }
+            }
+        }
+    }
+    for(size_t o = 0; o < out_len; o++) {
+        line[o] = sums[o] >> (2 * shift);
+    }
+}
+
+//thumbnail pixels the encoder makes from its DCT coefficients while encoding the full image
+typedef struct {
+    uint8_t shift;
+    uint8_t * buf;
+    uint16_t width;
+    uint16_t height;
+    uint16_t stride;
+    uint8_t channels;
+} thumb_pixels_t;
+
+//quantized coefficients of the last image encoded with them kept, for requantizing to other qualities
+struct jpg_coeffs_s {
+    jpge::coefficient_store store;
+};
+
+//coded blocks of the last frame, for reusing where the next one didn't change
+struct jpg_block_cache_s {
+    jpge::block_cache cache;
+};
+
+//what the encoder should make or keep besides the image, any may be NULL
+typedef struct {
+    thumb_pixels_t * thumb;
+    jpg_coeffs_t * coeffs;
+    jpg_block_cache_t * cache;
+    uint8_t tolerance;
+} encode_extras_t;
+
+bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpge::output_stream *dst_stream, bool flat_chroma = false, uint8_t scale_shift = 0, const encode_extras_t * extras = NULL)
+{
+    thumb_pixels_t * thumb = extras ? extras->thumb : NULL;
+    jpg_coeffs_t * coeffs = extras ? extras->coeffs : NULL;
+    jpg_block_cache_t * cache = extras ? extras->cache : NULL;
+
     int num_channels = 3;
     jpge::subsampling_t subsampling = jpge::H2V2;
 
     if(format == PIXFORMAT_GRAYSCALE) {
         num_channels = 1;
-        subsampling = jpge::Y_ONLY;
+        if(!flat_chroma) {
+            subsampling = jpge::Y_ONLY;
+        }
     }
 
     if(!quality) {
@@ -113,28 +174,82 @@ bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t fo
     jpge::params comp_params = jpge::params();
     comp_params.m_subsampling = subsampling;
     comp_params.m_quality = quality;
+    comp_params.m_flat_chroma = flat_chroma;
+    comp_params.m_out_buf_size = JPG_OUT_CHUNK_SIZE;
+
+    if(scale_shift > 3) {
+        scale_shift = 3; //sums of 64 pixels still fit 16 bits
+    }
+    uint16_t out_width = width >> scale_shift;
+    uint16_t out_height = height >> scale_shift;
 
     jpge::jpeg_encoder dst_image;
 
-    if (!dst_image.init(dst_stream, width, height, num_channels, comp_params)) {
+    if (!dst_image.init(dst_stream, out_width, out_height, num_channels, comp_params)) {
         ESP_LOGE(TAG, "JPG encoder init failed");
         return false;
     }
 
+    if(thumb) {
+        thumb->buf = (uint8_t*)_malloc(dst_image.get_thumbnail_size(thumb->shift));
+        if(!thumb->buf || !dst_image.set_thumbnail(thumb->buf, thumb->shift)) {
+            ESP_LOGE(TAG, "Thumbnail setup failed");
+            return false;
+        }
+        thumb->width = dst_image.get_thumbnail_width();
+        thumb->height = dst_image.get_thumbnail_height();
+        thumb->stride = dst_image.get_thumbnail_stride();
+        thumb->channels = dst_image.get_thumbnail_channels();
+    }
+
+    if(coeffs) {
+        dst_image.set_coefficient_store(&coeffs->store);
+    }
+
+    if(cache && !dst_image.set_block_cache(&cache->cache, extras->tolerance)) {
+        ESP_LOGW(TAG, "Block cache unavailable, encoding all blocks");
+    }
+
+    if(format == PIXFORMAT_GRAYSCALE && !scale_shift) {
+        //the frame buffer already holds the luma plane, encode it in place
+        if (!dst_image.process_y_image(src)) {
+            ESP_LOGE(TAG, "JPG grayscale encode failed");
+            return false;
+        }
+        dst_image.deinit();
+        return true;
+    }
+
     uint8_t* line = (uint8_t*)_malloc(width * num_channels);
     if(!line) {
         ESP_LOGE(TAG, "Scan line malloc failed");
         return false;
     }
 
-    for (int i = 0; i < height; i++) {
-        convert_line_format(src, format, line, width, num_channels, i);
+    uint16_t* sums = NULL;
+    if(scale_shift) {
+        sums = (uint16_t*)_malloc(out_width * num_channels * sizeof(uint16_t));
+        if(!sums) {
+            ESP_LOGE(TAG, "Downscale line malloc failed");
+            free(line);
+            return false;
+        }
+    }
+
+    for (int i = 0; i < out_height; i++) {
+        if(scale_shift) {
+            downscale_line(src, format, line, sums, width, num_channels, i, scale_shift);
+        } else {
+            convert_line_format(src, format, line, width, num_channels, i);
+        }
         if (!dst_image.process_scanline(line)) {
             ESP_LOGE(TAG, "JPG process line %u failed", i);
+            free(sums);
             free(line);
             return false;
         }
     }
+    free(sums);
     free(line);
 
     if (!dst_image.process_scanline(NULL)) {
@@ -182,9 +297,10 @@ class memory_stream : public jpge::output_stream {
 protected:
     uint8_t *out_buf;
     size_t max_len, index;
+    bool overflow;
 
 public:
-    memory_stream(void *pBuf, uint buf_size) : out_buf(static_cast<uint8_t*>(pBuf)), max_len(buf_size), index(0) { }
+    memory_stream(void *pBuf, uint buf_size) : out_buf(static_cast<uint8_t*>(pBuf)), max_len(buf_size), index(0), overflow(false) { }
 
     virtual ~memory_stream() { }
 
@@ -195,23 +311,39 @@ public:
             return true;
         }
         if ((size_t)len > (max_len - index)) {
+            //a truncated image is no use to anyone, fail the encode
             ESP_LOGW(TAG, "JPG output overflow: %d bytes", len - (max_len - index));
-            len = max_len - index;
+            overflow = true;
+            return false;
         }
         if (len) {
-            memcpy(out_buf + index, pBuf, len);
+            if (pBuf != out_buf + index) {
+                memcpy(out_buf + index, pBuf, len);
+            }
             index += len;
         }
         return true;
     }
 
+    //let the encoder write straight into the output buffer
+    virtual uint8_t *get_direct_buf(uint *len)
+    {
+        *len = max_len - index;
+        return out_buf + index;
+    }
+
     virtual size_t get_size() const
     {
         return index;
     }
+
+    bool overflowed() const
+    {
+        return overflow;
+    }
 };
 
-bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len)
+static bool fmt2jpg_mem(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len, bool flat_chroma, uint8_t scale_shift = 0, const encode_extras_t * extras = NULL)
 {
     //todo: allocate proper buffer for holding JPEG data
     //this should be enough for CIF frame size
@@ -225,7 +357,7 @@ bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixf
     }
     memory_stream dst_stream(jpg_buf, jpg_buf_len);
 
-    if(!convert_image(src, width, height, format, quality, &dst_stream)) {
+    if(!convert_image(src, width, height, format, quality, &dst_stream, flat_chroma, scale_shift, extras)) {
         free(jpg_buf);
         return false;
     }
@@ -235,7 +367,152 @@ bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixf
     return true;
 }
 
+bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+    return fmt2jpg_mem(src, src_len, width, height, format, quality, out, out_len, false);
+}
+
 bool frame2jpg(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len)
 {
     return fmt2jpg(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len);
 }
+
+bool frame2jpg_rtp(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+    return frame2jpg_rtp_scaled(fb, quality, 0, out, out_len);
+}
+
+bool frame2jpg_rtp_scaled(camera_fb_t * fb, uint8_t quality, uint8_t scale_shift, uint8_t ** out, size_t * out_len)
+{
+    return fmt2jpg_mem(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len, fb->format == PIXFORMAT_GRAYSCALE, scale_shift);
+}
+
+jpg_coeffs_t * jpg_coeffs_new(void)
+{
+    return new jpg_coeffs_t;
+}
+
+void jpg_coeffs_free(jpg_coeffs_t * coeffs)
+{
+    delete coeffs;
+}
+
+bool frame2jpg_rtp_coeffs(camera_fb_t * fb, uint8_t quality, jpg_coeffs_t * coeffs, uint8_t ** out, size_t * out_len)
+{
+    encode_extras_t extras = {};
+    extras.coeffs = coeffs;
+    return fmt2jpg_mem(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len, fb->format == PIXFORMAT_GRAYSCALE, 0, &extras);
+}
+
+bool coeffs2jpg(jpg_coeffs_t * coeffs, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+    if(!coeffs->store.is_valid()) {
+        ESP_LOGE(TAG, "No coefficients to transcode");
+        return false;
+    }
+    if(!quality) {
+        quality = 1;
+    } else if(quality > 100) {
+        quality = 100;
+    }
+
+    //a stored coefficient takes 3 bytes, coded it rarely takes more, and requantizing only drops some.
+    //When it does take more the buffer is grown and the image coded again.
+    size_t jpg_buf_len = coeffs->store.get_size() + coeffs->store.get_size() / 4 + 1024;
+    for(;;) {
+        uint8_t * jpg_buf = (uint8_t *)_malloc(jpg_buf_len);
+        if(jpg_buf == NULL) {
+            ESP_LOGE(TAG, "JPG buffer malloc failed");
+            return false;
+        }
+        memory_stream dst_stream(jpg_buf, jpg_buf_len);
+
+        jpge::jpeg_encoder dst_image;
+        if(dst_image.transcode(&dst_stream, coeffs->store, quality)) {
+            *out = jpg_buf;
+            *out_len = dst_stream.get_size();
+            return true;
+        }
+        free(jpg_buf);
+        if(!dst_stream.overflowed()) {
+            ESP_LOGE(TAG, "JPG transcode failed");
+            return false;
+        }
+        jpg_buf_len *= 2;
+    }
+}
+
+jpg_block_cache_t * jpg_block_cache_new(void)
+{
+    return new jpg_block_cache_t;
+}
+
+void jpg_block_cache_free(jpg_block_cache_t * cache)
+{
+    delete cache;
+}
+
+size_t jpg_block_cache_reused(jpg_block_cache_t * cache, size_t * blocks)
+{
+    if(blocks) {
+        *blocks = cache->cache.get_blocks();
+    }
+    return cache->cache.get_reused();
+}
+
+bool frame2jpg_rtp_cached(camera_fb_t * fb, uint8_t quality, jpg_block_cache_t * cache, uint8_t tolerance, uint8_t ** out, size_t * out_len)
+{
+    encode_extras_t extras = {};
+    extras.cache = cache;
+    extras.tolerance = tolerance;
+    return fmt2jpg_mem(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len, fb->format == PIXFORMAT_GRAYSCALE, 0, &extras);
+}
+
+//the thumbnail is tiny next to the frame, encoding its pixels costs little
+static bool thumb2jpg(thumb_pixels_t * thumb, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+    jpge::params comp_params = jpge::params();
+    comp_params.m_subsampling = jpge::H2V2;
+    comp_params.m_quality = quality ? (quality > 100 ? 100 : quality) : 1;
+    comp_params.m_flat_chroma = thumb->channels == 1;
+    comp_params.m_out_buf_size = JPG_OUT_CHUNK_SIZE;
+
+    size_t jpg_buf_len = thumb->width * thumb->height * 3 + 1024;
+    uint8_t * jpg_buf = (uint8_t *)_malloc(jpg_buf_len);
+    if(jpg_buf == NULL) {
+        ESP_LOGE(TAG, "Thumbnail JPG buffer malloc failed");
+        return false;
+    }
+    memory_stream dst_stream(jpg_buf, jpg_buf_len);
+
+    jpge::jpeg_encoder dst_image;
+    bool ok = dst_image.init(&dst_stream, thumb->width, thumb->height, thumb->channels, comp_params);
+    for (int i = 0; ok && i < thumb->height; i++) {
+        ok = dst_image.process_scanline(thumb->buf + i * thumb->stride);
+    }
+    if (!ok || !dst_image.process_scanline(NULL)) {
+        ESP_LOGE(TAG, "Thumbnail JPG encode failed");
+        free(jpg_buf);
+        return false;
+    }
+
+    *out = jpg_buf;
+    *out_len = dst_stream.get_size();
+    return true;
+}
+
+bool frame2jpg_rtp_thumb(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len, uint8_t thumb_shift, uint8_t thumb_quality, uint8_t ** thumb_out, size_t * thumb_len)
+{
+    thumb_pixels_t thumb = {};
+    thumb.shift = thumb_shift;
+    encode_extras_t extras = {};
+    extras.thumb = &thumb;
+    bool ok = fmt2jpg_mem(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len, fb->format == PIXFORMAT_GRAYSCALE, 0, &extras);
+    if(ok && !thumb2jpg(&thumb, thumb_quality, thumb_out, thumb_len)) {
+        free(*out);
+        *out = NULL;
+        ok = false;
+    }
+    free(thumb.buf);
+    return ok;
+}
@@ -0,0 +1,11 @@
+// Host stand-in for FreeRTOS, for the native tests
+#pragma once
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define pdTRUE  1
+#define pdFALSE 0
@@ -0,0 +1,143 @@
+// Frame buffer queue policy, replayed against a model of the queue camera_fb_done() feeds
+#include <string.h>
+#include <unity.h>
+#include "camera_fb_queue.h"
+
+#define MAX_DEPTH 8
+
+typedef struct {
+    int frames[MAX_DEPTH];
+    size_t len;
+    size_t depth;
+    uint32_t dropped;
+    uint32_t stale;
+} fb_queue_t;
+
+static void queue_init(fb_queue_t *q, camera_fb_policy_t policy, size_t depth, size_t fb_count)
+{
+    memset(q, 0, sizeof(*q));
+    q->depth = camera_fb_queue_depth(policy, depth, fb_count);
+}
+
+// what camera_fb_done() does with a completed frame
+static void frame_done(fb_queue_t *q, camera_fb_policy_t policy, int frame)
+{
+    if (q->len == q->depth) {
+        if (!camera_fb_queue_evicts(policy)) {
+            q->dropped++;
+            return;
+        }
+        memmove(q->frames, q->frames + 1, (q->len - 1) * sizeof(int));
+        q->len--;
+        q->stale++;
+    }
+    q->frames[q->len++] = frame;
+}
+
+static int frame_get(fb_queue_t *q)
+{
+    int frame = q->frames[0];
+    memmove(q->frames, q->frames + 1, (q->len - 1) * sizeof(int));
+    q->len--;
+    return frame;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static void test_depth_leaves_a_buffer_for_capture(void)
+{
+    TEST_ASSERT_EQUAL(1, camera_fb_queue_depth(CAMERA_FB_POLICY_LATEST, 3, 4));
+    TEST_ASSERT_EQUAL(3, camera_fb_queue_depth(CAMERA_FB_POLICY_DROP_OLDEST, 0, 4));
+    TEST_ASSERT_EQUAL(3, camera_fb_queue_depth(CAMERA_FB_POLICY_FIFO, 9, 4));
+    TEST_ASSERT_EQUAL(2, camera_fb_queue_depth(CAMERA_FB_POLICY_FIFO, 2, 4));
+    TEST_ASSERT_EQUAL(1, camera_fb_queue_depth(CAMERA_FB_POLICY_DROP_OLDEST, 0, 2));
+}
+
+static void test_latest_returns_the_newest_frame(void)
+{
+    fb_queue_t q;
+    queue_init(&q, CAMERA_FB_POLICY_LATEST, 0, 3);
+    for (int i = 1; i <= 5; i++) {
+        frame_done(&q, CAMERA_FB_POLICY_LATEST, i);
+    }
+    TEST_ASSERT_EQUAL(1, q.len);
+    TEST_ASSERT_EQUAL(5, frame_get(&q));
+    TEST_ASSERT_EQUAL(4, q.stale);
+    TEST_ASSERT_EQUAL(0, q.dropped);
+}
+
+static void test_drop_oldest_keeps_the_newest_frames_in_order(void)
+{
+    fb_queue_t q;
+    queue_init(&q, CAMERA_FB_POLICY_DROP_OLDEST, 0, 4);
+    for (int i = 1; i <= 7; i++) {
+        frame_done(&q, CAMERA_FB_POLICY_DROP_OLDEST, i);
+    }
+    TEST_ASSERT_EQUAL(5, frame_get(&q));
+    TEST_ASSERT_EQUAL(6, frame_get(&q));
+    TEST_ASSERT_EQUAL(7, frame_get(&q));
+    TEST_ASSERT_EQUAL(4, q.stale);
+    TEST_ASSERT_EQUAL(0, q.dropped);
+}
+
+static void test_fifo_keeps_the_first_frames_and_drops_new_ones(void)
+{
+    fb_queue_t q;
+    queue_init(&q, CAMERA_FB_POLICY_FIFO, 2, 4);
+    for (int i = 1; i <= 5; i++) {
+        frame_done(&q, CAMERA_FB_POLICY_FIFO, i);
+    }
+    TEST_ASSERT_EQUAL(1, frame_get(&q));
+    frame_done(&q, CAMERA_FB_POLICY_FIFO, 6);
+    TEST_ASSERT_EQUAL(2, frame_get(&q));
+    TEST_ASSERT_EQUAL(6, frame_get(&q));
+    TEST_ASSERT_EQUAL(3, q.dropped);
+    TEST_ASSERT_EQUAL(0, q.stale);
+}
+
+// a consumer at a third of the capture rate gets frames in order, as fresh as the policy keeps them
+static void test_slow_consumer(void)
+{
+    static const camera_fb_policy_t policies[] = { CAMERA_FB_POLICY_LATEST, CAMERA_FB_POLICY_DROP_OLDEST, CAMERA_FB_POLICY_FIFO };
+    static const int first_taken[] = { 3, 2, 1 };
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        fb_queue_t q;
+        int last = 0;
+        queue_init(&q, policies[p], 0, 3);
+        for (int i = 1; i <= 30; i++) {
+            frame_done(&q, policies[p], i);
+            if (i % 3 == 0) {
+                int frame = frame_get(&q);
+                if (!last) {
+                    TEST_ASSERT_EQUAL(first_taken[p], frame);
+                }
+                TEST_ASSERT_GREATER_THAN(last, frame);
+                last = frame;
+            }
+        }
+        TEST_ASSERT_EQUAL(30, q.dropped + q.stale + q.len + 10);
+    }
+}
+
+static void test_timeout_rounds_up_to_whole_ticks(void)
+{
+    TEST_ASSERT_EQUAL(0, camera_fb_timeout_ticks(0, 10));
+    TEST_ASSERT_EQUAL(1, camera_fb_timeout_ticks(1, 10));
+    TEST_ASSERT_EQUAL(1, camera_fb_timeout_ticks(10, 10));
+    TEST_ASSERT_EQUAL(2, camera_fb_timeout_ticks(11, 10));
+    TEST_ASSERT_EQUAL(5, camera_fb_timeout_ticks(5, 1));
+    TEST_ASSERT_EQUAL(UINT32_MAX / 10 + 1, camera_fb_timeout_ticks(UINT32_MAX, 10));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_depth_leaves_a_buffer_for_capture);
+    RUN_TEST(test_latest_returns_the_newest_frame);
+    RUN_TEST(test_drop_oldest_keeps_the_newest_frames_in_order);
+    RUN_TEST(test_fifo_keeps_the_first_frames_and_drops_new_ones);
+    RUN_TEST(test_slow_consumer);
+    RUN_TEST(test_timeout_rounds_up_to_whole_ticks);
+    return UNITY_END();
+}
@@ -0,0 +1,160 @@
+// Pre-event ring: frames come out of a snapshot whole and in order while they are pushed around the
+// arena, a snapshot outlives end(), and what the ring costs in memory and per push.
+#include <chrono>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include "FrameRing.h"
+
+#define ARENA  (1536 * 1024)
+#define PUSHES 200000
+
+static uint8_t s_frame[64 * 1024];
+
+// Sizes and contents follow from the timestamp, modulo 16 so pushes can reuse 16 made frames,
+// and a sink can check every byte
+static size_t frame_len(uint64_t ts) { return 3000 + ts % 16 * 3900; }
+
+static const uint8_t *make_frame(uint64_t ts)
+{
+    size_t len = frame_len(ts);
+    for (size_t i = 0; i < len; i++)
+        s_frame[i] = (uint8_t)(ts % 16 * 17 + i);
+    return s_frame;
+}
+
+class CheckingSink : public FrameSink
+{
+public:
+    CheckingSink() : frames(0), bad(0), last(0) {}
+    bool putFrame(const uint8_t *data, size_t len, uint64_t timestamp)
+    {
+        bool ok = len == frame_len(timestamp) && (!frames || timestamp > last);
+        for (size_t i = 0; ok && i < len; i++)
+            ok = data[i] == (uint8_t)(timestamp % 16 * 17 + i);
+        if (!ok) bad++;
+        frames++;
+        last = timestamp;
+        return true;
+    }
+    int frames, bad;
+    uint64_t last;
+};
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static void test_keeps_the_newest_frames_in_order(void)
+{
+    FrameRing ring;
+    TEST_ASSERT_TRUE(ring.begin(ARENA));
+    for (uint64_t ts = 1; ts <= 500; ts++)
+        TEST_ASSERT_TRUE(ring.push(make_frame(ts), frame_len(ts), ts));
+    TEST_ASSERT_GREATER_THAN(0, ring.getEvicted());
+    TEST_ASSERT_LESS_OR_EQUAL(ARENA, ring.getUsedBytes());
+
+    CheckingSink sink;
+    TEST_ASSERT_EQUAL(ring.getFrameCount(), ring.snapshot(sink));
+    TEST_ASSERT_EQUAL(0, sink.bad);
+    TEST_ASSERT_EQUAL(500, sink.last);
+    TEST_ASSERT_EQUAL(500 - (ring.getFrameCount() - 1), 500 - ring.getDuration());
+
+    CheckingSink recent;
+    TEST_ASSERT_EQUAL(11, ring.snapshot(recent, 490));
+    TEST_ASSERT_FALSE(ring.push(s_frame, ARENA + 1, 501)); // can never fit
+}
+
+// Frees the ring after the first frame, as setPreEventBuffer(0) can while a download runs,
+// then starts it over with other frames that must not be sent either
+class EndingSink : public CheckingSink
+{
+public:
+    EndingSink(FrameRing &ring) : ring(ring) {}
+    bool putFrame(const uint8_t *data, size_t len, uint64_t timestamp)
+    {
+        if (!frames) {
+            ring.end();
+            ring.begin(ARENA);
+            for (uint64_t ts = 1000; ts < 1010; ts++)
+                ring.push(make_frame(ts), frame_len(ts), ts);
+        }
+        return CheckingSink::putFrame(data, len, timestamp);
+    }
+    FrameRing &ring;
+};
+
+static void test_end_during_snapshot(void)
+{
+    FrameRing ring;
+    TEST_ASSERT_TRUE(ring.begin(ARENA));
+    for (uint64_t ts = 1; ts <= 10; ts++)
+        ring.push(make_frame(ts), frame_len(ts), ts);
+
+    EndingSink sink(ring);
+    TEST_ASSERT_EQUAL(1, ring.snapshot(sink));
+    TEST_ASSERT_EQUAL(0, sink.bad);
+    TEST_ASSERT_EQUAL(10, ring.getFrameCount());
+}
+
+struct Snapshotter
+{
+    FrameRing *ring;
+    volatile bool stop;
+    int snapshots, frames, bad;
+};
+
+static void *snapshot_loop(void *arg)
+{
+    Snapshotter *s = (Snapshotter *)arg;
+    while (!s->stop) {
+        CheckingSink sink;
+        s->ring->snapshot(sink);
+        s->snapshots++;
+        s->frames += sink.frames;
+        s->bad += sink.bad;
+    }
+    return NULL;
+}
+
+// Pushes while another thread keeps taking snapshots, timing the pushes
+static void test_push_cost_with_concurrent_snapshots(void)
+{
+    static uint8_t frames[16][64 * 1024];
+    for (int i = 0; i < 16; i++)
+        memcpy(frames[i], make_frame(i), frame_len(i));
+
+    FrameRing ring;
+    TEST_ASSERT_TRUE(ring.begin(ARENA));
+    Snapshotter s = { &ring, false, 0, 0, 0 };
+    pthread_t thread;
+    pthread_create(&thread, NULL, snapshot_loop, &s);
+
+    size_t bytes = 0, lost = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t ts = 0; ts < PUSHES; ts++) {
+        ring.push(frames[ts % 16], frame_len(ts % 16), ts);
+        bytes += frame_len(ts % 16);
+        lost += ARENA - ring.getUsedBytes();
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / PUSHES;
+    s.stop = true;
+    pthread_join(thread, NULL);
+
+    TEST_ASSERT_GREATER_THAN(0, s.snapshots);
+    TEST_ASSERT_EQUAL(0, s.bad);
+
+    char msg[160];
+    snprintf(msg, sizeof(msg), "%u bytes of index and state, %.2f us/push of %u bytes on average, %.1f%% of the arena unused, %d snapshots",
+             (unsigned)sizeof(FrameRing), us, (unsigned)(bytes / PUSHES), 100.0 * lost / PUSHES / ARENA, s.snapshots);
+    TEST_MESSAGE(msg);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_keeps_the_newest_frames_in_order);
+    RUN_TEST(test_end_during_snapshot);
+    RUN_TEST(test_push_cost_with_concurrent_snapshots);
+    return UNITY_END();
+}
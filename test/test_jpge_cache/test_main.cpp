@@ -0,0 +1,142 @@
+// Conditional replenishment: a block is only reused when its samples are within the tolerance of
+// those its bits were coded from, so moving content is coded afresh however little it moved, and
+// at tolerance 0 a frame coded with the cache comes out as it would without.
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "jpge.h"
+
+#define WIDTH  320
+#define HEIGHT 240
+#define RUNS   20
+
+class memory_stream : public jpge::output_stream
+{
+public:
+    memory_stream() : m_len(0) {}
+    bool put_buf(const void *buf, int len)
+    {
+        if (m_len + len > sizeof(m_buf)) return false;
+        memcpy(m_buf + m_len, buf, len);
+        m_len += len;
+        return true;
+    }
+    jpge::uint get_size() const { return m_len; }
+    const jpge::uint8 *get_buf() const { return m_buf; }
+
+private:
+    jpge::uint8 m_buf[WIDTH * HEIGHT * 3];
+    jpge::uint m_len;
+};
+
+static jpge::uint8 s_image[WIDTH * HEIGHT * 3];
+
+// Thin horizontal lines every 8 rows, starting at row offset
+static void make_lines(int offset)
+{
+    for (int y = 0; y < HEIGHT; y++)
+        for (int x = 0; x < WIDTH; x++)
+            for (int c = 0; c < 3; c++)
+                s_image[(y * WIDTH + x) * 3 + c] = ((y - offset) % 8 == 2) ? 220 : 40 + x / 4 + c * 20;
+}
+
+// Adds -1, 0 or +1 to every sample of a mid grey gradient
+static void make_noisy(unsigned seed)
+{
+    for (int i = 0; i < WIDTH * HEIGHT * 3; i++) {
+        seed = seed * 1103515245 + 12345;
+        s_image[i] = 64 + (i / 3) % WIDTH / 3 + (int)((seed >> 16) % 3) - 1;
+    }
+}
+
+static bool encode(memory_stream &out, jpge::block_cache *cache, int tolerance)
+{
+    jpge::params params;
+    params.m_quality = 60;
+    params.m_subsampling = jpge::H2V2;
+    jpge::jpeg_encoder enc;
+    if (!enc.init(&out, WIDTH, HEIGHT, 3, params)) return false;
+    if (cache && !enc.set_block_cache(cache, tolerance)) return false;
+    for (int y = 0; y < HEIGHT; y++)
+        if (!enc.process_scanline(s_image + y * WIDTH * 3)) return false;
+    return enc.process_scanline(NULL);
+}
+
+static void assert_same_as_fresh(const memory_stream &cached)
+{
+    memory_stream fresh;
+    TEST_ASSERT_TRUE(encode(fresh, NULL, 0));
+    TEST_ASSERT_EQUAL(fresh.get_size(), cached.get_size());
+    TEST_ASSERT_EQUAL_MEMORY(fresh.get_buf(), cached.get_buf(), fresh.get_size());
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+// Every line moves within its blocks, leaving each quadrant's sum as it was. Only the chroma blocks
+// stay, a line moving within a pair of rows averages to the same subsampled chroma.
+static void test_one_pixel_shift_codes_luma_again(void)
+{
+    jpge::block_cache cache;
+    memory_stream first, second;
+    make_lines(0);
+    TEST_ASSERT_TRUE(encode(first, &cache, 0));
+    make_lines(1);
+    TEST_ASSERT_TRUE(encode(second, &cache, 0));
+    TEST_ASSERT_EQUAL(cache.get_blocks() / 3, cache.get_reused()); // 4 luma and 2 chroma blocks per MCU
+    assert_same_as_fresh(second);
+}
+
+static void test_unchanged_frame_reuses_everything(void)
+{
+    jpge::block_cache cache;
+    make_lines(3);
+    memory_stream first;
+    TEST_ASSERT_TRUE(encode(first, &cache, 0));
+
+    double ms[2];
+    for (int cached = 0; cached < 2; cached++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < RUNS; r++) {
+            memory_stream scratch;
+            encode(scratch, cached ? &cache : NULL, 0);
+        }
+        ms[cached] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / RUNS;
+    }
+    memory_stream second;
+    TEST_ASSERT_TRUE(encode(second, &cache, 0));
+    TEST_ASSERT_EQUAL(cache.get_blocks(), cache.get_reused());
+    assert_same_as_fresh(second);
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "fresh %.2f ms, from the cache %.2f ms", ms[0], ms[1]);
+    TEST_MESSAGE(msg);
+}
+
+// Sensor noise of a level stays under a tolerance of 2, not under an exact compare
+static void test_tolerance_covers_noise(void)
+{
+    for (int tolerance = 0; tolerance <= 2; tolerance += 2) {
+        jpge::block_cache cache;
+        memory_stream first, second;
+        make_noisy(1);
+        TEST_ASSERT_TRUE(encode(first, &cache, tolerance));
+        make_noisy(2);
+        TEST_ASSERT_TRUE(encode(second, &cache, tolerance));
+        if (tolerance)
+            TEST_ASSERT_EQUAL(cache.get_blocks(), cache.get_reused());
+        else
+            TEST_ASSERT_LESS_THAN(cache.get_blocks() / 10, cache.get_reused());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_one_pixel_shift_codes_luma_again);
+    RUN_TEST(test_unchanged_frame_reuses_everything);
+    RUN_TEST(test_tolerance_covers_noise);
+    return UNITY_END();
+}
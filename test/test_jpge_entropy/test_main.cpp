@@ -0,0 +1,132 @@
+// Entropy coding benchmark: the same frame size encoded from content that leaves few or many
+// coefficients, so the difference in time is mostly Huffman coding and bit output.
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "jpge.h"
+
+#define WIDTH  640
+#define HEIGHT 480
+#define RUNS   20
+
+class memory_stream : public jpge::output_stream
+{
+public:
+    memory_stream(jpge::uint size) : m_size(size), m_len(0) { m_buf = (jpge::uint8 *)malloc(size); }
+    ~memory_stream() { free(m_buf); }
+    bool put_buf(const void *buf, int len)
+    {
+        if (m_len + len > m_size) return false;
+        memcpy(m_buf + m_len, buf, len);
+        m_len += len;
+        return true;
+    }
+    jpge::uint get_size() const { return m_len; }
+    void rewind() { m_len = 0; }
+    const jpge::uint8 *data() const { return m_buf; }
+
+private:
+    jpge::uint8 *m_buf;
+    jpge::uint m_size, m_len;
+};
+
+static jpge::uint8 s_smooth[WIDTH * HEIGHT * 3];
+static jpge::uint8 s_noisy[WIDTH * HEIGHT * 3];
+
+static void make_images()
+{
+    unsigned seed = 1;
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        int x = i % WIDTH, y = i / WIDTH;
+        s_smooth[i * 3 + 0] = x * 255 / WIDTH;
+        s_smooth[i * 3 + 1] = y * 255 / HEIGHT;
+        s_smooth[i * 3 + 2] = (x + y) * 255 / (WIDTH + HEIGHT);
+        for (int c = 0; c < 3; c++) {
+            seed = seed * 1103515245 + 12345;
+            s_noisy[i * 3 + c] = s_smooth[i * 3 + c] / 2 + ((seed >> 16) & 127);
+        }
+    }
+}
+
+static bool encode(memory_stream &out, const jpge::uint8 *image, int quality)
+{
+    jpge::params params;
+    params.m_quality = quality;
+    params.m_subsampling = jpge::H2V2;
+    jpge::jpeg_encoder enc;
+    out.rewind();
+    if (!enc.init(&out, WIDTH, HEIGHT, 3, params)) return false;
+    for (int y = 0; y < HEIGHT; y++)
+        if (!enc.process_scanline(image + y * WIDTH * 3)) return false;
+    return enc.process_scanline(NULL);
+}
+
+// Every 0xFF in the entropy coded data must be stuffed with a 0x00
+static void check_stuffing(const memory_stream &out)
+{
+    const jpge::uint8 *p = out.data();
+    jpge::uint len = out.get_size(), i = 2;
+    while (i + 4 <= len && !(p[i] == 0xFF && p[i + 1] == 0xDA))
+        i += 2 + (p[i + 2] << 8 | p[i + 3]);
+    TEST_ASSERT_TRUE(i + 4 <= len);
+    for (i += 2 + (p[i + 2] << 8 | p[i + 3]); i < len - 2; i++)
+        if (p[i] == 0xFF)
+            TEST_ASSERT_EQUAL_HEX8(0x00, p[++i]);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, p[len - 2]);
+    TEST_ASSERT_EQUAL_HEX8(0xD9, p[len - 1]);
+}
+
+static void bench(const char *name, const jpge::uint8 *image, int quality)
+{
+    memory_stream out(WIDTH * HEIGHT * 3);
+    TEST_ASSERT_TRUE(encode(out, image, quality));
+    check_stuffing(out);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < RUNS; i++)
+        encode(out, image, quality);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / RUNS;
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%s q%d: %u bytes, %.2f ms/frame, %.1f Mbit/s coded",
+             name, quality, out.get_size(), ms, out.get_size() * 8 / ms / 1000);
+    TEST_MESSAGE(msg);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static void test_smooth(void)
+{
+    bench("smooth", s_smooth, 50);
+    bench("smooth", s_smooth, 90);
+}
+
+static void test_noisy(void)
+{
+    bench("noisy", s_noisy, 50);
+    bench("noisy", s_noisy, 90);
+}
+
+// The output must not depend on anything left over from an earlier encode
+static void test_deterministic(void)
+{
+    memory_stream a(WIDTH * HEIGHT * 3), b(WIDTH * HEIGHT * 3);
+    TEST_ASSERT_TRUE(encode(a, s_noisy, 75));
+    TEST_ASSERT_TRUE(encode(b, s_smooth, 75));
+    TEST_ASSERT_TRUE(encode(b, s_noisy, 75));
+    TEST_ASSERT_EQUAL(a.get_size(), b.get_size());
+    TEST_ASSERT_EQUAL_MEMORY(a.data(), b.data(), a.get_size());
+}
+
+int main(int argc, char **argv)
+{
+    make_images();
+    UNITY_BEGIN();
+    RUN_TEST(test_smooth);
+    RUN_TEST(test_noisy);
+    RUN_TEST(test_deterministic);
+    return UNITY_END();
+}
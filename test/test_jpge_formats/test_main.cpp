@@ -0,0 +1,134 @@
+// Per format benchmark of the row kernels: every source format and subsampling combination the
+// encoder picks a scanline converter and MCU row coder for, timed on the same 640x480 frame.
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "jpge.h"
+
+#define WIDTH  640
+#define HEIGHT 480
+#define RUNS   20
+
+class counting_stream : public jpge::output_stream
+{
+public:
+    counting_stream() : m_len(0) {}
+    bool put_buf(const void *, int len) { m_len += len; return true; }
+    jpge::uint get_size() const { return m_len; }
+
+private:
+    jpge::uint m_len;
+};
+
+struct format
+{
+    const char *name;
+    int channels;
+    jpge::subsampling_t subsampling;
+    bool flat_chroma;
+};
+
+static const format s_formats[] = {
+    { "RGB  Y_ONLY",      3, jpge::Y_ONLY, false },
+    { "RGB  H1V1",        3, jpge::H1V1,   false },
+    { "RGB  H2V1",        3, jpge::H2V1,   false },
+    { "RGB  H2V2",        3, jpge::H2V2,   false },
+    { "luma Y_ONLY",      1, jpge::Y_ONLY, false },
+    { "luma H1V1",        1, jpge::H1V1,   false },
+    { "luma H2V1",        1, jpge::H2V1,   false },
+    { "luma H2V2",        1, jpge::H2V2,   false },
+    { "luma H1V1 flat",   1, jpge::H1V1,   true },
+    { "luma H2V1 flat",   1, jpge::H2V1,   true },
+    { "luma H2V2 flat",   1, jpge::H2V2,   true },
+};
+
+static jpge::uint8 s_rgb[WIDTH * HEIGHT * 3];
+static jpge::uint8 s_luma[WIDTH * HEIGHT];
+
+static void make_images()
+{
+    unsigned seed = 7;
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        int x = i % WIDTH, y = i / WIDTH;
+        seed = seed * 1103515245 + 12345;
+        int n = (seed >> 16) & 31;
+        s_rgb[i * 3 + 0] = (x * 255 / WIDTH + n) & 255;
+        s_rgb[i * 3 + 1] = (y * 255 / HEIGHT + n) & 255;
+        s_rgb[i * 3 + 2] = ((x ^ y) + n) & 255;
+        s_luma[i] = (s_rgb[i * 3 + 0] * 77 + s_rgb[i * 3 + 1] * 150 + s_rgb[i * 3 + 2] * 29) >> 8;
+    }
+}
+
+static jpge::uint encode(const format &f)
+{
+    jpge::params params;
+    params.m_quality = 75;
+    params.m_subsampling = f.subsampling;
+    params.m_flat_chroma = f.flat_chroma;
+    counting_stream out;
+    jpge::jpeg_encoder enc;
+    const jpge::uint8 *image = f.channels == 3 ? s_rgb : s_luma;
+    if (!enc.init(&out, WIDTH, HEIGHT, f.channels, params)) return 0;
+    for (int y = 0; y < HEIGHT; y++)
+        if (!enc.process_scanline(image + y * WIDTH * f.channels)) return 0;
+    return enc.process_scanline(NULL) ? out.get_size() : 0;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static void test_formats(void)
+{
+    for (size_t i = 0; i < sizeof(s_formats) / sizeof(s_formats[0]); i++) {
+        const format &f = s_formats[i];
+        jpge::uint size = encode(f);
+        TEST_ASSERT_GREATER_THAN(0, size);
+
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < RUNS; r++)
+            encode(f);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / RUNS;
+
+        char msg[96];
+        snprintf(msg, sizeof(msg), "%-16s %7u bytes %6.2f ms/frame", f.name, size, ms);
+        TEST_MESSAGE(msg);
+    }
+}
+
+// Luma read in place, without going through the MCU line buffer
+static void test_y_image(void)
+{
+    jpge::params params;
+    params.m_quality = 75;
+    params.m_subsampling = jpge::H2V2;
+    params.m_flat_chroma = true;
+
+    counting_stream whole;
+    jpge::jpeg_encoder enc;
+    TEST_ASSERT_TRUE(enc.init(&whole, WIDTH, HEIGHT, 1, params));
+    TEST_ASSERT_TRUE(enc.process_y_image(s_luma));
+    TEST_ASSERT_EQUAL(encode(s_formats[10]), whole.get_size());
+
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < RUNS; r++) {
+        counting_stream out;
+        enc.init(&out, WIDTH, HEIGHT, 1, params);
+        enc.process_y_image(s_luma);
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / RUNS;
+
+    char msg[96];
+    snprintf(msg, sizeof(msg), "%-16s %7u bytes %6.2f ms/frame", "luma in place", whole.get_size(), ms);
+    TEST_MESSAGE(msg);
+}
+
+int main(int argc, char **argv)
+{
+    make_images();
+    UNITY_BEGIN();
+    RUN_TEST(test_formats);
+    RUN_TEST(test_y_image);
+    return UNITY_END();
+}
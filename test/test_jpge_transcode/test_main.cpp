@@ -0,0 +1,119 @@
+// Transcoding kept coefficients to lower qualities: a tier must not come out bigger than encoding
+// the frame directly at its quality, and a stream that runs out of room must fail the transcode.
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "jpge.h"
+
+#define WIDTH  640
+#define HEIGHT 480
+#define RUNS   20
+
+class memory_stream : public jpge::output_stream
+{
+public:
+    memory_stream(jpge::uint size) : m_size(size), m_len(0) { m_buf = (jpge::uint8 *)malloc(size); }
+    ~memory_stream() { free(m_buf); }
+    bool put_buf(const void *buf, int len)
+    {
+        if (m_len + len > m_size) return false;
+        memcpy(m_buf + m_len, buf, len);
+        m_len += len;
+        return true;
+    }
+    jpge::uint get_size() const { return m_len; }
+
+private:
+    jpge::uint8 *m_buf;
+    jpge::uint m_size, m_len;
+};
+
+static jpge::uint8 s_image[WIDTH * HEIGHT * 3];
+
+static void make_image()
+{
+    unsigned seed = 11;
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        int x = i % WIDTH, y = i / WIDTH;
+        for (int c = 0; c < 3; c++) {
+            seed = seed * 1103515245 + 12345;
+            s_image[i * 3 + c] = ((x * (c + 1) + y * (3 - c)) & 255) / 2 + ((seed >> 16) & 63);
+        }
+    }
+}
+
+static jpge::uint encode(int quality, jpge::coefficient_store *store)
+{
+    jpge::params params;
+    params.m_quality = quality;
+    params.m_subsampling = jpge::H2V2;
+    memory_stream out(WIDTH * HEIGHT * 3);
+    jpge::jpeg_encoder enc;
+    if (!enc.init(&out, WIDTH, HEIGHT, 3, params)) return 0;
+    if (store && !enc.set_coefficient_store(store)) return 0;
+    for (int y = 0; y < HEIGHT; y++)
+        if (!enc.process_scanline(s_image + y * WIDTH * 3)) return 0;
+    return enc.process_scanline(NULL) ? out.get_size() : 0;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static void test_tiers_are_no_bigger_than_direct_encodes(void)
+{
+    static const int tiers[] = { 75, 50, 35, 20, 10 };
+    jpge::coefficient_store store;
+    TEST_ASSERT_GREATER_THAN(0, encode(90, &store));
+    TEST_ASSERT_TRUE(store.is_valid());
+
+    for (size_t i = 0; i < sizeof(tiers) / sizeof(tiers[0]); i++) {
+        memory_stream out(WIDTH * HEIGHT * 3);
+        jpge::jpeg_encoder enc;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < RUNS; r++) {
+            memory_stream scratch(WIDTH * HEIGHT * 3);
+            enc.transcode(&scratch, store, tiers[i]);
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / RUNS;
+        TEST_ASSERT_TRUE(enc.transcode(&out, store, tiers[i]));
+        jpge::uint direct = encode(tiers[i], NULL);
+
+        char msg[96];
+        snprintf(msg, sizeof(msg), "q%d: transcoded %u bytes in %.2f ms, direct %u bytes", tiers[i], out.get_size(), ms, direct);
+        TEST_MESSAGE(msg);
+        TEST_ASSERT_LESS_OR_EQUAL(direct, out.get_size());
+    }
+}
+
+// At the stored quality the coefficients come out as they went in
+static void test_same_quality_is_unchanged(void)
+{
+    jpge::coefficient_store store;
+    jpge::uint size = encode(90, &store);
+    memory_stream out(WIDTH * HEIGHT * 3);
+    jpge::jpeg_encoder enc;
+    TEST_ASSERT_TRUE(enc.transcode(&out, store, 90));
+    TEST_ASSERT_EQUAL(size, out.get_size());
+}
+
+static void test_overflow_fails(void)
+{
+    jpge::coefficient_store store;
+    TEST_ASSERT_GREATER_THAN(0, encode(90, &store));
+
+    memory_stream small(4096);
+    jpge::jpeg_encoder enc;
+    TEST_ASSERT_FALSE(enc.transcode(&small, store, 50));
+}
+
+int main(int argc, char **argv)
+{
+    make_image();
+    UNITY_BEGIN();
+    RUN_TEST(test_tiers_are_no_bigger_than_direct_encodes);
+    RUN_TEST(test_same_quality_is_unchanged);
+    RUN_TEST(test_overflow_fails);
+    return UNITY_END();
+}
@@ -0,0 +1,153 @@
+// The shared multicast stream, received on this host through multicast loopback: RTP goes to the
+// group with the TTL the SDP announces, and reports sent to the group's RTCP port reach the streamer.
+// Needs a route for the group, the default one will do.
+#include <unity.h>
+#include "CStreamer.h"
+#include "jpge.h"
+
+#define WIDTH   160
+#define HEIGHT  120
+#define GROUP   "239.255.0.77"
+#define TTL     3
+
+class memory_stream : public jpge::output_stream
+{
+public:
+    unsigned char buf[WIDTH * HEIGHT * 3];
+    jpge::uint len;
+    memory_stream() : len(0) {}
+    bool put_buf(const void *p, int n)
+    {
+        if (len + n > sizeof(buf)) return false;
+        memcpy(buf + len, p, n);
+        len += n;
+        return true;
+    }
+    jpge::uint get_size() const { return len; }
+};
+
+static memory_stream s_jpeg;
+
+class TestStreamer : public CStreamer
+{
+public:
+    TestStreamer() : CStreamer(NULLSOCKET, WIDTH, HEIGHT) {}
+    void streamImage(uint32_t curMsec) { streamFrame(s_jpeg.buf, s_jpeg.len, curMsec); }
+};
+
+static IPPORT s_port;
+
+// A viewer's socket: joined to the group on port, reporting the TTL packets arrive with
+static int joinGroup(IPPORT port)
+{
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(s, IPPROTO_IP, IP_RECVTTL, &one, sizeof(one));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    bind(s, (sockaddr *)&addr, sizeof(addr));
+    ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = inet_addr(GROUP);
+    mreq.imr_interface.s_addr = INADDR_ANY;
+    TEST_ASSERT_EQUAL(0, setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)));
+    return s;
+}
+
+// Next datagram within a second, its TTL in *ttl
+static int receive(int s, unsigned char *buf, size_t len, int *ttl)
+{
+    timeval tv = { 1, 0 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char control[64];
+    iovec iov = { buf, len };
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int res = recvmsg(s, &msg, 0);
+    *ttl = -1;
+    for (cmsghdr *c = CMSG_FIRSTHDR(&msg); res > 0 && c; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_TTL)
+            *ttl = *(int *)CMSG_DATA(c);
+    return res;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static void test_rtp_reaches_every_viewer_with_the_announced_ttl(void)
+{
+    TestStreamer streamer;
+    streamer.SetPacing(0);
+    streamer.InitMulticast(inet_addr(GROUP), s_port, TTL);
+    TEST_ASSERT_EQUAL(TTL, streamer.GetMulticastTtl());
+    TEST_ASSERT_EQUAL(s_port, streamer.GetRtpServerPort());
+    TEST_ASSERT_EQUAL(s_port + 1, streamer.GetRtcpServerPort());
+
+    int viewers[2] = { joinGroup(s_port), joinGroup(s_port) };
+    streamer.streamImage(msecnow());
+
+    for (int v = 0; v < 2; v++) {
+        unsigned char pkt[2048];
+        int ttl;
+        int len = receive(viewers[v], pkt, sizeof(pkt), &ttl);
+        TEST_ASSERT_GREATER_THAN(12, len);
+        TEST_ASSERT_EQUAL_HEX8(0x80, pkt[0]);      // RTP version 2
+        TEST_ASSERT_EQUAL(26, pkt[1] & 0x7F);      // JPEG
+        TEST_ASSERT_EQUAL(TTL, ttl);
+        close(viewers[v]);
+    }
+}
+
+static void test_reports_to_the_group_reach_the_streamer(void)
+{
+    TestStreamer streamer;
+    streamer.SetPacing(0);
+    streamer.InitMulticast(inet_addr(GROUP), s_port, TTL);
+    TEST_ASSERT_NOT_EQUAL(0, streamer.GetRtcpSocket());
+
+    // one receiver report block about our stream, as a viewer sends it to the RTCP port of the group
+    unsigned char rr[32] = { 0x81, 201, 0, 7, 0, 0, 0xC0, 0x01, 0x13, 0xf9, 0x7e, 0x67, 10 };
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(GROUP);
+    addr.sin_port = htons(s_port + 1);
+    TEST_ASSERT_EQUAL(sizeof(rr), sendto(s, rr, sizeof(rr), 0, (sockaddr *)&addr, sizeof(addr)));
+    close(s);
+
+    for (int i = 0; i < 100 && !streamer.GetReceiverCount(); i++) {
+        usleep(10000);
+        streamer.PollRtcp();
+    }
+    TEST_ASSERT_EQUAL(1, streamer.GetReceiverCount());
+    TEST_ASSERT_EQUAL(10, streamer.GetWorstReceiver()->fractionLost);
+}
+
+int main(int argc, char **argv)
+{
+    static unsigned char rgb[WIDTH * HEIGHT * 3];
+    for (unsigned i = 0; i < sizeof(rgb); i++)
+        rgb[i] = i * 7;
+    jpge::params params;
+    params.m_subsampling = jpge::H2V1;
+    jpge::jpeg_encoder enc;
+    enc.init(&s_jpeg, WIDTH, HEIGHT, 3, params);
+    for (int y = 0; y < HEIGHT; y++)
+        enc.process_scanline(rgb + y * WIDTH * 3);
+    enc.process_scanline(NULL);
+
+    s_port = 20000 + (getpid() % 10000) * 2; // keep parallel runs apart
+
+    UNITY_BEGIN();
+    RUN_TEST(test_rtp_reaches_every_viewer_with_the_announced_ttl);
+    RUN_TEST(test_reports_to_the_group_reach_the_streamer);
+    return UNITY_END();
+}
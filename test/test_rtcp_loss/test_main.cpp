@@ -0,0 +1,253 @@
+// RTCP receiver reports over loopback: a client that drops every 4th RTP packet reports its loss
+// to the streamer next to one that claims a clean link, the streamer has to act on the lossy one.
+#include <unity.h>
+#include "CStreamer.h"
+#include "jpge.h"
+
+#define WIDTH   320
+#define HEIGHT  240
+#define LOSSY_SSRC 0x0000A001
+#define CLEAN_SSRC 0x0000B001
+
+class memory_stream : public jpge::output_stream
+{
+public:
+    unsigned char buf[WIDTH * HEIGHT * 3];
+    jpge::uint len;
+    memory_stream() : len(0) {}
+    bool put_buf(const void *p, int n)
+    {
+        if (len + n > sizeof(buf)) return false;
+        memcpy(buf + len, p, n);
+        len += n;
+        return true;
+    }
+    jpge::uint get_size() const { return len; }
+};
+
+static memory_stream s_jpeg;
+
+// Sends the same frame every time and remembers the reports it was told about
+class TestStreamer : public CStreamer
+{
+public:
+    TestStreamer(SOCKET client) : CStreamer(client, WIDTH, HEIGHT), calls(0), lastSsrc(0), lastLoss(0), otherCalls(0) {}
+    void streamImage(uint32_t curMsec) { streamFrame(s_jpeg.buf, s_jpeg.len, curMsec); }
+
+    int calls;
+    uint32_t lastSsrc;
+    uint8_t lastLoss;
+    int otherCalls; // reports passed on for a receiver other than the first one seen
+
+protected:
+    void onReceiverReport(const RtcpReceiverStats &stats)
+    {
+        if (calls && stats.ssrc != lastSsrc) otherCalls++;
+        calls++;
+        lastSsrc = stats.ssrc;
+        lastLoss = stats.fractionLost;
+    }
+};
+
+// Receives RTP, drops every dropEvery'th packet and reports like an RFC 3550 receiver
+struct LossyClient
+{
+    UDPSOCKET rtp, rtcp;
+    IPPORT rtpPort;
+    int dropEvery;
+    uint32_t sourceSsrc;
+    uint32_t received, highest, prevExpected, prevReceived;
+    bool started;
+    uint16_t base;
+};
+
+static UDPSOCKET bindAny(IPPORT *port)
+{
+    UDPSOCKET s = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(s, (sockaddr *)&addr, sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(s, (sockaddr *)&addr, &len);
+    if (port) *port = ntohs(addr.sin_port);
+    return s;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void sendReport(UDPSOCKET s, IPPORT to, uint32_t ssrc, uint32_t source, uint8_t fraction, int32_t cumulative, uint32_t highest)
+{
+    unsigned char rr[32];
+    rr[0] = 0x81; rr[1] = 201; rr[2] = 0; rr[3] = 7;
+    put32(rr + 4, ssrc);
+    put32(rr + 8, source);
+    put32(rr + 12, ((uint32_t)fraction << 24) | (cumulative & 0xFFFFFF));
+    put32(rr + 16, highest);
+    put32(rr + 20, 0);  // jitter
+    put32(rr + 24, 0);  // LSR
+    put32(rr + 28, 0);  // DLSR
+    udpsocketsend(s, rr, sizeof(rr), htonl(INADDR_LOOPBACK), to);
+}
+
+static void receive(LossyClient &c)
+{
+    unsigned char pkt[2048];
+    int len;
+    while ((len = udpsocketrecv(c.rtp, pkt, sizeof(pkt))) > 0) {
+        uint16_t seq = pkt[2] << 8 | pkt[3];
+        c.sourceSsrc = (uint32_t)pkt[8] << 24 | pkt[9] << 16 | pkt[10] << 8 | pkt[11];
+        if (!c.started) {
+            c.started = true;
+            c.base = seq;
+        }
+        uint32_t n = (uint16_t)(seq - c.base);
+        if (c.dropEvery && n % c.dropEvery == c.dropEvery - 1)
+            continue; // lost on the way
+        c.received++;
+        if (n > c.highest) c.highest = n;
+    }
+}
+
+// RFC 3550 A.3: loss since the last report in 1/256
+static void report(LossyClient &c, IPPORT to)
+{
+    uint32_t expected = c.highest + 1;
+    uint32_t expectedInterval = expected - c.prevExpected, receivedInterval = c.received - c.prevReceived;
+    int32_t lostInterval = expectedInterval - receivedInterval;
+    uint8_t fraction = (expectedInterval && lostInterval > 0) ? (lostInterval << 8) / expectedInterval : 0;
+    c.prevExpected = expected;
+    c.prevReceived = c.received;
+    sendReport(c.rtcp, to, LOSSY_SSRC, c.sourceSsrc, fraction, expected - c.received, c.base + c.highest);
+}
+
+static SOCKET s_server, s_client;
+
+void setUp(void)
+{
+    // the streamer sends UDP to the peer of its RTSP connection, so give it a loopback one
+    IPPORT port;
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listener, (sockaddr *)&addr, sizeof(addr));
+    listen(listener, 1);
+    socklen_t len = sizeof(addr);
+    getsockname(listener, (sockaddr *)&addr, &len);
+    port = addr.sin_port;
+    s_client = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_port = port;
+    connect(s_client, (sockaddr *)&addr, sizeof(addr));
+    s_server = accept(listener, NULL, NULL);
+    close(listener);
+}
+
+void tearDown(void)
+{
+    close(s_server);
+    close(s_client);
+}
+
+static void streamFrames(TestStreamer &streamer, LossyClient &lossy, UDPSOCKET clean, int frames)
+{
+    for (int i = 0; i < frames; i++) {
+        streamer.streamImage(msecnow());
+        usleep(2000);
+        receive(lossy);
+        report(lossy, streamer.GetRtcpServerPort());
+        sendReport(clean, streamer.GetRtcpServerPort(), CLEAN_SSRC, lossy.sourceSsrc, 0, 0, lossy.base + lossy.highest);
+    }
+    streamer.PollRtcp();
+}
+
+static void test_lossy_receiver_drives_adaptation(void)
+{
+    LossyClient lossy;
+    memset(&lossy, 0, sizeof(lossy));
+    IPPORT rtcpPort;
+    lossy.rtp = bindAny(&lossy.rtpPort);
+    lossy.rtcp = bindAny(&rtcpPort);
+    lossy.dropEvery = 4;
+    UDPSOCKET clean = bindAny(NULL);
+
+    TestStreamer streamer(s_server);
+    streamer.SetPacing(0);
+    streamer.InitTransport(lossy.rtpPort, rtcpPort, false);
+    TEST_ASSERT_NOT_EQUAL(0, streamer.GetRtcpServerPort());
+
+    streamFrames(streamer, lossy, clean, 10);
+
+    // both are tracked, only the lossy one is passed on however often the clean one reports
+    TEST_ASSERT_EQUAL(2, streamer.GetReceiverCount());
+    const RtcpReceiverStats *worst = streamer.GetWorstReceiver();
+    TEST_ASSERT_NOT_NULL(worst);
+    TEST_ASSERT_EQUAL_UINT32(LOSSY_SSRC, worst->ssrc);
+    TEST_ASSERT_EQUAL(10, worst->reports);
+    TEST_ASSERT_EQUAL(10, streamer.calls);
+    TEST_ASSERT_EQUAL(0, streamer.otherCalls);
+    TEST_ASSERT_EQUAL_UINT32(LOSSY_SSRC, streamer.lastSsrc);
+    TEST_ASSERT_GREATER_OR_EQUAL(56, streamer.lastLoss); // a quarter is 64/256
+    TEST_ASSERT_LESS_OR_EQUAL(72, streamer.lastLoss);
+    TEST_ASSERT_EQUAL(lossy.highest + 1 - lossy.received, worst->cumulativeLost);
+
+    // once the link is clean both tie, and the reports of just one of them are passed on
+    lossy.dropEvery = 0;
+    streamFrames(streamer, lossy, clean, 5);
+    TEST_ASSERT_EQUAL(0, streamer.GetWorstReceiver()->fractionLost);
+    TEST_ASSERT_EQUAL(15, streamer.calls);
+    TEST_ASSERT_EQUAL(0, streamer.otherCalls);
+
+    close(lossy.rtp);
+    close(lossy.rtcp);
+    close(clean);
+}
+
+// Report blocks about other sources are ignored, SR blocks count like RR ones
+static void test_report_parsing(void)
+{
+    TestStreamer streamer(s_server);
+    unsigned char sr[4 + 24 + 24 + 24];
+    memset(sr, 0, sizeof(sr));
+    sr[0] = 0x82; sr[1] = 200; sr[2] = 0; sr[3] = sizeof(sr) / 4 - 1; // SR with 2 report blocks
+    put32(sr + 4, 0xC001);
+    put32(sr + 28, 0xDEADBEEF);                  // about someone else
+    put32(sr + 32, 200u << 24);
+    put32(sr + 52, 0x13f97e67);                  // about us
+    put32(sr + 56, (30u << 24) | 5);
+    streamer.HandleRtcpPacket(sr, sizeof(sr));
+
+    TEST_ASSERT_EQUAL(1, streamer.calls);
+    TEST_ASSERT_EQUAL(30, streamer.lastLoss);
+    TEST_ASSERT_EQUAL(5, streamer.GetWorstReceiver()->cumulativeLost);
+
+    // truncated packets are dropped
+    streamer.HandleRtcpPacket(sr, 20);
+    TEST_ASSERT_EQUAL(1, streamer.calls);
+}
+
+int main(int argc, char **argv)
+{
+    // a noisy frame, so it takes a good number of packets
+    static unsigned char rgb[WIDTH * HEIGHT * 3];
+    for (unsigned i = 0, seed = 3; i < sizeof(rgb); i++)
+        rgb[i] = (seed = seed * 1103515245 + 12345) >> 24;
+    jpge::params params;
+    params.m_quality = 90;
+    params.m_subsampling = jpge::H2V1;
+    jpge::jpeg_encoder enc;
+    enc.init(&s_jpeg, WIDTH, HEIGHT, 3, params);
+    for (int y = 0; y < HEIGHT; y++)
+        enc.process_scanline(rgb + y * WIDTH * 3);
+    enc.process_scanline(NULL);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_lossy_receiver_drives_adaptation);
+    RUN_TEST(test_report_parsing);
+    return UNITY_END();
+}
@@ -0,0 +1,179 @@
+// RTSP request parsing: a corpus of requests the way common clients send them, each checked for
+// what the session needs out of it, and the parse timed over the whole corpus.
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include "RtspParser.h"
+
+#define RUNS 20000
+
+struct corpus_entry
+{
+    const char *client;
+    const char *request;
+    RTSP_CMD_TYPES cmd;
+    const char *cseq;
+    const char *suffix;
+    bool tcp;
+    bool multicast;
+    IPPORT rtpPort, rtcpPort;
+};
+
+static const corpus_entry s_corpus[] = {
+    { "VLC OPTIONS",
+      "OPTIONS rtsp://192.168.1.20:8554/mjpeg/1 RTSP/1.0\r\n"
+      "CSeq: 2\r\n"
+      "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n\r\n",
+      RTSP_OPTIONS, "2", "1", false, false, 0, 0 },
+    { "VLC DESCRIBE",
+      "DESCRIBE rtsp://192.168.1.20:8554/mjpeg/1 RTSP/1.0\r\n"
+      "CSeq: 3\r\n"
+      "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+      "Accept: application/sdp\r\n\r\n",
+      RTSP_DESCRIBE, "3", "1", false, false, 0, 0 },
+    { "VLC SETUP UDP",
+      "SETUP rtsp://192.168.1.20:8554/mjpeg/1/track1 RTSP/1.0\r\n"
+      "CSeq: 4\r\n"
+      "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+      "Transport: RTP/AVP;unicast;client_port=58832-58833\r\n\r\n",
+      RTSP_SETUP, "4", "track1", false, false, 58832, 58833 },
+    { "VLC PLAY",
+      "PLAY rtsp://192.168.1.20:8554/mjpeg/1/ RTSP/1.0\r\n"
+      "CSeq: 5\r\n"
+      "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+      "Session: -1294967296\r\n"
+      "Range: npt=0.000-\r\n\r\n",
+      RTSP_PLAY, "5", "", false, false, 0, 0 },
+    { "ffmpeg SETUP TCP",
+      "SETUP rtsp://192.168.1.20:8554/mjpeg/1/track1 RTSP/1.0\r\n"
+      "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n"
+      "CSeq: 3\r\n"
+      "User-Agent: Lavf60.3.100\r\n\r\n",
+      RTSP_SETUP, "3", "track1", true, false, 0, 0 },
+    { "ffmpeg TEARDOWN",
+      "TEARDOWN rtsp://192.168.1.20:8554/mjpeg/1/ RTSP/1.0\r\n"
+      "CSeq: 5\r\n"
+      "User-Agent: Lavf60.3.100\r\n"
+      "Session: 2147483650\r\n\r\n",
+      RTSP_TEARDOWN, "5", "", false, false, 0, 0 },
+    { "GStreamer SETUP, lower case transport",
+      "SETUP rtsp://cam.local:8554/mjpeg/2/track1 RTSP/1.0\r\n"
+      "CSeq: 3\r\n"
+      "transport: rtp/avp/tcp;unicast;interleaved=0-1\r\n"
+      "user-agent: GStreamer/1.22.0\r\n\r\n",
+      RTSP_SETUP, "3", "track1", true, false, 0, 0 },
+    { "GStreamer SETUP multicast",
+      "SETUP rtsp://cam.local:8554/mjpeg/multicast/track1 RTSP/1.0\r\n"
+      "CSeq: 3\r\n"
+      "Transport: RTP/AVP;MULTICAST;port=5004-5005\r\n\r\n",
+      RTSP_SETUP, "3", "track1", false, true, 0, 0 },
+    { "keep alive before OPTIONS",
+      "\r\n\r\nOPTIONS * RTSP/1.0\r\n"
+      "CSeq: 9\r\n\r\n",
+      RTSP_OPTIONS, "9", "*", false, false, 0, 0 },
+    { "bare LF line ends",
+      "\nGET_PARAMETER rtsp://192.168.1.20:8554/mjpeg/1/ RTSP/1.0\n"
+      "CSeq: 7\n"
+      "Session: 12345\n"
+      "Content-Length: 0\n\n",
+      RTSP_UNKNOWN, "7", "", false, false, 0, 0 },
+    { "SET_PARAMETER with body",
+      "SET_PARAMETER rtsp://192.168.1.20:8554/mjpeg/1 RTSP/1.0\r\n"
+      "CSeq: 8\r\n"
+      "Content-Type: text/parameters\r\n"
+      "Content-Length: 12\r\n\r\n"
+      "barparam: 1\n",
+      RTSP_UNKNOWN, "8", "1", false, false, 0, 0 },
+    { "one client port",
+      "SETUP rtsp://10.0.0.5/mjpeg/1/track1 RTSP/1.0\r\n"
+      "CSeq: 4\r\n"
+      "Transport: RTP/AVP/UDP;unicast;Client_Port=6970\r\n\r\n",
+      RTSP_SETUP, "4", "track1", false, false, 6970, 6971 },
+};
+
+#define CORPUS_SIZE (sizeof(s_corpus) / sizeof(s_corpus[0]))
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static void test_corpus(void)
+{
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        const corpus_entry &e = s_corpus[i];
+        RtspRequest req;
+        unsigned len = strlen(e.request);
+        TEST_ASSERT_EQUAL(len, parseRtspRequest(e.request, len, &req));
+        TEST_ASSERT_EQUAL(e.cmd, req.cmd);
+        TEST_ASSERT_TRUE(rtspViewEquals(req.cseq, e.cseq));
+        TEST_ASSERT_TRUE(rtspViewEquals(req.urlSuffix, e.suffix));
+        TEST_ASSERT_EQUAL(e.tcp, req.tcpTransport);
+        TEST_ASSERT_EQUAL(e.multicast, req.multicast);
+        TEST_ASSERT_EQUAL(e.rtpPort, req.clientRtpPort);
+        TEST_ASSERT_EQUAL(e.rtcpPort, req.clientRtcpPort);
+
+        // any shorter and it must wait for more
+        for (unsigned cut = 0; cut < len; cut++)
+            TEST_ASSERT_EQUAL(0, parseRtspRequest(e.request, cut, &req));
+    }
+}
+
+// Requests pipelined in one buffer follow each other at the returned length
+static void test_pipelined(void)
+{
+    static char buf[8192];
+    unsigned len = 0;
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        memcpy(buf + len, s_corpus[i].request, strlen(s_corpus[i].request));
+        len += strlen(s_corpus[i].request);
+    }
+
+    unsigned pos = 0;
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        RtspRequest req;
+        int used = parseRtspRequest(buf + pos, len - pos, &req);
+        TEST_ASSERT_EQUAL(strlen(s_corpus[i].request), used);
+        TEST_ASSERT_EQUAL(s_corpus[i].cmd, req.cmd);
+        pos += used;
+    }
+    TEST_ASSERT_EQUAL(len, pos);
+}
+
+static void test_not_rtsp(void)
+{
+    RtspRequest req;
+    TEST_ASSERT_EQUAL(-1, parseRtspRequest("GET / HTTP/1.1\r\n\r\n", 18, &req));
+    TEST_ASSERT_EQUAL(-1, parseRtspRequest("\r\n\r\nOPTIONS\r\n\r\n", 15, &req));
+    TEST_ASSERT_EQUAL(0, parseRtspRequest("\r\n\r\n", 4, &req)); // only keep alives so far
+}
+
+static void test_parse_speed(void)
+{
+    unsigned lens[CORPUS_SIZE];
+    for (size_t i = 0; i < CORPUS_SIZE; i++)
+        lens[i] = strlen(s_corpus[i].request);
+
+    int total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < RUNS; r++)
+        for (size_t i = 0; i < CORPUS_SIZE; i++) {
+            RtspRequest req;
+            total += parseRtspRequest(s_corpus[i].request, lens[i], &req);
+        }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (RUNS * CORPUS_SIZE);
+    TEST_ASSERT_GREATER_THAN(0, total);
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "%.0f ns/request", ns);
+    TEST_MESSAGE(msg);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_corpus);
+    RUN_TEST(test_pipelined);
+    RUN_TEST(test_not_rtsp);
+    RUN_TEST(test_parse_speed);
+    return UNITY_END();
+}
@@ -0,0 +1,210 @@
+// A client that stops reading its RTP over RTSP/TCP must not hold up the server: the server keeps
+// stepping, the client misses frames instead of getting them queued without end, the ones it gets
+// stay whole, and it is closed once it has taken nothing for RTSP_SERVER_STALL_MSEC.
+#include <chrono>
+#include <unity.h>
+#include "CRtspServer.h"
+#include "jpge.h"
+
+#define WIDTH     640
+#define HEIGHT    480
+#define MSEC_PER_FRAME 10
+
+class memory_stream : public jpge::output_stream
+{
+public:
+    unsigned char buf[WIDTH * HEIGHT * 3];
+    jpge::uint len;
+    memory_stream() : len(0) {}
+    bool put_buf(const void *p, int n)
+    {
+        if (len + n > sizeof(buf)) return false;
+        memcpy(buf + len, p, n);
+        len += n;
+        return true;
+    }
+    jpge::uint get_size() const { return len; }
+};
+
+static memory_stream s_jpeg;
+
+class TestStreamer : public CStreamer
+{
+public:
+    TestStreamer(SOCKET client) : CStreamer(client, WIDTH, HEIGHT) {}
+    void streamImage(uint32_t curMsec) { streamFrame(s_jpeg.buf, s_jpeg.len, curMsec); }
+};
+
+class TestServer : public CRtspServer
+{
+public:
+    TestServer(u_short port) : CRtspServer(port, MSEC_PER_FRAME, 4) {}
+
+protected:
+    CStreamer *NewStreamer(SOCKET aClient) { return new TestStreamer(aClient); }
+};
+
+static u_short s_port;
+
+static double stepFor(TestServer &server, int msec)
+{
+    double slowest = 0;
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(msec);
+    while (std::chrono::steady_clock::now() < end) {
+        auto start = std::chrono::steady_clock::now();
+        server.Step(MSEC_PER_FRAME);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (ms > slowest) slowest = ms;
+    }
+    return slowest;
+}
+
+// Connects with a small receive buffer, so the server's side fills up soon
+static int connectClient(u_short port)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    int size = 16 * 1024;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    TEST_ASSERT_EQUAL(0, connect(s, (sockaddr *)&addr, sizeof(addr)));
+    return s;
+}
+
+static bool readAll(int s, unsigned char *buf, size_t len)
+{
+    while (len) {
+        ssize_t res = recv(s, buf, len, 0);
+        if (res <= 0) return false;
+        buf += res;
+        len -= res;
+    }
+    return true;
+}
+
+// Reads a response up to its empty line and checks the status
+static void readResponse(int s)
+{
+    char buf[1024];
+    size_t len = 0;
+    while (len < 4 || memcmp(buf + len - 4, "\r\n\r\n", 4)) {
+        TEST_ASSERT_TRUE(len < sizeof(buf));
+        TEST_ASSERT_TRUE(readAll(s, (unsigned char *)buf + len, 1));
+        len++;
+    }
+    TEST_ASSERT_EQUAL_MEMORY("RTSP/1.0 200 OK", buf, 15);
+}
+
+static void play(int s, u_short port)
+{
+    char req[256];
+    snprintf(req, sizeof(req),
+             "SETUP rtsp://127.0.0.1:%u/mjpeg/1/ RTSP/1.0\r\nCSeq: 1\r\nTransport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n\r\n"
+             "PLAY rtsp://127.0.0.1:%u/mjpeg/1/ RTSP/1.0\r\nCSeq: 2\r\nSession: 1\r\n\r\n", port, port);
+    TEST_ASSERT_EQUAL(strlen(req), send(s, req, strlen(req), 0));
+}
+
+static unsigned char s_rx[1 << 20];
+static size_t s_rxLen;
+
+// Reads what has arrived, false if it isn't a run of whole interleaved RTP packets
+static bool readPackets(int s, int *frames)
+{
+    ssize_t res;
+    while ((res = recv(s, s_rx + s_rxLen, sizeof(s_rx) - s_rxLen, MSG_DONTWAIT)) > 0)
+        s_rxLen += res;
+
+    size_t pos = 0;
+    while (pos + 4 <= s_rxLen) {
+        const unsigned char *p = s_rx + pos;
+        unsigned len = p[2] << 8 | p[3];
+        if (p[0] != '$' || p[1] > 1) return false;
+        if (pos + 4 + len > s_rxLen) break; // the rest comes later
+        if (p[1] == 0) {
+            if ((p[4] & 0xC0) != 0x80 || (p[5] & 0x7F) != 26) return false;
+            if (p[5] & 0x80) (*frames)++; // marker on the last packet of a frame
+        }
+        pos += 4 + len;
+    }
+    memmove(s_rx, s_rx + pos, s_rxLen - pos);
+    s_rxLen -= pos;
+    return true;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static void test_slow_client_misses_frames_without_stalling_the_server(void)
+{
+    TestServer server(s_port);
+    TEST_ASSERT_TRUE(server.Start());
+
+    int s = connectClient(s_port);
+    play(s, s_port);
+    stepFor(server, 50);
+    readResponse(s);
+    readResponse(s);
+
+    // not reading at all
+    double slowest = stepFor(server, 1000);
+    char msg[96];
+    snprintf(msg, sizeof(msg), "slowest step %.1f ms, %u frames dropped", slowest, server.GetDroppedFrames());
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_LESS_THAN(50, slowest);
+    TEST_ASSERT_GREATER_THAN(50, server.GetDroppedFrames());
+    TEST_ASSERT_EQUAL(1, server.GetSessionCount());
+
+    // reading again, everything that arrives is whole and frames keep coming
+    int frames = 0;
+    bool whole = true;
+    for (int i = 0; i < 20 && whole; i++) {
+        stepFor(server, 20);
+        whole = readPackets(s, &frames);
+    }
+    TEST_ASSERT_TRUE(whole);
+    TEST_ASSERT_GREATER_THAN(2, frames);
+    TEST_ASSERT_EQUAL(1, server.GetSessionCount());
+
+    close(s);
+}
+
+static void test_stalled_client_is_closed(void)
+{
+    TestServer server(s_port + 1);
+    TEST_ASSERT_TRUE(server.Start());
+
+    int s = connectClient(s_port + 1);
+    play(s, s_port + 1);
+    stepFor(server, 50);
+    TEST_ASSERT_EQUAL(1, server.GetSessionCount());
+
+    stepFor(server, RTSP_SERVER_STALL_MSEC + 500);
+    TEST_ASSERT_EQUAL(0, server.GetSessionCount());
+    close(s);
+}
+
+int main(int argc, char **argv)
+{
+    // noisy, so a frame is a few hundred kB and a few of them fill the socket buffers
+    static unsigned char rgb[WIDTH * HEIGHT * 3];
+    for (unsigned i = 0, seed = 5; i < sizeof(rgb); i++)
+        rgb[i] = (seed = seed * 1103515245 + 12345) >> 24;
+    jpge::params params;
+    params.m_quality = 95;
+    params.m_subsampling = jpge::H2V1;
+    jpge::jpeg_encoder enc;
+    enc.init(&s_jpeg, WIDTH, HEIGHT, 3, params);
+    for (int y = 0; y < HEIGHT; y++)
+        enc.process_scanline(rgb + y * WIDTH * 3);
+    enc.process_scanline(NULL);
+
+    s_port = 30000 + (getpid() % 10000) * 2; // keep parallel runs apart
+
+    UNITY_BEGIN();
+    RUN_TEST(test_slow_client_misses_frames_without_stalling_the_server);
+    RUN_TEST(test_stalled_client_is_closed);
+    return UNITY_END();
+}